@@ -0,0 +1,679 @@
+/*
+    HTTP load generator: -c connections driven from -t threads, each thread with its own
+    epoll. Closed loop by default, every connection keeps -p requests in flight and sends
+    the next one as soon as a response is complete. With -R the requests are due at a
+    constant rate instead (open loop) and latency is taken from when a request was due,
+    not from when a free connection could send it, so a server that stalls is charged
+    for every request it held up (coordinated omission). A closed loop can't know when
+    its requests were due, there the same correction is applied afterwards with the
+    mean latency as the expected interval and the raw numbers are printed next to it.
+
+    -S adds slow clients on top of -c: they trickle their requests SLOW_CHUNK bytes every
+    -i ms and hold their connection the whole time, their requests aren't measured.
+
+    g++ -std=c++17 -O2 -I. -o loadgen bench/loadgen.cpp -lpthread
+    ./loadgen [-c connections] [-t threads] [-d seconds] [-p pipeline] [-R requests_per_s]
+              [-k 0|1] [-S slow_clients] [-i slow_interval_ms] host:port [path...]
+*/
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <deque>
+#include <string>
+#include <vector>
+#include "hdr_histogram.h"
+
+#define MAX_PIPELINE 64
+#define MAX_EVENTS 1024
+#define READ_SIZE 65536
+#define MAX_HEADER 65536
+#define SLOW_CHUNK 8
+#define RETRY_MS 10     // wait before reconnecting after a failed connect
+
+static int connections = 64;
+static int threads = 1;
+static int duration = 10;
+static int pipeline = 1;
+static double rate = 0;         // requests per second, 0 is closed loop
+static bool keep_alive = true;
+static int slow_clients = 0;
+static int slow_interval = 100;
+static sockaddr_storage server;
+static socklen_t server_len;
+static std::vector<std::string> requests;
+
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+struct client {
+    int fd;
+    bool connected;
+    bool slow;
+    uint64_t retry_at;          // 0 unless waiting to reconnect
+    int in_flight;
+    int due_head;
+    uint64_t due[MAX_PIPELINE]; // when each request in flight was due, oldest at due_head
+    int next_request;
+    std::string out;
+    size_t out_off;
+    // response being read
+    std::string head;
+    bool in_body;
+    bool until_close;           // no Content-Length, the body ends with the connection
+    uint64_t body_left;
+    bool close_after;
+    int status;
+};
+
+struct worker {
+    pthread_t thread;
+    int index;
+    int epollfd;
+    int timerfd;
+    uint64_t armed;             // what timerfd is set to
+    uint64_t end;
+    std::vector<client> clients;   // the slow ones last
+    size_t slow;
+    hdr_histogram latency;
+    uint64_t completed;
+    uint64_t slow_completed;
+    uint64_t bytes;
+    uint64_t connect_errors;
+    uint64_t io_errors;
+    uint64_t status_errors;
+    // open loop
+    uint64_t interval;
+    uint64_t next_due;
+    std::deque<uint64_t> backlog;   // due but no connection free to take them yet
+    size_t next_client;
+    uint64_t next_slow;
+    char buf[READ_SIZE];
+};
+
+static void start_connect(worker& w, client& c, uint64_t now);
+
+static void queue_request(client& c, uint64_t due) {
+    c.due[(c.due_head + c.in_flight) % MAX_PIPELINE] = due;
+    c.in_flight++;
+    c.out += requests[c.next_request];
+    c.next_request = (c.next_request + 1) % requests.size();
+}
+
+// closed loop: top the connection up to its depth, due right away
+static void fill(client& c, uint64_t now) {
+    int depth = c.slow ? 1 : pipeline;
+    while (c.in_flight < depth) {
+        queue_request(c, now);
+    }
+}
+
+static void drop(client& c) {
+    if (c.fd != -1) {
+        close(c.fd);
+        c.fd = -1;
+    }
+    c.connected = false;
+    c.in_flight = 0;
+    c.due_head = 0;
+    c.out.clear();
+    c.out_off = 0;
+    c.head.clear();
+    c.in_body = false;
+    c.until_close = false;
+    c.close_after = false;
+}
+
+static void reconnect(worker& w, client& c, uint64_t now) {
+    drop(c);
+    start_connect(w, c, now);
+}
+
+static bool flush(client& c) {
+    if (!c.connected) {
+        return true;
+    }
+    while (c.out_off < c.out.size()) {
+        size_t len = c.out.size() - c.out_off;
+        if (c.slow && len > SLOW_CHUNK) {
+            len = SLOW_CHUNK;
+        }
+        ssize_t n = send(c.fd, c.out.data() + c.out_off, len, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EINTR) {
+                return true;
+            }
+            return false;
+        }
+        c.out_off += n;
+        if (c.slow) {
+            break;
+        }
+    }
+    if (c.out_off == c.out.size()) {
+        c.out.clear();
+        c.out_off = 0;
+    }
+    return true;
+}
+
+static void start_connect(worker& w, client& c, uint64_t now) {
+    c.retry_at = 0;
+    c.fd = socket(server.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (c.fd == -1) {
+        w.connect_errors++;
+        c.retry_at = now + RETRY_MS * 1000000ULL;
+        return;
+    }
+    int one = 1;
+    setsockopt(c.fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (connect(c.fd, (sockaddr*)&server, server_len) == -1 && errno != EINPROGRESS) {
+        w.connect_errors++;
+        drop(c);
+        c.retry_at = now + RETRY_MS * 1000000ULL;
+        return;
+    }
+    epoll_event ev;
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    ev.data.u32 = &c - w.clients.data();
+    epoll_ctl(w.epollfd, EPOLL_CTL_ADD, c.fd, &ev);
+    // the requests of a closed loop are due from the moment it starts connecting
+    if (rate == 0 || c.slow) {
+        fill(c, now);
+    }
+}
+
+// status line and the headers that decide where the body ends
+static void parse_head(client& c, const char* p, size_t len) {
+    c.status = 0;
+    if (len > 12 && strncmp(p, "HTTP/1.", 7) == 0) {
+        c.status = atoi(p + 9);
+    }
+    c.close_after = len > 8 && p[7] == '0';
+    bool has_length = false;
+    uint64_t length = 0;
+    const char* end = p + len;
+    const char* line = (const char*)memchr(p, '\n', len);
+    while (line && ++line < end) {
+        const char* next = (const char*)memchr(line, '\n', end - line);
+        if (strncasecmp(line, "Content-Length:", 15) == 0) {
+            has_length = true;
+            length = strtoull(line + 15, NULL, 10);
+        } else if (strncasecmp(line, "Connection:", 11) == 0) {
+            const char* v = line + 11;
+            while (*v == ' ') {
+                v++;
+            }
+            c.close_after = strncasecmp(v, "close", 5) == 0;
+        }
+        line = next;
+    }
+    bool no_body = c.status / 100 == 1 || c.status == 204 || c.status == 304;
+    c.until_close = !no_body && !has_length;
+    c.body_left = no_body ? 0 : length;
+    c.in_body = c.until_close || c.body_left > 0;
+}
+
+static void complete(worker& w, client& c, uint64_t now) {
+    uint64_t due = c.due[c.due_head];
+    c.due_head = (c.due_head + 1) % MAX_PIPELINE;
+    c.in_flight--;
+    if (c.slow) {
+        w.slow_completed++;
+    } else {
+        w.latency.record(now - due);
+        w.completed++;
+    }
+    if (c.status < 200 || c.status >= 400) {
+        w.status_errors++;
+    }
+}
+
+// false when the connection had to be given up
+static bool consume(worker& w, client& c, const char* p, size_t n, uint64_t now) {
+    while (n > 0) {
+        if (c.in_body) {
+            if (c.until_close) {
+                return true;
+            }
+            size_t take = n < c.body_left ? n : c.body_left;
+            c.body_left -= take;
+            p += take;
+            n -= take;
+            if (c.body_left == 0) {
+                c.in_body = false;
+                complete(w, c, now);
+            }
+            continue;
+        }
+        if (c.in_flight == 0) {
+            w.io_errors++;      // a response nobody asked for
+            return false;
+        }
+
+        const char* head;
+        size_t head_len;
+        size_t used;
+        if (c.head.empty()) {
+            const char* end = (const char*)memmem(p, n, "\r\n\r\n", 4);
+            if (!end) {
+                c.head.assign(p, n);
+                return true;
+            }
+            head = p;
+            head_len = end + 4 - p;
+            used = head_len;
+        } else {
+            size_t old = c.head.size();
+            c.head.append(p, n);
+            size_t end = c.head.find("\r\n\r\n", old > 3 ? old - 3 : 0);
+            if (end == std::string::npos) {
+                if (c.head.size() > MAX_HEADER) {
+                    w.io_errors++;
+                    return false;
+                }
+                return true;
+            }
+            head = c.head.data();
+            head_len = end + 4;
+            used = head_len - old;
+        }
+        parse_head(c, head, head_len);
+        c.head.clear();
+        p += used;
+        n -= used;
+        if (!c.in_body) {
+            complete(w, c, now);
+        }
+    }
+    return true;
+}
+
+// after a response: go on with the next request or start over on a new connection
+static void next(worker& w, client& c, uint64_t now) {
+    if (c.in_flight == 0 && !c.in_body && (c.close_after || !keep_alive)) {
+        reconnect(w, c, now);
+        return;
+    }
+    if (rate == 0 || c.slow) {
+        fill(c, now);
+    }
+    if (!flush(c)) {
+        w.io_errors++;
+        reconnect(w, c, now);
+    }
+}
+
+static void on_readable(worker& w, client& c, uint64_t now) {
+    for (;;) {
+        ssize_t n = recv(c.fd, w.buf, sizeof(w.buf), 0);
+        if (n > 0) {
+            w.bytes += n;
+            if (!consume(w, c, w.buf, n, now)) {
+                reconnect(w, c, now);
+                return;
+            }
+            continue;
+        }
+        if (n < 0 && (errno == EAGAIN || errno == EINTR)) {
+            break;
+        }
+        // closed: the end of a body that ran to the close, otherwise requests were lost
+        if (c.in_body && c.until_close) {
+            c.in_body = false;
+            complete(w, c, now);
+            c.close_after = true;
+        }
+        if (c.in_flight > 0) {
+            w.io_errors++;
+        }
+        reconnect(w, c, now);
+        return;
+    }
+    next(w, c, now);
+}
+
+static void on_event(worker& w, client& c, uint32_t events, uint64_t now) {
+    if (!c.connected) {
+        int err = 0;
+        socklen_t len = sizeof(err);
+        getsockopt(c.fd, SOL_SOCKET, SO_ERROR, &err, &len);
+        if (err != 0) {
+            w.connect_errors++;
+            drop(c);
+            c.retry_at = now + RETRY_MS * 1000000ULL;
+            return;
+        }
+        if (!(events & (EPOLLOUT | EPOLLIN))) {
+            return;
+        }
+        c.connected = true;
+    }
+    if (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+        int fd = c.fd;
+        on_readable(w, c, now);
+        if (c.fd != fd) {
+            return;
+        }
+    }
+    if ((events & EPOLLOUT) && !flush(c)) {
+        w.io_errors++;
+        reconnect(w, c, now);
+    }
+}
+
+// open loop: everything due goes to the backlog, the backlog to connections with room
+static void dispatch(worker& w, uint64_t now) {
+    while (w.next_due <= now && now < w.end) {
+        w.backlog.push_back(w.next_due);
+        w.next_due += w.interval;
+    }
+    size_t n = w.clients.size() - w.slow;
+    for (size_t tried = 0; !w.backlog.empty() && tried < n; ++tried) {
+        client& c = w.clients[w.next_client];
+        w.next_client = (w.next_client + 1) % n;
+        if (!c.connected || c.in_body || c.in_flight >= pipeline ||
+            (!keep_alive && c.in_flight > 0)) {
+            continue;
+        }
+        while (!w.backlog.empty() && c.in_flight < pipeline) {
+            queue_request(c, w.backlog.front());
+            w.backlog.pop_front();
+            if (!keep_alive) {
+                break;
+            }
+        }
+        if (!flush(c)) {
+            w.io_errors++;
+            reconnect(w, c, now);
+        }
+        tried = 0;
+    }
+}
+
+// slow clients get their next bytes out, failed connects are retried
+static void on_tick(worker& w, uint64_t now) {
+    if (w.slow > 0 && now >= w.next_slow) {
+        for (size_t i = w.clients.size() - w.slow; i < w.clients.size(); ++i) {
+            if (!flush(w.clients[i])) {
+                w.io_errors++;
+                reconnect(w, w.clients[i], now);
+            }
+        }
+        w.next_slow = now + slow_interval * 1000000ULL;
+    }
+    for (size_t i = 0; i < w.clients.size(); ++i) {
+        client& c = w.clients[i];
+        if (c.retry_at && now >= c.retry_at) {
+            start_connect(w, c, now);
+        }
+    }
+}
+
+// the earliest of: the next request due, the next slow write, the end of the run
+static void arm_timer(worker& w) {
+    uint64_t at = w.end;
+    if (rate > 0 && w.next_due < at) {
+        at = w.next_due;
+    }
+    if (w.slow > 0 && w.next_slow < at) {
+        at = w.next_slow;
+    }
+    uint64_t now = now_ns();
+    for (size_t i = 0; i < w.clients.size(); ++i) {
+        if (w.clients[i].retry_at && w.clients[i].retry_at < at) {
+            at = w.clients[i].retry_at;
+        }
+    }
+    if (at == w.armed) {
+        return;
+    }
+    if (at <= now) {
+        at = now + 1;
+    }
+    struct itimerspec its;
+    memset(&its, 0, sizeof(its));
+    its.it_value.tv_sec = at / 1000000000;
+    its.it_value.tv_nsec = at % 1000000000;
+    timerfd_settime(w.timerfd, TFD_TIMER_ABSTIME, &its, NULL);
+    w.armed = at;
+}
+
+static void* run(void* arg) {
+    worker& w = *(worker*)arg;
+    epoll_event events[MAX_EVENTS];
+    epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.u32 = UINT32_MAX;
+    epoll_ctl(w.epollfd, EPOLL_CTL_ADD, w.timerfd, &ev);
+
+    uint64_t now = now_ns();
+    for (size_t i = 0; i < w.clients.size(); ++i) {
+        start_connect(w, w.clients[i], now);
+    }
+    while ((now = now_ns()) < w.end) {
+        if (rate > 0) {
+            dispatch(w, now);
+        }
+        on_tick(w, now);
+        arm_timer(w);
+        int number = epoll_wait(w.epollfd, events, MAX_EVENTS, -1);
+        if (number < 0 && errno != EINTR) {
+            perror("epoll_wait");
+            break;
+        }
+        now = now_ns();
+        for (int i = 0; i < number; ++i) {
+            if (events[i].data.u32 == UINT32_MAX) {
+                uint64_t expirations;
+                if (read(w.timerfd, &expirations, sizeof(expirations)) == sizeof(expirations)) {
+                    w.armed = 0;
+                }
+                continue;
+            }
+            client& c = w.clients[events[i].data.u32];
+            if (c.fd != -1) {
+                on_event(w, c, events[i].events, now);
+            }
+        }
+    }
+    for (size_t i = 0; i < w.clients.size(); ++i) {
+        drop(w.clients[i]);
+    }
+    return NULL;
+}
+
+static bool resolve(const char* target) {
+    std::string host(target);
+    std::string port = "80";
+    size_t colon = host.rfind(':');
+    if (colon != std::string::npos) {
+        port = host.substr(colon + 1);
+        host = host.substr(0, colon);
+    }
+    addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    addrinfo* res;
+    if (getaddrinfo(host.c_str(), port.c_str(), &hints, &res) != 0) {
+        return false;
+    }
+    memcpy(&server, res->ai_addr, res->ai_addrlen);
+    server_len = res->ai_addrlen;
+    freeaddrinfo(res);
+    return true;
+}
+
+static void print_latency(const char* name, const hdr_histogram& h) {
+    printf("%-12s p50 %8.1fus  p99 %8.1fus  p99.9 %8.1fus  max %8.1fus  mean %8.1fus\n", name,
+           h.percentile(50) / 1e3, h.percentile(99) / 1e3, h.percentile(99.9) / 1e3, h.max() / 1e3,
+           h.mean() / 1e3);
+}
+
+int main(int argc, char* argv[]) {
+    // -c: connections measured, -t: threads, -d: seconds to run
+    // -p: requests in flight per connection (pipelining depth)
+    // -R: open loop at this many requests per second in total, 0 is closed loop
+    // -k: 0 opens a new connection for every request
+    // -S: slow clients on top of -c, -i: ms between their SLOW_CHUNK byte writes
+    int opt;
+    while ((opt = getopt(argc, argv, "c:t:d:p:R:k:S:i:")) != -1) {
+        switch (opt) {
+        case 'c':
+            connections = atoi(optarg);
+            break;
+        case 't':
+            threads = atoi(optarg);
+            break;
+        case 'd':
+            duration = atoi(optarg);
+            break;
+        case 'p':
+            pipeline = atoi(optarg);
+            break;
+        case 'R':
+            rate = atof(optarg);
+            break;
+        case 'k':
+            keep_alive = atoi(optarg) != 0;
+            break;
+        case 'S':
+            slow_clients = atoi(optarg);
+            break;
+        case 'i':
+            slow_interval = atoi(optarg);
+            break;
+        default:
+            printf("usage: %s [-c connections] [-t threads] [-d seconds] [-p pipeline] [-R requests_per_s]"
+                   " [-k 0|1] [-S slow_clients] [-i slow_interval_ms] host:port [path...]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (optind >= argc) {
+        printf("host:port need to be provided\n");
+        return 1;
+    }
+    if (threads < 1 || connections < threads || duration < 1 || slow_clients < 0 || slow_interval < 1 ||
+        pipeline < 1 || pipeline > MAX_PIPELINE || rate < 0) {
+        printf("need 1 <= threads <= connections, pipeline <= %d, a positive duration and interval\n",
+               MAX_PIPELINE);
+        return 1;
+    }
+    if (!keep_alive) {
+        pipeline = 1;
+    }
+    const char* target = argv[optind];
+    if (!resolve(target)) {
+        printf("can't resolve %s\n", target);
+        return 1;
+    }
+    for (int i = optind + 1; i < argc || requests.empty(); ++i) {
+        std::string request = "GET ";
+        request += i < argc ? argv[i] : "/";
+        request += " HTTP/1.1\r\nHost: ";
+        request += target;
+        request += keep_alive ? "\r\n\r\n" : "\r\nConnection: close\r\n\r\n";
+        requests.push_back(request);
+    }
+
+    std::vector<worker*> workers;
+    uint64_t start = now_ns();
+    uint64_t end = start + duration * 1000000000ULL;
+    for (int i = 0; i < threads; ++i) {
+        worker* w = new worker();
+        w->index = i;
+        w->epollfd = epoll_create1(EPOLL_CLOEXEC);
+        w->timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        if (w->epollfd == -1 || w->timerfd == -1) {
+            perror("epoll/timerfd");
+            return 1;
+        }
+        w->end = end;
+        // slow clients are spread over the threads too
+        int measured = connections / threads + (i < connections % threads);
+        int slow = slow_clients / threads + (i < slow_clients % threads);
+        w->clients.resize(measured + slow);
+        w->slow = slow;
+        for (int j = 0; j < measured + slow; ++j) {
+            client& c = w->clients[j];
+            c.fd = -1;
+            c.slow = j >= measured;
+            c.next_request = j % requests.size();
+        }
+        if (rate > 0) {
+            // the threads share the rate and take turns, so the whole is still evenly spaced
+            w->interval = (uint64_t)(1e9 * threads / rate);
+            if (w->interval == 0) {
+                w->interval = 1;
+            }
+            w->next_due = start + w->interval * i / threads;
+        }
+        w->next_slow = start;
+        workers.push_back(w);
+    }
+    for (int i = 0; i < threads; ++i) {
+        if (pthread_create(&workers[i]->thread, NULL, run, workers[i]) != 0) {
+            perror("pthread_create");
+            return 1;
+        }
+    }
+
+    hdr_histogram latency;
+    uint64_t completed = 0, slow_completed = 0, bytes = 0;
+    uint64_t connect_errors = 0, io_errors = 0, status_errors = 0, backlog = 0;
+    for (int i = 0; i < threads; ++i) {
+        worker* w = workers[i];
+        pthread_join(w->thread, NULL);
+        latency.merge(w->latency);
+        completed += w->completed;
+        slow_completed += w->slow_completed;
+        bytes += w->bytes;
+        connect_errors += w->connect_errors;
+        io_errors += w->io_errors;
+        status_errors += w->status_errors;
+        backlog += w->backlog.size();
+        close(w->epollfd);
+        close(w->timerfd);
+    }
+    double seconds = (now_ns() - start) / 1e9;
+
+    printf("%d threads, %d connections (+%d slow), %ds, %s, pipeline %d, %s\n", threads, connections,
+           slow_clients, duration, rate > 0 ? "open loop" : "closed loop", pipeline,
+           keep_alive ? "keep-alive" : "connection per request");
+    if (rate > 0) {
+        printf("target       %.1f requests/s, %lu due but never sent\n", rate, (unsigned long)backlog);
+    }
+    printf("requests     %lu, %.1f/s, %.2f MB/s read\n", (unsigned long)completed, completed / seconds,
+           bytes / seconds / (1 << 20));
+    if (slow_clients > 0) {
+        printf("slow         %lu requests\n", (unsigned long)slow_completed);
+    }
+    printf("errors       connect %lu, io %lu, status %lu\n", (unsigned long)connect_errors,
+           (unsigned long)io_errors, (unsigned long)status_errors);
+    if (rate > 0) {
+        print_latency("latency", latency);
+    } else {
+        hdr_histogram corrected;
+        corrected.merge_corrected(latency, (uint64_t)latency.mean());
+        print_latency("latency", corrected);
+        print_latency("uncorrected", latency);
+    }
+    for (int i = 0; i < threads; ++i) {
+        delete workers[i];
+    }
+    return 0;
+}
@@ -0,0 +1,514 @@
+/*
+    Microbenchmarks, no network: the parser on canned requests (with every scanner
+    implementation the CPU supports), the timing wheel from 1k to 1M timers, the
+    threadpool queues at several worker counts and the response builder. Targets are
+    cache hits, so no syscall is made per request either. The results are printed as
+    one JSON document so builds can be compared.
+
+    g++ -std=c++17 -O2 -I. -o micro_bench bench/micro_bench.cpp http_conn.cpp http_response.cpp \
+        http_scan.cpp file_cache.cpp reactor.cpp reactor_ring.cpp io_ring.cpp metrics.cpp logger.cpp \
+        upload.cpp response_stream.cpp router.cpp proxy.cpp reactor_proxy.cpp -lpthread -lz
+    ./micro_bench [iterations] [parser|timer|threadpool|response ...]
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sched.h>
+#include <unistd.h>
+#include <atomic>
+#include <string>
+#include <vector>
+#include "http_conn.h"
+#include "http_scan.h"
+#include "lst_timer.h"
+#include "threadpool.h"
+#include "hdr_histogram.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+static inline unsigned long long cycles() { return __rdtsc(); }
+#else
+static inline unsigned long long cycles() { return 0; }
+#endif
+
+extern const char* doc_root;
+
+static const char* minimal_request =
+    "GET /index.html HTTP/1.1\r\n"
+    "Host: localhost\r\n"
+    "\r\n";
+
+// what a desktop browser sends for a page navigation
+static const char* browser_request =
+    "GET /index.html HTTP/1.1\r\n"
+    "Host: www.example.com:9006\r\n"
+    "Connection: keep-alive\r\n"
+    "Cache-Control: max-age=0\r\n"
+    "sec-ch-ua: \"Chromium\";v=\"118\", \"Google Chrome\";v=\"118\", \"Not=A?Brand\";v=\"99\"\r\n"
+    "sec-ch-ua-mobile: ?0\r\n"
+    "sec-ch-ua-platform: \"Linux\"\r\n"
+    "Upgrade-Insecure-Requests: 1\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko) "
+    "Chrome/118.0.0.0 Safari/537.36\r\n"
+    "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,image/avif,image/webp,"
+    "image/apng,*/*;q=0.8,application/signed-exchange;v=b3;q=0.7\r\n"
+    "Sec-Fetch-Site: none\r\n"
+    "Sec-Fetch-Mode: navigate\r\n"
+    "Sec-Fetch-User: ?1\r\n"
+    "Sec-Fetch-Dest: document\r\n"
+    "Accept-Encoding: gzip, deflate, br\r\n"
+    "Accept-Language: en-US,en;q=0.9,zh-CN;q=0.8,zh;q=0.7\r\n"
+    "Cookie: _ga=GA1.1.1234567890.1697000000; session=3f2a9c1d8e7b6a5f4e3d2c1b0a998877; "
+    "theme=dark; _ga_ABCDEF1234=GS1.1.1697000000.3.1.1697000123.0.0.0\r\n"
+    "If-None-Match: \"5f3a-64a1b2c3\"\r\n"
+    "If-Modified-Since: Mon, 02 Oct 2023 08:00:00 GMT\r\n"
+    "\r\n";
+
+// eight minimal requests back to back, the way a pipelining client sends them
+static std::string pipelined_requests() {
+    std::string all;
+    for (int i = 0; i < 8; ++i) {
+        all += minimal_request;
+    }
+    return all;
+}
+
+// the results, printed as {"build": {...}, "results": [{...}, ...]} at the end
+class report {
+public:
+    void begin(const char* suite, const char* name) {
+        m_out += m_out.empty() ? "\n    {" : ",\n    {";
+        m_first = true;
+        field("suite", suite);
+        field("name", name);
+    }
+    void field(const char* key, const char* value) {
+        key_prefix(key);
+        m_out += '"';
+        m_out += value;
+        m_out += '"';
+    }
+    void field(const char* key, double value) {
+        char text[64];
+        snprintf(text, sizeof(text), "%.1f", value);
+        key_prefix(key);
+        m_out += text;
+    }
+    void field(const char* key, long value) {
+        key_prefix(key);
+        m_out += std::to_string(value);
+    }
+    void end() { m_out += "}"; }
+
+    void print(long iterations) const {
+        printf("{\n  \"build\": {\"compiler\": \"%s\", \"cpus\": %ld, \"iterations\": %ld, \"time\": %ld},\n"
+               "  \"results\": [%s\n  ]\n}\n", __VERSION__, sysconf(_SC_NPROCESSORS_ONLN), iterations,
+               (long)time(NULL), m_out.c_str());
+    }
+
+private:
+    void key_prefix(const char* key) {
+        if (!m_first) {
+            m_out += ", ";
+        }
+        m_first = false;
+        m_out += '"';
+        m_out += key;
+        m_out += "\": ";
+    }
+
+    std::string m_out;
+    bool m_first = true;
+};
+
+class http_conn_bench {
+public:
+    static void init(http_conn& conn) {
+        conn.init();
+        conn.acquire_workspace();
+    }
+
+    // hand the request to the parser as if it had just been read
+    static http_conn::HTTP_CODE parse(http_conn& conn, const char* request, int len) {
+        memcpy(conn.m_read_buf, request, len);
+        conn.m_read_idx = len;
+        conn.m_checked_idx = 0;
+        conn.m_start_line = 0;
+        conn.init_request();
+        return conn.process_read();
+    }
+
+    // every request in the buffer, as process() walks through them; returns how many
+    static int parse_all(http_conn& conn, const char* requests, int len) {
+        memcpy(conn.m_read_buf, requests, len);
+        conn.m_read_idx = len;
+        conn.m_checked_idx = 0;
+        conn.m_start_line = 0;
+        conn.init_request();
+        int n = 0;
+        while (conn.process_read() == http_conn::FILE_REQUEST) {
+            conn.consume_request();
+            ++n;
+        }
+        return n;
+    }
+
+    // the request arrives piece by piece, the parser resumes after each read
+    static http_conn::HTTP_CODE parse_split(http_conn& conn, const char* request, int len, int piece) {
+        conn.m_read_idx = 0;
+        conn.m_checked_idx = 0;
+        conn.m_start_line = 0;
+        conn.init_request();
+        http_conn::HTTP_CODE ret = http_conn::NO_REQUEST;
+        for (int off = 0; off < len && ret == http_conn::NO_REQUEST; off += piece) {
+            int n = len - off < piece ? len - off : piece;
+            memcpy(conn.m_read_buf + conn.m_read_idx, request + off, n);
+            conn.m_read_idx += n;
+            ret = conn.process_read();
+        }
+        return ret;
+    }
+
+    // gather the response to the request parsed last again, as process() would
+    static bool build(http_conn& conn, http_conn::HTTP_CODE ret) {
+        int fd = conn.m_file_fd;
+        conn.init_response();
+        conn.m_file_fd = fd;
+        return conn.process_write(ret);
+    }
+    static int response_bytes(const http_conn& conn) {
+        int bytes = 0;
+        for (int i = 0; i < conn.m_iv_count; ++i) {
+            bytes += conn.m_ws->iv[i].iov_len;
+        }
+        return bytes;
+    }
+};
+
+static double now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+// ns and cycles per op of the calls made since start
+struct stopwatch {
+    double start_ns = now_ns();
+    unsigned long long start_cycles = cycles();
+
+    void stop(report& out, long ops) {
+        unsigned long long spent = cycles() - start_cycles;
+        double ns = now_ns() - start_ns;
+        out.field("ns_per_op", ns / ops);
+        out.field("cycles_per_op", (double)spent / ops);
+    }
+};
+
+static void fail(const char* what) {
+    fprintf(stderr, "%s failed\n", what);
+    exit(1);
+}
+
+static void bench_parser(report& out, http_conn& conn, long iterations) {
+    static const char* isas[] = { "scalar", "sse4.2", "avx2" };
+    const char* detected = http_scan::isa();
+    std::string pipelined = pipelined_requests();
+    for (size_t i = 0; i < sizeof(isas) / sizeof(isas[0]); ++i) {
+        if (!http_scan::select(isas[i])) {
+            continue;
+        }
+        const char* cases[][2] = { { "minimal", minimal_request }, { "browser", browser_request } };
+        for (auto& c : cases) {
+            int len = strlen(c[1]);
+            if (http_conn_bench::parse(conn, c[1], len) != http_conn::FILE_REQUEST) {
+                fail(c[0]);
+            }
+            out.begin("parser", c[0]);
+            out.field("isa", isas[i]);
+            out.field("bytes", (long)len);
+            stopwatch watch;
+            for (long n = 0; n < iterations; ++n) {
+                http_conn_bench::parse(conn, c[1], len);
+            }
+            watch.stop(out, iterations);
+            out.end();
+        }
+
+        // per request of the batch
+        int count = http_conn_bench::parse_all(conn, pipelined.data(), pipelined.size());
+        if (count != 8) {
+            fail("pipelined");
+        }
+        out.begin("parser", "pipelined");
+        out.field("isa", isas[i]);
+        out.field("bytes", (long)pipelined.size());
+        out.field("requests", (long)count);
+        stopwatch watch;
+        for (long n = 0; n < iterations / count; ++n) {
+            http_conn_bench::parse_all(conn, pipelined.data(), pipelined.size());
+        }
+        watch.stop(out, iterations / count * count);
+        out.end();
+
+        // the browser request in 64-byte reads, each one parsed as it comes
+        int len = strlen(browser_request);
+        if (http_conn_bench::parse_split(conn, browser_request, len, 64) != http_conn::FILE_REQUEST) {
+            fail("split");
+        }
+        out.begin("parser", "split");
+        out.field("isa", isas[i]);
+        out.field("bytes", (long)len);
+        out.field("reads", (long)((len + 63) / 64));
+        stopwatch split_watch;
+        for (long n = 0; n < iterations; ++n) {
+            http_conn_bench::parse_split(conn, browser_request, len, 64);
+        }
+        split_watch.stop(out, iterations);
+        out.end();
+    }
+    http_scan::select(detected);
+}
+
+static long expired_timers = 0;
+
+static void count_expired(client_data*) {
+    ++expired_timers;
+}
+
+// the timeouts connections get, CONN_TIMEOUT in ticks
+static const int TIMER_TICKS = 150;
+
+static uint32_t next_random(uint32_t& state) {
+    state ^= state << 13;
+    state ^= state >> 17;
+    state ^= state << 5;
+    return state;
+}
+
+// add every timer, adjust them in random order, then tick until all of them have fired
+static void bench_timers(report& out, long iterations) {
+    for (long n = 1000; n <= 1000000; n *= 10) {
+        std::vector<client_data> data(n);
+        long rounds = iterations / n > 0 ? iterations / n : 1;
+        double add_ns = 0, adjust_ns = 0, tick_ns = 0, del_ns = 0;
+        long ticks = 0;
+        uint32_t seed = 2463534242u;
+        for (long r = 0; r < rounds; ++r) {
+            time_wheel* wheel = new time_wheel;
+            for (long i = 0; i < n; ++i) {
+                data[i].timer.user_data = &data[i];
+                data[i].timer.cb_func = count_expired;
+            }
+            double start = now_ns();
+            for (long i = 0; i < n; ++i) {
+                wheel->add_timer(&data[i].timer, 1 + next_random(seed) % TIMER_TICKS);
+            }
+            add_ns += now_ns() - start;
+
+            start = now_ns();
+            for (long i = 0; i < n; ++i) {
+                wheel->adjust_timer(&data[next_random(seed) % n].timer, 1 + next_random(seed) % TIMER_TICKS);
+            }
+            adjust_ns += now_ns() - start;
+
+            expired_timers = 0;
+            start = now_ns();
+            while (wheel->size() > 0) {
+                wheel->tick();
+                ++ticks;
+            }
+            tick_ns += now_ns() - start;
+            if (expired_timers != n) {
+                fail("timer expiry");
+            }
+
+            for (long i = 0; i < n; ++i) {
+                wheel->add_timer(&data[i].timer, TIMER_TICKS);
+            }
+            start = now_ns();
+            for (long i = 0; i < n; ++i) {
+                wheel->del_timer(&data[next_random(seed) % n].timer);
+            }
+            for (long i = 0; i < n; ++i) {
+                wheel->del_timer(&data[i].timer);
+            }
+            del_ns += now_ns() - start;
+            delete wheel;
+        }
+        char name[32];
+        snprintf(name, sizeof(name), "%ld", n);
+        out.begin("timer", name);
+        out.field("timers", n);
+        out.field("rounds", rounds);
+        out.field("add_ns", add_ns / (rounds * n));
+        out.field("adjust_ns", adjust_ns / (rounds * n));
+        out.field("expire_ns", tick_ns / (rounds * n));
+        out.field("tick_ns", tick_ns / ticks);
+        out.field("del_ns", del_ns / (rounds * n));
+        out.end();
+    }
+}
+
+// a request as the threadpool sees it: stamped when queued, done once a worker has it
+struct bench_task {
+    double enqueued;
+    double latency;
+    std::atomic<long>* done;
+
+    void queued() { enqueued = now_ns(); }
+    void rejected() {}
+    void process() {
+        latency = now_ns() - enqueued;
+        done->fetch_add(1, std::memory_order_release);
+    }
+};
+
+template<typename Queue>
+static void bench_queue(report& out, const char* name, int workers, long iterations) {
+    typedef threadpool<bench_task, Queue> pool_type;
+    std::atomic<long> done(0);
+    long burst = iterations / 10 > 1000 ? iterations / 10 : 1000;
+    long round_trips = burst / 10;
+    std::vector<bench_task> tasks(burst);
+    for (bench_task& t : tasks) {
+        t.done = &done;
+    }
+    pool_type* pool = new pool_type(workers, 10000);
+
+    // throughput: queue everything as fast as the queue takes it
+    double start = now_ns();
+    for (long i = 0; i < burst; ++i) {
+        while (!pool->append(&tasks[i])) {
+            sched_yield();
+        }
+    }
+    while (done.load(std::memory_order_acquire) < burst) {
+        sched_yield();
+    }
+    double elapsed = now_ns() - start;
+
+    // latency: one request at a time, so it includes waking a parked worker up
+    hdr_histogram latency;
+    for (long i = 0; i < round_trips; ++i) {
+        long target = done.load(std::memory_order_relaxed) + 1;
+        while (!pool->append(&tasks[i])) {
+            sched_yield();
+        }
+        // yield rather than spin, on a machine with fewer cores than workers a spin holds the worker off
+        while (done.load(std::memory_order_acquire) < target) {
+            sched_yield();
+        }
+        latency.record((uint64_t)tasks[i].latency);
+    }
+    delete pool;
+
+    out.begin("threadpool", name);
+    out.field("workers", (long)workers);
+    out.field("tasks", burst);
+    out.field("ops_per_s", burst / elapsed * 1e9);
+    out.field("ns_per_op", elapsed / burst);
+    out.field("latency_p50_ns", (double)latency.percentile(50));
+    out.field("latency_p99_ns", (double)latency.percentile(99));
+    out.field("latency_max_ns", (double)latency.max());
+    out.end();
+}
+
+static void bench_threadpool(report& out, long iterations) {
+    for (int workers = 1; workers <= 8; workers *= 2) {
+        bench_queue<stealing_queue<bench_task> >(out, "stealing", workers, iterations);
+        bench_queue<locked_queue<bench_task> >(out, "locked", workers, iterations);
+    }
+}
+
+// process_write() on the request parsed before: the headers and iovecs of one response
+static void bench_response(report& out, http_conn& conn, long iterations) {
+    static const char* cases[][2] = {
+        { "200", "GET /index.html HTTP/1.1\r\nHost: localhost\r\n\r\n" },
+        { "200_sendfile", "GET /big.html HTTP/1.1\r\nHost: localhost\r\n\r\n" },
+        { "206", "GET /big.html HTTP/1.1\r\nHost: localhost\r\nRange: bytes=0-99\r\n\r\n" },
+        { "206_multipart", "GET /big.html HTTP/1.1\r\nHost: localhost\r\nRange: bytes=0-99,200-299\r\n\r\n" },
+        { "304", "GET /index.html HTTP/1.1\r\nHost: localhost\r\nIf-None-Match: *\r\n\r\n" },
+        { "404", "GET /missing.html HTTP/1.1\r\nHost: localhost\r\n\r\n" },
+    };
+    for (auto& c : cases) {
+        http_conn::HTTP_CODE ret = http_conn_bench::parse(conn, c[1], strlen(c[1]));
+        if (!http_conn_bench::build(conn, ret)) {
+            fail(c[0]);
+        }
+        out.begin("response", c[0]);
+        out.field("bytes", (long)http_conn_bench::response_bytes(conn));
+        stopwatch watch;
+        for (long n = 0; n < iterations; ++n) {
+            http_conn_bench::build(conn, ret);
+        }
+        watch.stop(out, iterations);
+        out.end();
+    }
+}
+
+static bool wanted(int argc, char* argv[], int first, const char* suite) {
+    if (first >= argc) {
+        return true;
+    }
+    for (int i = first; i < argc; ++i) {
+        if (strcmp(argv[i], suite) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+int main(int argc, char* argv[]) {
+    int first = 1;
+    long iterations = 1000000;
+    if (argc > 1 && atol(argv[1]) > 0) {
+        iterations = atol(argv[1]);
+        first = 2;
+    }
+    logger::m_level = LEVEL_WARN;   // stdout is the report
+
+    char dir[] = "/tmp/micro_bench.XXXXXX";
+    if (!mkdtemp(dir)) {
+        perror("mkdtemp");
+        return 1;
+    }
+    std::string small = std::string(dir) + "/index.html";
+    FILE* fp = fopen(small.c_str(), "w");
+    fputs("<html><body>hello</body></html>\n", fp);
+    fclose(fp);
+    // larger than SMALL_FILE_SIZE, the body goes out with sendfile
+    std::string big = std::string(dir) + "/big.html";
+    fp = fopen(big.c_str(), "w");
+    for (int i = 0; i < 64; ++i) {
+        fputs("<p>a paragraph of a page that is too large to be copied</p>\n", fp);
+    }
+    fclose(fp);
+    doc_root = dir;
+    http_conn::m_file_cache = new file_cache(dir, 1 << 20, 16);
+
+    http_conn* conn = new http_conn;
+    http_conn_bench::init(*conn);
+
+    report out;
+    if (wanted(argc, argv, first, "parser")) {
+        bench_parser(out, *conn, iterations);
+    }
+    if (wanted(argc, argv, first, "timer")) {
+        bench_timers(out, iterations);
+    }
+    if (wanted(argc, argv, first, "threadpool")) {
+        bench_threadpool(out, iterations);
+    }
+    if (wanted(argc, argv, first, "response")) {
+        bench_response(out, *conn, iterations);
+    }
+    out.print(iterations);
+
+    delete conn;
+    delete http_conn::m_file_cache;
+    unlink(small.c_str());
+    unlink(big.c_str());
+    rmdir(dir);
+    return 0;
+}
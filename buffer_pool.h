@@ -0,0 +1,68 @@
+#ifndef BUFFER_POOL_H
+#define BUFFER_POOL_H
+
+#include <stdlib.h>
+#include <stddef.h>
+#include "locker.h"
+
+// Shared pool of fixed-size blocks, freed blocks are kept on a free list for reuse
+class buffer_pool {
+public:
+    buffer_pool(size_t block_size, size_t max_free) :
+    m_block_size(block_size), m_max_free(max_free), m_free(NULL), m_free_count(0) {}
+
+    ~buffer_pool() {
+        while (m_free) {
+            block* next = m_free->next;
+            free(m_free);
+            m_free = next;
+        }
+    }
+
+    size_t block_size() const { return m_block_size; }
+
+    // NULL when memory is exhausted
+    char* take() {
+        m_lock.lock();
+        block* b = m_free;
+        if (b) {
+            m_free = b->next;
+            --m_free_count;
+        }
+        m_lock.unlock();
+        if (!b) {
+            return (char*)malloc(m_block_size < sizeof(block) ? sizeof(block) : m_block_size);
+        }
+        return (char*)b;
+    }
+
+    void give(char* data) {
+        if (!data) {
+            return;
+        }
+        m_lock.lock();
+        if (m_free_count < m_max_free) {
+            block* b = (block*)data;
+            b->next = m_free;
+            m_free = b;
+            ++m_free_count;
+            data = NULL;
+        }
+        m_lock.unlock();
+        free(data);
+    }
+
+private:
+    // a free block stores the link to the next one in its first bytes
+    struct block {
+        block* next;
+    };
+
+    size_t m_block_size;
+    size_t m_max_free;
+    locker m_lock;
+    block* m_free;
+    size_t m_free_count;
+};
+
+#endif
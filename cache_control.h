@@ -0,0 +1,57 @@
+#ifndef CACHE_CONTROL_H
+#define CACHE_CONTROL_H
+
+#include <string.h>
+#include <string>
+#include <string_view>
+#include <vector>
+
+/*
+    Cache-Control rules by URL prefix, e.g. "/static/=public, max-age=31536000, immutable".
+    They are set up before the reactors start and only read afterwards. The longest
+    matching prefix wins; the header becomes part of the prebuilt headers of a file
+    entry, so a rule costs nothing per request.
+*/
+class cache_control {
+public:
+    // "prefix=value", false if there is no '=' or the prefix isn't a URL path
+    bool add(const char* rule) {
+        const char* eq = strchr(rule, '=');
+        if (!eq || rule[0] != '/' || eq[1] == '\0') {
+            return false;
+        }
+        entry e;
+        e.prefix.assign(rule, eq - rule);
+        e.header.assign("Cache-Control: ").append(eq + 1).append("\r\n");
+        // keep the longest prefixes first, a later rule for the same prefix replaces the earlier one
+        auto it = m_rules.begin();
+        while (it != m_rules.end() && it->prefix.size() > e.prefix.size()) {
+            ++it;
+        }
+        if (it != m_rules.end() && it->prefix == e.prefix) {
+            *it = e;
+        } else {
+            m_rules.insert(it, e);
+        }
+        return true;
+    }
+
+    // the complete header line for url, empty if no rule matches
+    std::string_view find(std::string_view url) const {
+        for (const entry& e : m_rules) {
+            if (url.compare(0, e.prefix.size(), e.prefix) == 0) {
+                return e.header;
+            }
+        }
+        return std::string_view();
+    }
+
+private:
+    struct entry {
+        std::string prefix;
+        std::string header;     // "Cache-Control: ...\r\n"
+    };
+    std::vector<entry> m_rules;
+};
+
+#endif
@@ -0,0 +1,293 @@
+#include <sys/inotify.h>
+#include <sys/eventfd.h>
+#include <poll.h>
+#include <dirent.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include "file_cache.h"
+#include "logger.h"
+
+file_cache::file_cache(const char* doc_root, size_t budget, size_t max_entries) :
+m_doc_root(doc_root), m_shard_budget(budget / SHARD_NUM), m_shard_entries(max_entries / SHARD_NUM),
+m_inotifyfd(-1), m_wakefd(-1), m_started(false) {
+    if (m_shard_entries == 0) {
+        m_shard_entries = 1;
+    }
+    for (int i = 0; i < SHARD_NUM; ++i) {
+        m_shards[i].hand = m_shards[i].ring.end();
+    }
+}
+
+file_cache::~file_cache() {
+    stop();
+    if (m_inotifyfd != -1) {
+        close(m_inotifyfd);
+    }
+    if (m_wakefd != -1) {
+        close(m_wakefd);
+    }
+}
+
+bool file_cache::start() {
+    m_inotifyfd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (m_inotifyfd == -1) {
+        return false;
+    }
+    m_wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (m_wakefd == -1) {
+        return false;
+    }
+    add_watch(m_doc_root, "");
+    if (m_watches.empty()) {
+        return false;
+    }
+    if (pthread_create(&m_thread, NULL, worker, this) != 0) {
+        return false;
+    }
+    m_started = true;
+    return true;
+}
+
+void file_cache::stop() {
+    if (!m_started) {
+        return;
+    }
+    uint64_t one = 1;
+    ::write(m_wakefd, &one, sizeof(one));
+    pthread_join(m_thread, NULL);
+    m_started = false;
+}
+
+bool file_cache::cacheable(const char* url) {
+    if (url[0] != '/') {
+        return false;
+    }
+    for (const char* p = url; *p; ++p) {
+        if (*p == '?' || *p == '%' || *p == '\\') {
+            return false;
+        }
+        // reject "//", "/." and "/.." segments
+        if (*p == '/' && (p[1] == '/' || p[1] == '.')) {
+            return false;
+        }
+    }
+    return true;
+}
+
+file_cache::shard& file_cache::shard_of(std::string_view url) {
+    return m_shards[std::hash<std::string_view>()(url) % SHARD_NUM];
+}
+
+file_ref file_cache::lookup(std::string_view url) {
+    shard& s = shard_of(url);
+    s.lock.lock();
+    auto it = s.map.find(url);
+    if (it == s.map.end()) {
+        s.lock.unlock();
+        return file_ref();
+    }
+    it->second->referenced = true;
+    file_ref entry = it->second;
+    s.lock.unlock();
+    return entry;
+}
+
+static size_t footprint(const std::shared_ptr<file_entry>& entry) {
+    if (!entry) {
+        return 0;
+    }
+    return sizeof(file_entry) + entry->url.size() + entry->header.size() + entry->data.size()
+        + entry->validators.size() + entry->etag.size() + entry->last_modified.size()
+        + footprint(entry->gzip) + footprint(entry->br);
+}
+
+uint64_t file_cache::generation(std::string_view url) {
+    return shard_of(url).generation.load(std::memory_order_acquire);
+}
+
+// a later modification time, or the same one on the same file
+static bool not_older(const struct stat& a, const struct stat& b) {
+    if (a.st_mtim.tv_sec != b.st_mtim.tv_sec) {
+        return a.st_mtim.tv_sec > b.st_mtim.tv_sec;
+    }
+    if (a.st_mtim.tv_nsec != b.st_mtim.tv_nsec) {
+        return a.st_mtim.tv_nsec > b.st_mtim.tv_nsec;
+    }
+    return a.st_ino == b.st_ino && a.st_dev == b.st_dev;
+}
+
+void file_cache::insert(const std::shared_ptr<file_entry>& entry, uint64_t generation) {
+    entry->charge = footprint(entry);
+    shard& s = shard_of(entry->url);
+    s.lock.lock();
+    if (s.generation.load(std::memory_order_relaxed) != generation) {
+        // the file may have changed after it was stat()ed, the next miss loads it again
+        s.lock.unlock();
+        return;
+    }
+    auto it = s.map.find(entry->url);
+    if (it != s.map.end()) {
+        // another worker loaded the same file too, keep the newer one
+        if (not_older(it->second->st, entry->st)) {
+            s.lock.unlock();
+            return;
+        }
+        erase(s, it->second);
+    }
+    entry->pos = s.ring.insert(s.hand, entry);
+    s.map.emplace(std::string_view(entry->url), entry);
+    s.bytes += entry->charge;
+    evict(s);
+    s.lock.unlock();
+}
+
+void file_cache::invalidate(std::string_view url) {
+    shard& s = shard_of(url);
+    s.lock.lock();
+    s.generation.fetch_add(1, std::memory_order_release);
+    auto it = s.map.find(url);
+    if (it != s.map.end()) {
+        erase(s, it->second);
+    }
+    s.lock.unlock();
+}
+
+void file_cache::clear() {
+    for (int i = 0; i < SHARD_NUM; ++i) {
+        shard& s = m_shards[i];
+        s.lock.lock();
+        s.generation.fetch_add(1, std::memory_order_release);
+        s.map.clear();
+        s.ring.clear();
+        s.hand = s.ring.end();
+        s.bytes = 0;
+        s.lock.unlock();
+    }
+}
+
+// called with the shard locked
+void file_cache::erase(shard& s, const std::shared_ptr<file_entry>& entry) {
+    std::shared_ptr<file_entry> keep = entry;   // entry may be a reference into the map
+    if (s.hand == keep->pos) {
+        ++s.hand;
+    }
+    s.ring.erase(keep->pos);
+    s.map.erase(std::string_view(keep->url));
+    s.bytes -= keep->charge;
+}
+
+// CLOCK: sweep the hand, giving referenced entries a second chance
+void file_cache::evict(shard& s) {
+    while (!s.ring.empty() && (s.bytes > m_shard_budget || s.map.size() > m_shard_entries)) {
+        if (s.hand == s.ring.end()) {
+            s.hand = s.ring.begin();
+        }
+        std::shared_ptr<file_entry> entry = *s.hand;
+        if (entry->referenced) {
+            entry->referenced = false;
+            ++s.hand;
+            continue;
+        }
+        erase(s, entry);
+    }
+}
+
+void* file_cache::worker(void* arg) {
+    file_cache* cache = (file_cache*)arg;
+    cache->watch();
+    return cache;
+}
+
+// watch dir and everything below it, url is the url of dir without the trailing '/'
+void file_cache::add_watch(const std::string& dir, const std::string& url) {
+    int wd = inotify_add_watch(m_inotifyfd, dir.c_str(),
+        IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | IN_CREATE | IN_DELETE
+        | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR);
+    if (wd == -1) {
+        LOG_WARN("inotify_add_watch %s errno is: %d", dir.c_str(), errno);
+        return;
+    }
+    m_watches[wd] = url;
+
+    DIR* d = opendir(dir.c_str());
+    if (!d) {
+        return;
+    }
+    struct dirent* ent;
+    while ((ent = readdir(d)) != NULL) {
+        if (ent->d_type == DT_DIR && strcmp(ent->d_name, ".") != 0 && strcmp(ent->d_name, "..") != 0) {
+            add_watch(dir + "/" + ent->d_name, url + "/" + ent->d_name);
+        }
+    }
+    closedir(d);
+}
+
+void file_cache::watch() {
+    char buf[64 * 1024] __attribute__((aligned(__alignof__(struct inotify_event))));
+    struct pollfd fds[2];
+    fds[0].fd = m_inotifyfd;
+    fds[0].events = POLLIN;
+    fds[1].fd = m_wakefd;
+    fds[1].events = POLLIN;
+
+    while (true) {
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        if (fds[1].revents & POLLIN) {
+            break;
+        }
+
+        ssize_t len = ::read(m_inotifyfd, buf, sizeof(buf));
+        if (len <= 0) {
+            continue;
+        }
+        for (char* p = buf; p < buf + len; ) {
+            struct inotify_event* ev = (struct inotify_event*)p;
+            p += sizeof(struct inotify_event) + ev->len;
+
+            if (ev->mask & IN_Q_OVERFLOW) {
+                // events were lost, nothing in the cache can be trusted
+                clear();
+                continue;
+            }
+            auto it = m_watches.find(ev->wd);
+            if (it == m_watches.end()) {
+                continue;
+            }
+            if (ev->mask & IN_IGNORED) {
+                m_watches.erase(it);
+                continue;
+            }
+            if (ev->mask & (IN_DELETE_SELF | IN_MOVE_SELF)) {
+                clear();
+                continue;
+            }
+            if (ev->len == 0) {
+                continue;
+            }
+            std::string url = it->second + "/" + ev->name;
+            if (ev->mask & IN_ISDIR) {
+                if (ev->mask & (IN_CREATE | IN_MOVED_TO)) {
+                    std::string dir = m_doc_root + url;
+                    add_watch(dir, url);
+                }
+                if (ev->mask & (IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO)) {
+                    // a whole subtree went away or was replaced
+                    clear();
+                }
+                continue;
+            }
+            invalidate(url);
+            // a sidecar changed, its base file holds the compressed variant
+            size_t len = url.size();
+            if (len > 3 && (url.compare(len - 3, 3, ".gz") == 0 || url.compare(len - 3, 3, ".br") == 0)) {
+                invalidate(std::string_view(url).substr(0, len - 3));
+            }
+        }
+    }
+}
@@ -0,0 +1,110 @@
+#ifndef FILE_CACHE_H
+#define FILE_CACHE_H
+
+#include <sys/stat.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <atomic>
+#include <list>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include "locker.h"
+
+struct file_entry;
+typedef std::shared_ptr<const file_entry> file_ref;
+
+// everything do_request() needs to answer a hit without touching the filesystem
+struct file_entry {
+    file_entry() : fd(-1), streamed(false), modified(0), charge(0), referenced(false) {}
+    ~file_entry() {
+        if (fd != -1) {
+            close(fd);
+        }
+    }
+
+    std::string url;            // key, the map stores a string_view into it
+    struct stat st;
+    int fd;                     // kept open for sendfile(), -1 when the body is in data
+    bool streamed;              // a copy compressed while it is sent, neither fd nor data holds it
+    std::string data;           // the whole body of a small file or of a compressed copy
+    std::string header;         // status line and entity headers, each ending with "\r\n"
+    std::string validators;     // ETag, Last-Modified, Cache-Control and Vary, shared by 200, 206 and 304
+    std::string etag;           // strong, quoted; a compressed copy has its own
+    std::string last_modified;  // HTTP-date of the identity file
+    time_t modified;            // the same as a number, for If-Modified-Since
+    size_t charge;              // bytes accounted against the budget
+
+    // compressed representations of the same URL, from .gz/.br sidecars or made
+    // once in memory; they live inside their identity entry and are not in the map
+    std::shared_ptr<file_entry> gzip;
+    std::shared_ptr<file_entry> br;
+
+    // guarded by the shard lock
+    bool referenced;            // CLOCK reference bit
+    std::list<std::shared_ptr<file_entry> >::iterator pos;
+};
+
+/*
+    Cache of opened files under doc_root, keyed by URL. It is split into shards,
+    each with its own lock, map and CLOCK ring, and bounded by a byte budget and
+    an entry count (every entry may hold an fd). An inotify watcher on doc_root
+    drops the entries of files that are changed, moved or deleted. Entries are
+    reference counted, so a connection that is still sending an evicted file
+    keeps its fd valid until it is done.
+*/
+class file_cache {
+public:
+    static const int SHARD_NUM = 16;
+
+    file_cache(const char* doc_root, size_t budget, size_t max_entries);
+    ~file_cache();
+
+    bool start();                           // start the inotify watcher
+    void stop();
+
+    file_ref lookup(std::string_view url);
+    // read before the file is stat()ed; insert() drops an entry loaded while an
+    // invalidation of its shard came in, it may describe the file before the change
+    uint64_t generation(std::string_view url);
+    void insert(const std::shared_ptr<file_entry>& entry, uint64_t generation);
+    void invalidate(std::string_view url);
+    void clear();
+
+    // only canonical paths are cached, so one file can't hide behind several keys
+    static bool cacheable(const char* url);
+
+private:
+    struct shard {
+        shard() : bytes(0), generation(0) {}
+        locker lock;
+        std::unordered_map<std::string_view, std::shared_ptr<file_entry> > map;
+        std::list<std::shared_ptr<file_entry> > ring;
+        std::list<std::shared_ptr<file_entry> >::iterator hand;
+        size_t bytes;
+        std::atomic<uint64_t> generation;  // bumped by every invalidation, written under the lock
+    };
+
+    shard& shard_of(std::string_view url);
+    void erase(shard& s, const std::shared_ptr<file_entry>& entry);
+    void evict(shard& s);
+
+    static void* worker(void* arg);
+    void watch();
+    void add_watch(const std::string& dir, const std::string& url);
+
+private:
+    std::string m_doc_root;
+    size_t m_shard_budget;
+    size_t m_shard_entries;
+    shard m_shards[SHARD_NUM];
+
+    int m_inotifyfd;
+    int m_wakefd;
+    pthread_t m_thread;
+    bool m_started;
+    std::unordered_map<int, std::string> m_watches;    // wd -> url of the directory, watcher thread only
+};
+
+#endif
@@ -0,0 +1,187 @@
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <poll.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include "handoff.h"
+#include "logger.h"
+
+static const int MAX_FDS = 253;     // SCM_MAX_FD, what the kernel passes in one message
+
+static bool unix_address(const char* path, sockaddr_un& addr, socklen_t& len) {
+    size_t n = strlen(path);
+    if (n == 0 || n >= sizeof(addr.sun_path)) {
+        errno = ENAMETOOLONG;
+        return false;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    memcpy(addr.sun_path, path, n);
+    len = offsetof(sockaddr_un, sun_path) + n + 1;
+    return true;
+}
+
+// the other side has timeout_ms to send something
+static bool wait_readable(int fd, int timeout_ms) {
+    struct pollfd pfd = { fd, POLLIN, 0 };
+    int ret;
+    while ((ret = poll(&pfd, 1, timeout_ms)) == -1 && errno == EINTR) {
+    }
+    if (ret == 0) {
+        errno = ETIMEDOUT;
+    }
+    return ret == 1;
+}
+
+static void close_all(std::vector<int>& fds) {
+    for (int fd : fds) {
+        close(fd);
+    }
+    fds.clear();
+}
+
+bool handoff::receive(const char* path, std::vector<int>& fds, int& conn) {
+    conn = -1;
+    sockaddr_un addr;
+    socklen_t len;
+    if (!unix_address(path, addr, len)) {
+        return false;
+    }
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+        return false;
+    }
+    if (connect(fd, (sockaddr*)&addr, len) == -1) {
+        int err = errno;
+        close(fd);
+        errno = err;
+        // the first start, or the file of a server that is gone
+        return err == ENOENT || err == ECONNREFUSED;
+    }
+
+    // the message is the number of fds, the fds ride along
+    int count = 0;
+    struct iovec iov = { &count, sizeof(count) };
+    union {
+        cmsghdr align;
+        char buf[CMSG_SPACE(sizeof(int) * MAX_FDS)];
+    } control;
+    msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+    ssize_t n = -1;
+    if (wait_readable(fd, HANDOFF_TIMEOUT_MS)) {
+        while ((n = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC)) == -1 && errno == EINTR) {
+        }
+    }
+    if (n > 0) {
+        for (cmsghdr* c = CMSG_FIRSTHDR(&msg); c; c = CMSG_NXTHDR(&msg, c)) {
+            if (c->cmsg_level != SOL_SOCKET || c->cmsg_type != SCM_RIGHTS) {
+                continue;
+            }
+            size_t k = (c->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            for (size_t i = 0; i < k; ++i) {
+                int received;
+                memcpy(&received, CMSG_DATA(c) + i * sizeof(int), sizeof(int));
+                fds.push_back(received);
+            }
+        }
+    }
+    if (n != (ssize_t)sizeof(count) || (msg.msg_flags & MSG_CTRUNC) || count <= 0 || (size_t)count != fds.size()) {
+        int err = n == -1 ? errno : EPROTO;
+        close_all(fds);
+        close(fd);
+        errno = err;
+        return false;
+    }
+    conn = fd;
+    return true;
+}
+
+bool handoff::confirm(int conn) {
+    char ok = 1;
+    bool sent = send(conn, &ok, 1, MSG_NOSIGNAL) == 1;
+    close(conn);
+    return sent;
+}
+
+int handoff::listen_at(const char* path) {
+    sockaddr_un addr;
+    socklen_t len;
+    if (!unix_address(path, addr, len)) {
+        return -1;
+    }
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+        return -1;
+    }
+    // the file of the process we replaced, or of one that is gone. Nobody can connect
+    // before listen(), so the mode is set while only we can see the socket
+    unlink(path);
+    if (bind(fd, (sockaddr*)&addr, len) == -1 || chmod(path, S_IRUSR | S_IWUSR) == -1 || listen(fd, 4) == -1) {
+        int err = errno;
+        close(fd);
+        errno = err;
+        return -1;
+    }
+    return fd;
+}
+
+bool handoff::give(int listenfd, const std::vector<int>& fds) {
+    int conn = accept4(listenfd, NULL, NULL, SOCK_CLOEXEC);
+    if (conn == -1) {
+        return false;
+    }
+    // the listeners are the server, whoever gets them answers its clients
+    struct ucred cred;
+    socklen_t cred_len = sizeof(cred);
+    if (getsockopt(conn, SOL_SOCKET, SO_PEERCRED, &cred, &cred_len) == -1 || cred.uid != geteuid()) {
+        LOG_WARN("handover refused to pid %d of uid %d", (int)cred.pid, (int)cred.uid);
+        close(conn);
+        errno = EPERM;
+        return false;
+    }
+
+    int count = fds.size() < (size_t)MAX_FDS ? (int)fds.size() : MAX_FDS;
+    struct iovec iov = { &count, sizeof(count) };
+    union {
+        cmsghdr align;
+        char buf[CMSG_SPACE(sizeof(int) * MAX_FDS)];
+    } control;
+    memset(&control, 0, sizeof(control));
+    msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = CMSG_SPACE(sizeof(int) * count);
+    cmsghdr* c = CMSG_FIRSTHDR(&msg);
+    c->cmsg_level = SOL_SOCKET;
+    c->cmsg_type = SCM_RIGHTS;
+    c->cmsg_len = CMSG_LEN(sizeof(int) * count);
+    memcpy(CMSG_DATA(c), fds.data(), sizeof(int) * count);
+    ssize_t n;
+    while ((n = sendmsg(conn, &msg, MSG_NOSIGNAL)) == -1 && errno == EINTR) {
+    }
+
+    // the new process answers once its reactors run, it closes without a word if they don't
+    bool confirmed = false;
+    if (n == (ssize_t)sizeof(count) && wait_readable(conn, HANDOFF_TIMEOUT_MS)) {
+        char ok = 0;
+        n = recv(conn, &ok, 1, 0);
+        confirmed = n == 1 && ok == 1;
+        if (n == 0) {
+            errno = ECONNRESET;
+        }
+    }
+    int err = errno;
+    close(conn);
+    errno = err;
+    return confirmed;
+}
@@ -0,0 +1,33 @@
+#ifndef HANDOFF_H
+#define HANDOFF_H
+
+#include <vector>
+
+#define HANDOFF_TIMEOUT_MS 10000    // the other process has this long to send the listeners or confirm it serves them
+
+/*
+    Restart without refusing a connection. A server started with -U path first
+    connects to path. If a running server listens there it sends its listening
+    sockets over that connection (SCM_RIGHTS): they are the same sockets, so
+    connections queued on them wait instead of being reset. The new process starts
+    its reactors on them and confirms with one byte; only then does the old one stop
+    accepting and drain its connections. The new process then binds path itself for
+    the next restart. Until the confirmation the old process keeps serving, so a new
+    build that fails to start changes nothing.
+*/
+class handoff {
+public:
+    // take the listeners of the server at path into fds, conn is the connection to confirm
+    // on. An empty fds and conn -1 if nobody listens there; false if the handover failed
+    static bool receive(const char* path, std::vector<int>& fds, int& conn);
+    // the listeners are served, the old process may drain. Closes conn
+    static bool confirm(int conn);
+
+    // the socket the next process connects to, -1 on failure. A stale socket file at path is replaced
+    static int listen_at(const char* path);
+    // a process connected to listenfd: hand it fds and wait for its confirmation. Only
+    // a process of the same user gets them
+    static bool give(int listenfd, const std::vector<int>& fds);
+};
+
+#endif
@@ -0,0 +1,154 @@
+#ifndef HDR_HISTOGRAM_H
+#define HDR_HISTOGRAM_H
+
+#include <stdint.h>
+#include <string.h>
+
+/*
+    Log-linear histogram in the manner of HdrHistogram: values below LINEAR have a
+    bucket each, above that every power of two is split into SUB_COUNT buckets, so a
+    value is known to within 1/64 (1.6%) anywhere from 0 to 2^64 with a fixed array of
+    counters. record() is a handful of instructions and never allocates; a histogram
+    belongs to one thread and the histograms of several threads are merged afterwards.
+*/
+class hdr_histogram {
+public:
+    static const int SUB_BITS = 6;
+    static const int SUB_COUNT = 1 << SUB_BITS;     // buckets per power of two
+    static const int LINEAR = 2 * SUB_COUNT;        // values below it are exact
+    static const int BUCKETS = LINEAR + (64 - SUB_BITS - 1) * SUB_COUNT;
+
+    hdr_histogram() { reset(); }
+
+    void reset() {
+        memset(m_counts, 0, sizeof(m_counts));
+        m_total = 0;
+        m_sum = 0;
+        m_min = UINT64_MAX;
+        m_max = 0;
+    }
+
+    void record(uint64_t v, uint64_t n = 1) {
+        m_counts[index(v)] += n;
+        m_total += n;
+        m_sum += v * n;
+        if (v < m_min) {
+            m_min = v;
+        }
+        if (v > m_max) {
+            m_max = v;
+        }
+    }
+
+    // a value that held up the samples behind it: also record the ones that would have
+    // been taken every expected_interval meanwhile (coordinated omission)
+    void record_corrected(uint64_t v, uint64_t expected_interval) {
+        record(v);
+        if (expected_interval == 0) {
+            return;
+        }
+        for (uint64_t missed = v - (v >= expected_interval ? expected_interval : v);
+             missed >= expected_interval; missed -= expected_interval) {
+            record(missed);
+        }
+    }
+
+    void merge(const hdr_histogram& other) {
+        for (int i = 0; i < BUCKETS; ++i) {
+            m_counts[i] += other.m_counts[i];
+        }
+        m_total += other.m_total;
+        m_sum += other.m_sum;
+        if (other.m_min < m_min) {
+            m_min = other.m_min;
+        }
+        if (other.m_max > m_max) {
+            m_max = other.m_max;
+        }
+    }
+
+    // merge other as if every value had been recorded with record_corrected()
+    void merge_corrected(const hdr_histogram& other, uint64_t expected_interval) {
+        for (int i = 0; i < BUCKETS; ++i) {
+            uint64_t n = other.m_counts[i];
+            if (n == 0) {
+                continue;
+            }
+            uint64_t v = highest_equivalent(i);
+            if (v > other.m_max) {
+                v = other.m_max;
+            }
+            record(v, n);
+            if (expected_interval == 0) {
+                continue;
+            }
+            for (uint64_t missed = v - (v >= expected_interval ? expected_interval : v);
+                 missed >= expected_interval; missed -= expected_interval) {
+                record(missed, n);
+            }
+        }
+    }
+
+    uint64_t count() const { return m_total; }
+    uint64_t min() const { return m_total ? m_min : 0; }
+    uint64_t max() const { return m_max; }
+    double mean() const { return m_total ? (double)m_sum / m_total : 0; }
+    uint64_t sum() const { return m_sum; }
+
+    // the value percent of the samples are at or below, e.g. 99.9
+    uint64_t percentile(double percent) const {
+        if (m_total == 0) {
+            return 0;
+        }
+        uint64_t rank = (uint64_t)(percent / 100 * m_total + 0.5);
+        if (rank == 0) {
+            rank = 1;
+        }
+        uint64_t seen = 0;
+        for (int i = 0; i < BUCKETS; ++i) {
+            seen += m_counts[i];
+            if (seen >= rank) {
+                uint64_t v = highest_equivalent(i);
+                return v < m_max ? v : m_max;
+            }
+        }
+        return m_max;
+    }
+
+    // samples at or below v, for cumulative exports such as Prometheus buckets
+    uint64_t count_at_or_below(uint64_t v) const {
+        uint64_t n = 0;
+        int last = index(v);
+        for (int i = 0; i <= last; ++i) {
+            n += m_counts[i];
+        }
+        return n;
+    }
+
+    static int index(uint64_t v) {
+        if (v < (uint64_t)LINEAR) {
+            return (int)v;
+        }
+        int shift = 63 - __builtin_clzll(v) - SUB_BITS;     // v >> shift is in [SUB_COUNT, 2 * SUB_COUNT)
+        return LINEAR + (shift - 1) * SUB_COUNT + (int)(v >> shift) - SUB_COUNT;
+    }
+
+    // the largest value that lands in bucket i
+    static uint64_t highest_equivalent(int i) {
+        if (i < LINEAR) {
+            return i;
+        }
+        int shift = (i - LINEAR) / SUB_COUNT + 1;
+        uint64_t sub = (i - LINEAR) % SUB_COUNT + SUB_COUNT;
+        return ((sub + 1) << shift) - 1;
+    }
+
+private:
+    uint64_t m_counts[BUCKETS];
+    uint64_t m_total;
+    uint64_t m_sum;
+    uint64_t m_min;
+    uint64_t m_max;
+};
+
+#endif
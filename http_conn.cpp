@@ -1,21 +1,23 @@
+#include <zlib.h>
+#include <charconv>
 #include "http_conn.h"
-
-// 定义HTTP响应的一些状态信息
-const char* ok_200_title = "OK";
-const char* error_400_title = "Bad Request";
-const char* error_400_form = "Your request has bad syntax or is inherently impossible to satisfy.\n";
-const char* error_403_title = "Forbidden";
-const char* error_403_form = "You do not have permission to get file from this server.\n";
-const char* error_404_title = "Not Found";
-const char* error_404_form = "The requested file was not found on this server.\n";
-const char* error_500_title = "Internal Error";
-const char* error_500_form = "There was an unusual problem serving the requested file.\n";
+#include "http_scan.h"
+#include "http_response.h"
+#include "reactor.h"
 
 // 网站的根目录
 const char* doc_root = "/home/non-fire/桌面/webserver/resources";
 
-int http_conn::m_user_count = 0;
-int http_conn::m_epollfd = -1;
+static_assert( HEADER_COUNT <= 64, "m_known_set has one bit per known header" );
+
+thread_local http_conn::workspace_cache http_conn::m_workspaces;
+file_cache* http_conn::m_file_cache = NULL;
+buffer_pool* http_conn::m_read_pool = NULL;
+cache_control* http_conn::m_cache_control = NULL;
+router* http_conn::m_router = NULL;
+const char* http_conn::m_upload_dir = NULL;
+int64_t http_conn::m_max_upload = http_conn::DEFAULT_MAX_UPLOAD;
+std::atomic<bool> http_conn::m_draining( false );
 
 int setnonblocking(int fd) {
     int old_option = fcntl( fd, F_GETFL );
@@ -27,7 +29,7 @@ int setnonblocking(int fd) {
 // add fd that need to be listened into epoll
 void addfd(int epollfd, int fd, bool one_shot) {
     epoll_event event;
-    event.data.fd = fd;
+    event.data.u64 = fd;   // the whole word, reactor::run() tells upstream connections apart by its top bit
     event.events = EPOLLIN | EPOLLRDHUP;
     if(one_shot) 
     {
@@ -44,99 +46,450 @@ void removefd( int epollfd, int fd ) {
     close(fd);
 }
 
-// modify fd to reset the EPOLLONESHOT event so that EPOLLIN event can be triggered
+// modify fd to reset the EPOLLONESHOT event so that EPOLLIN event can be triggered.
+// An accepted connection is only added to the set the first time it is armed
 void modfd(int epollfd, int fd, int ev) {
     epoll_event event;
-    event.data.fd = fd;
+    event.data.u64 = fd;
     event.events = ev | EPOLLONESHOT | EPOLLRDHUP;
-    epoll_ctl( epollfd, EPOLL_CTL_MOD, fd, &event );
+    if ( epoll_ctl( epollfd, EPOLL_CTL_MOD, fd, &event ) == -1 && errno == ENOENT ) {
+        epoll_ctl( epollfd, EPOLL_CTL_ADD, fd, &event );
+    }
 }
 
-void http_conn::init(int sockfd, const sockaddr_in& addr) {
+void http_conn::init(int sockfd, const sockaddr_in& addr, int epollfd, reactor* ring) {
+    m_epollfd = epollfd;
+    m_ring = ring;
     m_sockfd = sockfd;
     m_address = addr;
+    m_owner.store( OWNER_REACTOR );
 
-    // 端口复用
-    int reuse = 1;
-    setsockopt( m_sockfd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof( reuse ) );
-    // !
-    addfd(m_epollfd, m_sockfd, true);
-    m_user_count ++;
+    // accept4() made it nonblocking. It is not in the epoll set yet: the reactor reads
+    // eagerly, and a worker it hands the request to must not race a hangup reported
+    // meanwhile (EPOLLHUP and EPOLLERR fire even on a disarmed fd). The first modfd()
+    // adds it, from the reactor or at hand-back
+    metrics::add( CONNECTIONS_ACCEPTED );
     init();
 }
 
+// the slot may never have been used, nothing here reads what was in it before. The
+// buffers are borrowed with the workspace once the first bytes arrive and nobody relies
+// on them being zeroed
 void http_conn::init() {
-    bytes_to_send = 0;
-    bytes_have_send = 0;
+    m_ws = NULL;
+    m_read_buf = NULL;
+    m_read_size = 0;
+    m_start_line = 0;
+    m_checked_idx = 0;
+    m_read_idx = 0;
+    m_pipelined = false;
+    m_streaming = false;
+    m_chunked = false;
+    m_proxying = false;
+    m_pinned_count = 0;
+    init_request();
+    init_response();
+}
+
+http_conn::workspace_cache::~workspace_cache() {
+    while ( head ) {
+        workspace* next = head->next;
+        delete head;
+        head = next;
+    }
+}
+
+void http_conn::acquire_workspace() {
+    workspace_cache& cache = m_workspaces;
+    if ( cache.head ) {
+        m_ws = cache.head;
+        cache.head = m_ws->next;
+        --cache.count;
+    } else {
+        m_ws = new workspace;
+    }
+    m_read_buf = m_ws->inline_buf;
+    m_read_size = READ_BUFFER_SIZE;
+    m_request_start = metrics::now();
+}
+
+// init_response() has dropped the pinned entries already
+void http_conn::release_workspace() {
+    if ( !m_ws ) {
+        return;
+    }
+    m_ws->file.reset();
+    delete m_ws->body;
+    m_ws->body = NULL;
+    delete m_ws->stream;
+    m_ws->stream = NULL;
+    m_streaming = false;
+    m_proxying = false;
+    release_read_buf();
+    workspace_cache& cache = m_workspaces;
+    if ( cache.count < WORKSPACE_CACHE_MAX ) {
+        m_ws->next = cache.head;
+        cache.head = m_ws;
+        ++cache.count;
+    } else {
+        delete m_ws;
+    }
+    m_ws = NULL;
+    m_read_buf = NULL;
+    m_read_size = 0;
+    m_read_idx = 0;
+    m_checked_idx = 0;
+    m_start_line = 0;
+}
 
+// forget the parsed request, the read buffer and its indexes are left alone
+void http_conn::init_request() {
     m_check_state = CHECK_STATE_REQUESTLINE;    // 初始状态为检查请求行
-    m_linger = false;       // 默认不保持链接  Connection : keep-alive保持连接
+    m_linger = false;       // HTTP/1.1 默认保持连接，由 parse_request_line() 根据版本设置
+    m_accept_encoding = 0;  // 默认只接受未压缩的内容
+    m_range_count = 0;      // 默认发送整个文件
 
     m_method = GET;         // 默认请求方式为GET
     m_url = 0;              
     m_version = 0;
     m_content_length = 0;
-    m_host = 0;
-    m_start_line = 0;
-    m_checked_idx = 0;
-    m_read_idx = 0;
+    m_header_count = 0;
+    m_known_set = 0;
+    if ( m_ws ) {
+        m_ws->file.reset();
+        // a finished upload has been answered, an unfinished one is removed
+        delete m_ws->body;
+        m_ws->body = NULL;
+    }
+}
+
+// forget the gathered responses once they have been sent
+void http_conn::init_response() {
+    close_file();
     m_write_idx = 0;
+    m_iv_count = 0;
+    m_iv_idx = 0;
+    m_segment_count = 0;
+    m_segment_idx = 0;
+    m_keep_alive = false;
+}
+
+// drop the bytes of the request just answered, a pipelined request behind it moves to the front
+void http_conn::consume_request() {
+    int end = m_checked_idx;
+    if ( m_check_state == CHECK_STATE_CONTENT ) {
+        end += m_content_length;
+    }
+    if ( end > m_read_idx ) {
+        end = m_read_idx;
+    }
+    memmove( m_read_buf, m_read_buf + end, m_read_idx - end );
+    m_read_idx -= end;
+    m_checked_idx = 0;
+    m_start_line = 0;
+    init_request();
+
+    // the big request is gone, what is left fits inline again
+    if ( m_read_buf != m_ws->inline_buf && m_read_idx <= READ_BUFFER_SIZE ) {
+        memcpy( m_ws->inline_buf, m_read_buf, m_read_idx );
+        release_read_buf();
+    }
+}
+
+// the first READ_BUFFER_SIZE bytes of block are free for the inline segment, so the
+// request becomes contiguous again and the parser never sees a segment boundary
+void http_conn::switch_read_buf( char* block ) {
+    memcpy( block, m_ws->inline_buf, m_read_idx );
+    // the request line and headers parsed so far point into the inline segment
+    char** parsed[] = { &m_url, &m_version };
+    for ( size_t i = 0; i < sizeof( parsed ) / sizeof( parsed[ 0 ] ); ++i ) {
+        if ( *parsed[ i ] ) {
+            *parsed[ i ] = block + ( *parsed[ i ] - m_ws->inline_buf );
+        }
+    }
+    auto rebase = [ block, this ]( std::string_view& view ) {
+        view = std::string_view( block + ( view.data() - m_ws->inline_buf ), view.size() );
+    };
+    for ( int i = 0; i < m_header_count; ++i ) {
+        rebase( m_ws->headers[ i ].name );
+        rebase( m_ws->headers[ i ].value );
+    }
+    for ( int i = 0; i < HEADER_COUNT; ++i ) {
+        if ( m_known_set & ( 1ULL << i ) ) {
+            rebase( m_ws->known[ i ] );
+        }
+    }
+    m_read_buf = block;
+    m_read_size = m_read_pool->block_size();
+}
 
-    bzero(m_read_buf, READ_BUFFER_SIZE);
-    bzero(m_write_buf, READ_BUFFER_SIZE);
-    bzero(m_real_file, FILENAME_LEN);
+void http_conn::release_read_buf() {
+    if ( m_read_buf != m_ws->inline_buf ) {
+        m_read_pool->give( m_read_buf );
+        m_read_buf = m_ws->inline_buf;
+        m_read_size = READ_BUFFER_SIZE;
+    }
 }
 
 void http_conn::close_conn() {
-    if(m_sockfd != -1) {
-        removefd(m_epollfd, m_sockfd);
+    // the worker is still using the workspace, it closes the connection when it hands it back
+    int owner = OWNER_WORKER;
+    if ( m_owner.compare_exchange_strong( owner, OWNER_CLOSING ) || owner == OWNER_CLOSING ) {
+        return;
+    }
+    close_socket();
+}
+
+void http_conn::close_socket() {
+    close_file();
+    release_workspace();
+    int fd = m_sockfd;
+    if(fd != -1) {
+        // once it is closed accept() may hand the same slot to a new connection
         m_sockfd = -1;
-        m_user_count--;
+        if ( m_ring ) {
+            close( fd );
+        } else {
+            removefd(m_epollfd, fd);
+        }
+        LOG_DEBUG( "close fd %d", fd );
+        metrics::add( CONNECTIONS_CLOSED );
     }
-    printf( "close fd %d\n", m_sockfd );
 }
 
 bool http_conn::read() {
-    if (m_read_idx >= READ_BUFFER_SIZE) {
-        return false;
+    // a small request is read into the inline segment. Once that is nearly full,
+    // readv() spills the rest into a pooled block in the same call and the request
+    // moves over to the block; a full block means the request is too large and
+    // process() answers it
+    if (receiving()) {
+        return receive_body();
+    }
+    bool growable = m_read_pool && (int)m_read_pool->block_size() > READ_BUFFER_SIZE;
+    bool borrowed = !m_ws;
+    if (borrowed) {
+        acquire_workspace();
     }
-    int bytes_read = 0;
     while (true) {
-        bytes_read = recv(m_sockfd, m_read_buf, READ_BUFFER_SIZE - m_read_idx, 0);
-        if (bytes_read == -1) {
-            if( errno == EAGAIN || errno == EWOULDBLOCK ) {
+        struct iovec iv[2];
+        int iv_count = 1;
+        char* block = NULL;
+        if (m_read_buf == m_ws->inline_buf && growable && m_read_size - m_read_idx < READ_BUFFER_SIZE / 4) {
+            block = m_read_pool->take();
+        }
+        if (m_read_idx == m_read_size && !block) {
+            break;
+        }
+        iv[0].iov_base = m_read_buf + m_read_idx;
+        iv[0].iov_len = m_read_size - m_read_idx;
+        if (block) {
+            iv[1].iov_base = block + READ_BUFFER_SIZE;
+            iv[1].iov_len = m_read_pool->block_size() - READ_BUFFER_SIZE;
+            iv_count = 2;
+        }
+        ssize_t bytes_read = readv(m_sockfd, iv, iv_count);
+        if (bytes_read <= 0) {
+            if (block) {
+                m_read_pool->give(block);
+            }
+            if (bytes_read == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
                 // no data
                 break;
             }
-            return false;   
-        } else if (bytes_read == 0) {   // the client close the connection
+            // an error, or the client closed the connection; close_conn() gives the workspace back
             return false;
         }
+        metrics::add( BYTES_RECEIVED, bytes_read );
+        if (block) {
+            if ((size_t)bytes_read > iv[0].iov_len) {
+                // the inline segment is full, the bytes behind it are in the block already
+                m_read_idx = READ_BUFFER_SIZE;
+                switch_read_buf(block);
+                bytes_read -= iv[0].iov_len;
+            } else {
+                m_read_pool->give(block);
+            }
+        }
         m_read_idx += bytes_read;
     }
+    if (borrowed && m_read_idx == 0) {
+        // a wakeup without data keeps the connection idle
+        release_workspace();
+    }
     return true;
 }
 
-void http_conn::process() {
-    // parse http request
-    HTTP_CODE read_ret = process_read();
-    if ( read_ret == NO_REQUEST ) {
-        modfd( m_epollfd, m_sockfd, EPOLLIN );
+// the same growth as read(): once the inline segment can't take the bytes, the request
+// moves to a pooled block, and whatever doesn't fit into that is left to the caller
+size_t http_conn::feed( const char* data, size_t len ) {
+    if ( !m_ws ) {
+        acquire_workspace();
+    }
+    if ( m_read_buf == m_ws->inline_buf && m_read_pool && (int)m_read_pool->block_size() > READ_BUFFER_SIZE
+            && len > (size_t)( m_read_size - m_read_idx ) ) {
+        char* block = m_read_pool->take();
+        if ( block ) {
+            switch_read_buf( block );
+        }
+    }
+    if ( len > (size_t)( m_read_size - m_read_idx ) ) {
+        len = m_read_size - m_read_idx;
+    }
+    memcpy( m_read_buf + m_read_idx, data, len );
+    m_read_idx += len;
+    metrics::add( BYTES_RECEIVED, len );
+    return len;
+}
+
+// payload the length of which is known is spliced from the socket into the file, the
+// rest (chunk framing and whatever may follow it) is read into the read buffer and
+// decoded from there. Once the body is complete the bytes behind it stay in the read
+// buffer, they are the next request
+bool http_conn::receive_body() {
+    upload& body = *m_ws->body;
+    off_t budget = MAX_RECEIVE_PER_CALL;
+    while ( body.receiving() && budget > 0 ) {
+        ssize_t n;
+        if ( body.spliceable() ) {
+            n = body.splice_from( m_sockfd, budget );
+        } else {
+            // the decoder took everything read before, the buffer is empty
+            n = recv( m_sockfd, m_read_buf, m_read_size, 0 );
+            if ( n > 0 ) {
+                size_t used = body.take( m_read_buf, n );
+                memmove( m_read_buf, m_read_buf + used, n - used );
+                m_read_idx = n - used;
+            }
+        }
+        if ( n == 0 ) {
+            // the client went away in the middle of the body
+            return false;
+        }
+        if ( n < 0 ) {
+            return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+        }
+        metrics::add( BYTES_RECEIVED, n );
+        budget -= n;
+    }
+    return true;
+}
+
+size_t http_conn::feed_body( const char* data, size_t len ) {
+    size_t used = m_ws->body->take( data, len );
+    metrics::add( BYTES_RECEIVED, used );
+    return used;
+}
+
+void http_conn::queued() {
+    m_phase_start = metrics::now();
+    if ( !m_ring ) {
+        m_owner.store( OWNER_WORKER );
+    }
+}
+
+void http_conn::rejected() {
+    m_owner.store( OWNER_REACTOR );
+}
+
+void http_conn::hand_back( int ev ) {
+    int owner = OWNER_WORKER;
+    if ( !m_owner.compare_exchange_strong( owner, OWNER_REACTOR ) && owner == OWNER_CLOSING ) {
+        // the reactor closed it meanwhile, nobody else touches it any more
+        close_socket();
         return;
     }
-    
-    // generate http response
-    bool write_ret = process_write( read_ret );
-    if ( !write_ret ) {
+    if ( m_ring ) {
+        // the reactor closes it too, its operations may still be in flight
+        m_next_event = ev;
+        m_ring->resume( this );
+    } else if ( ev == 0 ) {
         close_conn();
+    } else {
+        modfd( m_epollfd, m_sockfd, ev );
+    }
+}
+
+void http_conn::process() {
+    uint64_t start = metrics::now();
+    metrics::record( PHASE_QUEUE, start - m_phase_start );
+    m_pipelined = false;
+
+    if ( m_streaming ) {
+        // the batch before has been written to the socket, the next one goes the same way
+        bool ok = add_stream_chunk();
+        m_phase_start = metrics::now();
+        metrics::record( PHASE_PROCESS, m_phase_start - start );
+        hand_back( ok ? (int)EPOLLOUT : 0 );
+        return;
+    }
+
+    // answer every complete request in the read buffer and gather the responses,
+    // so a pipelining client gets them all with one writev
+    int responses = 0;
+    while ( responses < MAX_PIPELINE ) {
+        // parse http request
+        HTTP_CODE read_ret = process_read();
+        if ( read_ret == BODY_REQUEST ) {
+            if ( responses > 0 ) {
+                // the responses before it go out first, a 100 Continue must not overtake them
+                break;
+            }
+            read_ret = begin_upload();
+            if ( read_ret == NO_REQUEST ) {
+                // the reactor writes the rest of the body to the file and hands it back once complete
+                break;
+            }
+        }
+        if ( read_ret == NO_REQUEST ) {
+            if ( m_read_idx < m_read_size ) {
+                break;
+            }
+            // read() only leaves the buffer full when it can't grow any more
+            read_ret = ( m_check_state == CHECK_STATE_CONTENT ) ? BODY_TOO_LARGE : HEADER_TOO_LARGE;
+        }
+        if ( read_ret == BAD_REQUEST || read_ret == HEADER_TOO_LARGE || read_ret == BODY_TOO_LARGE ) {
+            // we don't know where the broken request ends, so nothing after it can be trusted
+            m_linger = false;
+        }
+
+        // generate http response
+        bool write_ret = process_write( read_ret );
+        if ( !write_ret ) {
+            hand_back( 0 );
+            return;
+        }
+        ++responses;
+        if ( !m_proxying ) {
+            // a proxied response is counted once the reactor knows its status
+            metrics::status( response_status( read_ret ) );
+        }
+        m_keep_alive = m_linger;
+        // a file body has to go out with sendfile() after everything else, the part
+        // headers of a multipart body stay in part_headers until it is sent, a
+        // handler's response in reply, a streamed body is sent a batch at a time, a
+        // proxied one comes from the reactor, and the write buffer must keep room for
+        // one more set of headers
+        bool last = !m_keep_alive || m_file_fd != -1 || m_range_count > 1 || read_ret == ROUTE_REQUEST
+                || m_streaming || m_proxying || WRITE_BUFFER_SIZE - m_write_idx < RESPONSE_HEADER_RESERVE;
+        consume_request();
+        if ( last ) {
+            break;
+        }
     }
-    modfd( m_epollfd, m_sockfd, EPOLLOUT);
+
+    m_phase_start = metrics::now();
+    metrics::record( PHASE_PROCESS, m_phase_start - start );
+    hand_back( responses == 0 ? EPOLLIN : EPOLLOUT );
 }
 
 
 
 // main state machine
 http_conn::HTTP_CODE http_conn::process_read() {
+    if ( m_check_state == CHECK_STATE_BODY ) {
+        // the headers were parsed before: the upload is yet to begin or it is over
+        return m_ws->body ? finish_upload() : BODY_REQUEST;
+    }
     LINE_STATUS line_status = LINE_OK;
     HTTP_CODE ret = NO_REQUEST;
     char* text = 0;
@@ -145,7 +498,7 @@ http_conn::HTTP_CODE http_conn::process_read() {
         // get a line
         text = get_line();
         m_start_line = m_checked_idx;
-        // printf( "got 1 http line: %s\n", text );
+        // LOG_DEBUG( "got 1 http line: %s", text );
 
         switch ( m_check_state ) {
             case CHECK_STATE_REQUESTLINE: {
@@ -157,15 +510,15 @@ http_conn::HTTP_CODE http_conn::process_read() {
             }
             case CHECK_STATE_HEADER: {
                 ret = parse_headers( text );
-                if ( ret == BAD_REQUEST ) {
-                    return BAD_REQUEST;
-                } else if ( ret == GET_REQUEST ) {
+                if ( ret == GET_REQUEST ) {
                     return do_request();
+                } else if ( ret != NO_REQUEST ) {
+                    return ret;
                 }
                 break;
             }
             case CHECK_STATE_CONTENT: {
-                ret = parse_content( text );
+                ret = parse_content();
                 if ( ret == GET_REQUEST ) {
                     return do_request();
                 }
@@ -177,53 +530,49 @@ http_conn::HTTP_CODE http_conn::process_read() {
             }
         }
     }
+    if ( line_status == LINE_BAD ) {
+        return BAD_REQUEST;
+    }
     return NO_REQUEST;
 }
 
-// every line is finished by '\r\n'
+// every line is finished by '\r\n', the scanner stops at the first byte that
+// ends a line or can't be part of one
 http_conn::LINE_STATUS http_conn::parse_line() {
-    char temp;
-    for ( ; m_checked_idx < m_read_idx; ++m_checked_idx ) {
-        temp = m_read_buf[ m_checked_idx ];
-        if ( temp == '\r' ) {
-            // the read buffer ends with '\r' -> the line is imcomplete
-            if ( ( m_checked_idx + 1 ) == m_read_idx ) {
-                return LINE_OPEN;
-            // '\r\n' has been read -> the line is complete
-            } else if ( m_read_buf[ m_checked_idx + 1 ] == '\n' ) {
-                // end the line
-                m_read_buf[ m_checked_idx++ ] = '\0';
-                m_read_buf[ m_checked_idx++ ] = '\0';
-                return LINE_OK;
-            }
-            // '\n' is not after '\r' -> error
-            return LINE_BAD;
-        } else if( temp == '\n' )  {
-            // the last read buffer ends with '\r' and now the read buffer starts with '\n'
-            // -> the line is complete
-            if( ( m_checked_idx > 1) && ( m_read_buf[ m_checked_idx - 1 ] == '\r' ) ) {
-                // end the line
-                m_read_buf[ m_checked_idx-1 ] = '\0';
-                m_read_buf[ m_checked_idx++ ] = '\0';
-                return LINE_OK;
-            }
-            // '\n' is not after '\r' -> error
-            return LINE_BAD;
+    const char* end = m_read_buf + m_read_idx;
+    const char* p = http_scan::line_end( m_read_buf + m_checked_idx, end );
+    m_checked_idx = p - m_read_buf;
+    // didn't read '\r' -> the line is imcomplete
+    if ( p == end ) {
+        return LINE_OPEN;
+    }
+    if ( *p == '\r' ) {
+        // the read buffer ends with '\r' -> the line is imcomplete, it's checked again with the next read
+        if ( ( m_checked_idx + 1 ) == m_read_idx ) {
+            return LINE_OPEN;
+        // '\r\n' has been read -> the line is complete
+        } else if ( m_read_buf[ m_checked_idx + 1 ] == '\n' ) {
+            // end the line
+            m_read_buf[ m_checked_idx++ ] = '\0';
+            m_read_buf[ m_checked_idx++ ] = '\0';
+            return LINE_OK;
         }
     }
-    // didn't read '\r' or '\n' -> the line is imcomplete
-    return LINE_OPEN;
+    // '\n' is not after '\r', or a control character -> error
+    return LINE_BAD;
 }
 
 // parse the requstline: get the http request mothod, url link and http version
 http_conn::HTTP_CODE http_conn::parse_request_line( char* text ) {
     // e.g.
     // text: GET /index.html HTTP/1.1
-    m_url = strpbrk(text, " \t");
-    // strpbrk: Find the first occurrence in S of any character in ACCEPT
+    // parse_line() put two '\0' behind the line
+    char* end = m_read_buf + m_checked_idx - 2;
+    m_url = (char*)http_scan::space( text, end );
     // 3 parameters are splited by ' ' or '\t'
     // the idx after the first " \t" is the start of url
-    if (! m_url) { 
+    if ( m_url == end ) {
+        m_url = 0;
         return BAD_REQUEST;
     }
     
@@ -236,20 +585,32 @@ http_conn::HTTP_CODE http_conn::parse_request_line( char* text ) {
 
     if ( strcasecmp(method, "GET") == 0 ) { // compare the strs ignoring case
         m_method = GET;
+    } else if ( strcasecmp(method, "HEAD") == 0 ) {
+        m_method = HEAD;
+    } else if ( strcasecmp(method, "PUT") == 0 ) {
+        m_method = PUT;
+    } else if ( strcasecmp(method, "POST") == 0 ) {
+        m_method = POST;
     } else {
-        return BAD_REQUEST; // only support the get method
+        return BAD_REQUEST; // only support the get, head, put and post methods
     }
 
     // m_url: /index.html HTTP/1.1
-    m_version = strpbrk( m_url, " \t" );
-    if (!m_version) {
+    m_version = (char*)http_scan::space( m_url, end );
+    if ( m_version == end ) {
+        m_version = 0;
         return BAD_REQUEST;
     }
     *m_version++ = '\0';
     // m_url: /index.html\0HTTP/1.1
     // m_version: HTTP/1.1
     
-    if (strcasecmp( m_version, "HTTP/1.1") != 0 ) {
+    // HTTP/1.1 connections are persistent unless the client says otherwise
+    if (strcasecmp( m_version, "HTTP/1.1") == 0 ) {
+        m_linger = true;
+    } else if (strcasecmp( m_version, "HTTP/1.0") == 0 ) {
+        m_linger = false;
+    } else {
         return BAD_REQUEST;
     }
 
@@ -268,268 +629,1403 @@ http_conn::HTTP_CODE http_conn::parse_request_line( char* text ) {
     return NO_REQUEST;
 }
 
-http_conn::HTTP_CODE http_conn::parse_headers( char* text ) {
-     // '\0' means reach a empty line so the header is already parsed
-    if( text[0] == '\0' ) {
-        // if the http request has the content part
-        if ( m_content_length != 0 ) {
-            m_check_state = CHECK_STATE_CONTENT;
-            return NO_REQUEST;
+static bool is_space( char c ) {
+    return c == ' ' || c == '\t';
+}
+
+static std::string_view trim( std::string_view text ) {
+    while ( !text.empty() && is_space( text.front() ) ) {
+        text.remove_prefix( 1 );
+    }
+    while ( !text.empty() && is_space( text.back() ) ) {
+        text.remove_suffix( 1 );
+    }
+    return text;
+}
+
+static bool iequals( std::string_view a, std::string_view b ) {
+    return a.size() == b.size() && strncasecmp( a.data(), b.data(), a.size() ) == 0;
+}
+
+// take the next element off a comma separated list, false at the end of the list
+static bool next_element( std::string_view& list, std::string_view& element ) {
+    while ( !list.empty() && ( list.front() == ',' || is_space( list.front() ) ) ) {
+        list.remove_prefix( 1 );
+    }
+    if ( list.empty() ) {
+        return false;
+    }
+    size_t end = list.find( ',' );
+    if ( end == std::string_view::npos ) {
+        end = list.size();
+    }
+    element = trim( list.substr( 0, end ) );
+    list.remove_prefix( end );
+    return true;
+}
+
+// a non-negative decimal that takes up all of text
+static bool parse_offset( std::string_view text, off_t& value ) {
+    auto res = std::from_chars( text.data(), text.data() + text.size(), value );
+    return !text.empty() && res.ec == std::errc() && res.ptr == text.data() + text.size() && value >= 0;
+}
+
+// the codings we can send out of an Accept-Encoding list, "q=0" refuses a coding
+static int parse_accept_encoding( std::string_view list ) {
+    int encodings = 0;
+    std::string_view element;
+    while ( next_element( list, element ) ) {
+        size_t semicolon = element.find( ';' );
+        std::string_view name = trim( element.substr( 0, semicolon ) );
+        if ( semicolon != std::string_view::npos ) {
+            std::string_view param = trim( element.substr( semicolon + 1 ) );
+            if ( param.size() > 2 && ( param[ 0 ] == 'q' || param[ 0 ] == 'Q' ) && param[ 1 ] == '=' ) {
+                // the line is NUL terminated, strtod() stops there at the latest
+                if ( strtod( param.data() + 2, NULL ) <= 0 ) {
+                    continue;
+                }
+            }
         }
-        // if not, a whole request has been gotten
-        return GET_REQUEST;
-    } else if ( strncasecmp( text, "Connection:", 11 ) == 0 ) {
-        // Connection: keep-alive
-        text += 11;
-        text += strspn( text, " \t" );
-        // strspn: first character in s1 not existing in s2 and return the idx(length)
-        if ( strcasecmp( text, "keep-alive" ) == 0 ) {
-            m_linger = true;
+        if ( iequals( name, "gzip" ) || iequals( name, "x-gzip" ) ) {
+            encodings |= http_conn::ENCODING_GZIP;
+        } else if ( iequals( name, "br" ) ) {
+            encodings |= http_conn::ENCODING_BR;
+        } else if ( name == "*" ) {
+            encodings |= http_conn::ENCODING_GZIP | http_conn::ENCODING_BR;
         }
-    } else if ( strncasecmp( text, "Content-Length:", 15 ) == 0 ) {
-        // Content-Length: 112
-        text += 15;
-        text += strspn( text, " \t" );
-        m_content_length = atol(text);
-    } else if ( strncasecmp( text, "Host:", 5 ) == 0 ) {
-        // Host: localhost:8080
-        text += 5;
-        text += strspn( text, " \t" );
-        m_host = text;
-    } else {
-        // printf( "oop! unknow header %s\n", text );
     }
-    return NO_REQUEST;
+    return encodings;
 }
 
-// only check if the content is read
-http_conn::HTTP_CODE http_conn::parse_content( char* text ) {
-    if ( m_read_idx >= ( m_content_length + m_checked_idx ) )
-    {
-        text[ m_content_length ] = '\0';
-        return GET_REQUEST;
+// index one header line, the name is folded to lower case in place and nothing is copied
+http_conn::HTTP_CODE http_conn::parse_headers( char* text ) {
+     // '\0' means reach a empty line so the header is already parsed
+    if( text[0] == '\0' ) {
+        return end_headers();
+    }
+    // e.g. Connection: keep-alive
+    // parse_line() put two '\0' behind the line
+    char* end = m_read_buf + m_checked_idx - 2;
+    HEADER id;
+    char* colon = find_header( text, id );
+    // no whitespace is allowed before the colon, that also refuses obsolete line folding
+    if ( *colon != ':' || colon == text ) {
+        return BAD_REQUEST;
+    }
+    if ( m_header_count == MAX_HEADERS ) {
+        return HEADER_TOO_LARGE;
+    }
+    http_header_field& field = m_ws->headers[ m_header_count++ ];
+    field.name = std::string_view( text, colon - text );
+    field.value = trim( std::string_view( colon + 1, end - colon - 1 ) );
+    if ( id == HEADER_UNKNOWN ) {
+        return NO_REQUEST;
+    }
+    if ( m_known_set & ( 1ULL << id ) ) {
+        // two different lengths are how requests get smuggled past a proxy
+        if ( id == HEADER_CONTENT_LENGTH && m_ws->known[ id ] != field.value ) {
+            return BAD_REQUEST;
+        }
+        return NO_REQUEST;
     }
+    m_ws->known[ id ] = field.value;
+    m_known_set |= 1ULL << id;
     return NO_REQUEST;
 }
 
-// when getting a complete and corret http request, we have to confirm
-// whether it exists and is readable and is not a dir
-// if so, use mmap() to map it to m_file_address and tell the caller
-http_conn::HTTP_CODE http_conn::do_request()
-{
-    // "/home/non-fire/桌面/webserver/resources" 
-    strcpy( m_real_file, doc_root );
-    int len = strlen( doc_root );
-    strncpy( m_real_file + len, m_url, FILENAME_LEN - len - 1 );
-
-    // get the file state
-    if ( stat( m_real_file, &m_file_stat ) < 0 ) {
-        return NO_RESOURCE;
+// the blank line after the headers: act on the ones that matter to us
+http_conn::HTTP_CODE http_conn::end_headers() {
+    std::string_view value = header( HEADER_CONNECTION );
+    // the value is a token list, e.g. "keep-alive, Upgrade"
+    std::string_view token;
+    while ( next_element( value, token ) ) {
+        if ( iequals( token, "keep-alive" ) ) {
+            m_linger = true;
+        } else if ( iequals( token, "close" ) ) {
+            m_linger = false;
+        }
     }
-
-    // readable for other groups
-    if ( ! ( m_file_stat.st_mode & S_IROTH ) ) {
-        return FORBIDDEN_REQUEST;
+    if ( m_draining.load( std::memory_order_relaxed ) ) {
+        // the client learns to go elsewhere before it sends the next request
+        m_linger = false;
     }
 
-    // whether is a dir
-    if ( S_ISDIR( m_file_stat.st_mode ) ) {
+    if ( ( m_method == PUT || m_method == POST ) && !routed() ) {
+        if ( !m_upload_dir ) {
+            // the body that may follow is never read
+            m_linger = false;
+            return METHOD_NOT_ALLOWED;
+        }
+        // begin_upload() looks at the framing of the body
+        m_check_state = CHECK_STATE_BODY;
+        return BODY_REQUEST;
+    }
+    // only an upload is streamed, any other body (one for a handler too) has to fit into the read buffer
+    if ( !header( HEADER_TRANSFER_ENCODING ).empty() ) {
         return BAD_REQUEST;
     }
 
-    // read only
-    int fd = open( m_real_file, O_RDONLY );
+    // Content-Length: 112
+    value = header( HEADER_CONTENT_LENGTH );
+    if ( !value.empty() ) {
+        auto res = std::from_chars( value.data(), value.data() + value.size(), m_content_length );
+        if ( res.ec != std::errc() || res.ptr != value.data() + value.size() || m_content_length < 0 ) {
+            return BAD_REQUEST;
+        }
+    }
 
-    // map to m_file_address
-    m_file_address = ( char* )mmap( 0, m_file_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0 );
-    close( fd );
-    return FILE_REQUEST;
-}
+    // Accept-Encoding: gzip, deflate, br;q=0.9
+    m_accept_encoding = parse_accept_encoding( header( HEADER_ACCEPT_ENCODING ) );
 
-// cancel m_file_address
-void http_conn::unmap() {
-    if( m_file_address )
-    {
-        munmap( m_file_address, m_file_stat.st_size );
-        m_file_address = 0;
+    // if the http request has the content part
+    if ( m_content_length != 0 ) {
+        m_check_state = CHECK_STATE_CONTENT;
+        return NO_REQUEST;
     }
+    // if not, a whole request has been gotten
+    return GET_REQUEST;
 }
 
-// write the http answer
-bool http_conn::write() {
-    int temp = 0;
-    
-    if ( bytes_to_send == 0 ) {
-        // none bytes need to be sent, end the answer
-        modfd( m_epollfd, m_sockfd, EPOLLIN ); 
-        init();
-        return true;
+std::string_view http_conn::header( HEADER id ) const {
+    if ( m_known_set & ( 1ULL << id ) ) {
+        return m_ws->known[ id ];
     }
+    return std::string_view();
+}
 
-    while(1) {
-        // 分散写
-        temp = writev(m_sockfd, m_iv, m_iv_count);
-        if ( temp <= -1 ) {
-            // buffer has no space
-            // only reset EPOLLOUT so that we can't receive the next request from the same client
-            // however, the integrality of the connection is proved
-            if( errno == EAGAIN ) {
-                modfd( m_epollfd, m_sockfd, EPOLLOUT );
-                return true;
-            }
-            unmap();
-            return false;
+std::string_view http_conn::header( std::string_view name ) const {
+    for ( int i = 0; i < m_header_count; ++i ) {
+        if ( iequals( m_ws->headers[ i ].name, name ) ) {
+            return m_ws->headers[ i ].value;
         }
+    }
+    return std::string_view();
+}
 
-        bytes_have_send += temp;
-        bytes_to_send -= temp;
+// only check if the content is read, the byte behind it may already belong to
+// the next pipelined request so the content is not NUL terminated
+http_conn::HTTP_CODE http_conn::parse_content() {
+    if ( m_read_idx >= ( m_content_length + m_checked_idx ) )
+    {
+        return GET_REQUEST;
+    }
+    return NO_REQUEST;
+}
 
-        // m_iv[0] has already been sent but m_iv[1] hasn't
-        if (bytes_have_send >= m_iv[0].iov_len)
-        {
-            m_iv[0].iov_len = 0;
-            m_iv[1].iov_base = m_file_address + (bytes_have_send - m_write_idx);
-            m_iv[1].iov_len = bytes_to_send;
-        }
-        // m_iv[0] hasn't been sent completely
-        else
-        {
-            m_iv[0].iov_base = m_write_buf + bytes_have_send;
-            m_iv[0].iov_len = m_iv[0].iov_len - temp;
-        }
+// the URL up to its query
+static std::string_view url_path( const char* url ) {
+    const char* query = strchr( url, '?' );
+    return query ? std::string_view( url, query - url ) : std::string_view( url );
+}
 
-        if (bytes_to_send <= 0)
-        {
-            // no data need to be sent
-            unmap();
-            modfd(m_epollfd, m_sockfd, EPOLLIN);
+// a PUT/POST that a handler takes is read into the read buffer instead of being uploaded
+bool http_conn::routed() const {
+    handler_request req;
+    return m_router && m_router->match( url_path( m_url ), req );
+}
 
-            // keep-alive or not
-            if (m_linger)
-            {
-                init();
-                return true;
-            }
-            else
-            {
-                return false;
-            }
-        }
+// the handler runs right here, on the worker that parsed the request
+http_conn::HTTP_CODE http_conn::route_request() {
+    handler_request& req = m_ws->request;
+    req.path = url_path( m_url );
+    route_handler handler = m_router->match( req.path, req );
+    if ( !handler ) {
+        return NO_REQUEST;
+    }
+    req.conn = this;
+    req.method = m_method;
+    req.query = m_url[ req.path.size() ] == '?' ? std::string_view( m_url + req.path.size() + 1 ) : std::string_view();
+    req.body = std::string_view( m_read_buf + m_checked_idx, m_content_length );
 
+    handler_reply& reply = m_ws->reply;
+    reply.reset();
+    if ( !handler( req, reply ) || reply.status < 200 || reply.status > 599 ) {
+        LOG_WARN( "the handler of %s failed, status %d", m_url, reply.status );
+        delete reply.stream;
+        reply.stream = NULL;
+        return INTERNAL_ERROR;
     }
+    return reply.upstream ? PROXY_REQUEST : ROUTE_REQUEST;
 }
 
-/*
-va_list: used with variadic
-the operation principle is the caller and the callee stack
-the first parameter is at the lowest addressed byte of the stack
-https://www.jianshu.com/p/5634469190a3
-va_list: the char ptr
-va_start: find the first parameter's address
-va_arg: get the parameter from the higher addressed byte of the stack according the num
-va_end: empty the ptr
-*/
-bool http_conn::add_response( const char* format, ... ) {
-    if( m_write_idx >= WRITE_BUFFER_SIZE ) {
+// no "." or ".." segment that could leave the upload directory, and a file name at the end
+static bool upload_path( const char* url ) {
+    size_t len = strlen( url );
+    if ( len < 2 || url[ len - 1 ] == '/' ) {
         return false;
     }
-    va_list arg_list;
-    va_start( arg_list, format );
-    // int vsnprintf (char * sbuf, size_t n, const char * format, va_list arg );
-    // put the format str into sbuf, used with variadic
-    int len = vsnprintf( m_write_buf + m_write_idx, WRITE_BUFFER_SIZE - 1 - m_write_idx, format, arg_list );
-    if( len >= ( WRITE_BUFFER_SIZE - 1 - m_write_idx ) ) {
-        return false;
+    for ( const char* p = url; *p; ) {
+        // p is at a '/'
+        const char* segment = p + 1;
+        const char* next = strchr( segment, '/' );
+        size_t n = next ? (size_t)( next - segment ) : strlen( segment );
+        if ( n == 0 || ( n == 1 && segment[ 0 ] == '.' ) || ( n == 2 && segment[ 0 ] == '.' && segment[ 1 ] == '.' ) ) {
+            return false;
+        }
+        p = segment + n;
     }
-    m_write_idx += len;
-    va_end( arg_list );
     return true;
 }
 
-bool http_conn::add_status_line( int status, const char* title ) {
-    return add_response( "%s %d %s\r\n", "HTTP/1.1", status, title );
-}
+// Content-Length or chunked, never both: a proxy in front of us might pick the other one
+http_conn::HTTP_CODE http_conn::open_upload() {
+    std::string_view encoding = header( HEADER_TRANSFER_ENCODING );
+    std::string_view length_text = header( HEADER_CONTENT_LENGTH );
+    int64_t length = 0;
+    if ( !encoding.empty() ) {
+        if ( !length_text.empty() ) {
+            return BAD_REQUEST;
+        }
+        if ( !iequals( encoding, "chunked" ) ) {
+            return NOT_IMPLEMENTED;
+        }
+        length = -1;
+    } else if ( !length_text.empty() ) {
+        auto res = std::from_chars( length_text.data(), length_text.data() + length_text.size(), length );
+        if ( res.ec != std::errc() || res.ptr != length_text.data() + length_text.size() || length < 0 ) {
+            return BAD_REQUEST;
+        }
+        if ( length > m_max_upload ) {
+            return BODY_TOO_LARGE;
+        }
+    }
+    if ( !upload_path( m_url ) ) {
+        return FORBIDDEN_REQUEST;
+    }
 
-bool http_conn::add_headers(int content_len) {
-    add_content_length(content_len);
-    add_content_type();
-    add_linger();
-    add_blank_line();
+    upload* body = new upload;
+    if ( !body->open( std::string( m_upload_dir ) + m_url, length, m_max_upload ) ) {
+        int err = errno;
+        delete body;
+        LOG_WARN( "can't store an upload to %s%s, errno is: %d", m_upload_dir, m_url, err );
+        switch ( err ) {
+            case ENOENT: case ENOTDIR: return NO_RESOURCE;
+            case EACCES: case EPERM: case EISDIR: case EROFS: return FORBIDDEN_REQUEST;
+            case ENAMETOOLONG: return BAD_REQUEST;
+            default: return INTERNAL_ERROR;
+        }
+    }
+    m_ws->body = body;
+    return NO_REQUEST;
 }
 
-bool http_conn::add_content_length(int content_len) {
-    return add_response( "Content-Length: %d\r\n", content_len );
-}
+// the headers of a PUT or POST are in: open the file and store what has come of the
+// body so far. NO_REQUEST while the rest of it is still to come
+http_conn::HTTP_CODE http_conn::begin_upload() {
+    HTTP_CODE ret = open_upload();
+    if ( ret != NO_REQUEST ) {
+        // the body is still in the way of the next request
+        m_linger = false;
+        return ret;
+    }
+    int buffered = m_read_idx - m_checked_idx;
+    if ( buffered == 0 && iequals( header( HEADER_EXPECT ), "100-continue" ) ) {
+        // nothing else is on its way to the client, process() began with this request
+        if ( send( m_sockfd, continue_100.data(), continue_100.size(), MSG_NOSIGNAL | MSG_DONTWAIT )
+                != (ssize_t)continue_100.size() ) {
+            return CLOSED_CONNECTION;
+        }
+    }
+    size_t used = m_ws->body->take( m_read_buf + m_checked_idx, buffered );
 
-bool http_conn::add_linger()
-{
-    return add_response( "Connection: %s\r\n", ( m_linger == true ) ? "keep-alive" : "close" );
+    // nothing of the request is needed any more, the read buffer is the decoder's from
+    // here on and what follows the body is the next request
+    int rest = buffered - used;
+    memmove( m_read_buf, m_read_buf + m_checked_idx + used, rest );
+    m_read_idx = rest;
+    m_checked_idx = 0;
+    m_start_line = 0;
+    m_url = 0;
+    m_version = 0;
+    m_header_count = 0;
+    m_known_set = 0;
+    return receiving() ? NO_REQUEST : finish_upload();
 }
 
-bool http_conn::add_blank_line()
-{
-    return add_response( "%s", "\r\n" );
+// the body is complete or the upload failed, the reactor gave the connection back
+http_conn::HTTP_CODE http_conn::finish_upload() {
+    upload& body = *m_ws->body;
+    switch ( body.status() ) {
+        case upload::RECEIVED:
+            if ( body.commit() ) {
+                return UPLOAD_STORED;
+            }
+            break;
+        case upload::TOO_LARGE:
+            m_linger = false;
+            return BODY_TOO_LARGE;
+        case upload::BAD_BODY:
+            m_linger = false;
+            return BAD_REQUEST;
+        default:
+            break;
+    }
+    LOG_WARN( "upload failed after %lld bytes, errno is: %d", (long long)body.received(), errno );
+    m_linger = false;
+    return INTERNAL_ERROR;
 }
 
-bool http_conn::add_content( const char* content )
-{
-    return add_response( "%s", content );
+// files of these types are worth sending compressed
+static bool compressible( const char* url ) {
+    static const char* exts[] = { ".html", ".htm", ".css", ".js", ".mjs", ".json", ".svg",
+                                  ".txt", ".xml", ".csv", ".map", NULL };
+    const char* dot = strrchr( url, '.' );
+    if ( !dot || strchr( dot, '/' ) ) {
+        return false;
+    }
+    for ( int i = 0; exts[ i ]; ++i ) {
+        if ( strcasecmp( dot, exts[ i ] ) == 0 ) {
+            return true;
+        }
+    }
+    return false;
 }
 
-bool http_conn::add_content_type() {
-    return add_response("Content-Type:%s\r\n", "text/html");
+// gzip the whole input at once, false if it fails or doesn't get any smaller
+static bool gzip_compress( const std::string& in, std::string& out ) {
+    z_stream zs;
+    memset( &zs, 0, sizeof( zs ) );
+    // windowBits 15 + 16 asks zlib for a gzip wrapper instead of a zlib one
+    if ( deflateInit2( &zs, Z_BEST_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY ) != Z_OK ) {
+        return false;
+    }
+    out.resize( deflateBound( &zs, in.size() ) );
+    zs.next_in = (Bytef*)in.data();
+    zs.avail_in = in.size();
+    zs.next_out = (Bytef*)&out[ 0 ];
+    zs.avail_out = out.size();
+    int ret = deflate( &zs, Z_FINISH );
+    out.resize( zs.total_out );
+    deflateEnd( &zs );
+    return ret == Z_STREAM_END && out.size() < in.size();
 }
 
-bool http_conn::process_write( http_conn::HTTP_CODE ret ) {
-    switch (ret)
-    {
-        case INTERNAL_ERROR:
-            add_status_line( 500, error_500_title );
-            add_headers( strlen( error_500_form ) );
-            if ( ! add_content( error_500_form ) ) {
-                return false;
+// Range: bytes=0-499, 1000-, -500 against a file of size bytes. Returns the number
+// of satisfiable ranges, clamped to the file; 0 to ignore the header (a syntax or
+// unit we don't follow, or more than max ranges) and -1 if no range is satisfiable
+static int parse_ranges( std::string_view value, off_t size, http_conn::byte_range* ranges, int max ) {
+    const std::string_view unit = "bytes=";
+    if ( value.size() < unit.size() || strncasecmp( value.data(), unit.data(), unit.size() ) != 0 ) {
+        return 0;
+    }
+    value.remove_prefix( unit.size() );
+    int count = 0;
+    int elements = 0;
+    std::string_view element;
+    while ( next_element( value, element ) ) {
+        if ( ++elements > max ) {
+            return 0;
+        }
+        size_t dash = element.find( '-' );
+        if ( dash == std::string_view::npos ) {
+            return 0;
+        }
+        std::string_view first_text = trim( element.substr( 0, dash ) );
+        std::string_view last_text = trim( element.substr( dash + 1 ) );
+        off_t first = 0, last = size - 1;
+        if ( first_text.empty() ) {
+            // the last n bytes
+            off_t suffix;
+            if ( !parse_offset( last_text, suffix ) ) {
+                return 0;
             }
-            break;
-        case BAD_REQUEST:
-            add_status_line( 400, error_400_title );
-            add_headers( strlen( error_400_form ) );
-            if ( ! add_content( error_400_form ) ) {
-                return false;
+            if ( suffix == 0 ) {
+                continue;
             }
-            break;
-        case NO_RESOURCE:
-            add_status_line( 404, error_404_title );
-            add_headers( strlen( error_404_form ) );
-            if ( ! add_content( error_404_form ) ) {
-                return false;
+            first = suffix < size ? size - suffix : 0;
+        } else {
+            if ( !parse_offset( first_text, first ) ) {
+                return 0;
             }
-            break;
-        case FORBIDDEN_REQUEST:
-            add_status_line( 403, error_403_title );
-            add_headers(strlen( error_403_form));
-            if ( ! add_content( error_403_form ) ) {
-                return false;
+            if ( !last_text.empty() ) {
+                if ( !parse_offset( last_text, last ) || last < first ) {
+                    return 0;
+                }
+                if ( last >= size ) {
+                    last = size - 1;
+                }
+            }
+        }
+        if ( first >= size ) {
+            continue;
+        }
+        ranges[ count ].first = first;
+        ranges[ count ].last = last;
+        ++count;
+    }
+    if ( elements == 0 ) {
+        return 0;
+    }
+    return count > 0 ? count : -1;
+}
+
+// when getting a complete and corret http request, we have to confirm
+// whether it exists and is readable and is not a dir
+// if so, take it from the cache or load it, and pick the representation to send
+http_conn::HTTP_CODE http_conn::do_request()
+{
+    if ( m_router ) {
+        HTTP_CODE ret = route_request();
+        if ( ret != NO_REQUEST ) {
+            return ret;
+        }
+    }
+    bool cacheable = m_file_cache && file_cache::cacheable( m_url );
+    std::string_view range = header( HEADER_RANGE );
+    file_ref entry;
+    if ( cacheable ) {
+        // a hit needs no path building and no filesystem syscall at all
+        entry = m_file_cache->lookup( m_url );
+        metrics::add( entry ? CACHE_HITS : CACHE_MISSES );
+    }
+    if ( !entry ) {
+        // an invalidation from here on keeps what is loaded out of the cache
+        uint64_t generation = cacheable ? m_file_cache->generation( m_url ) : 0;
+        struct stat st;
+        HTTP_CODE ret = stat_file( st );
+        if ( ret != FILE_REQUEST ) {
+            return ret;
+        }
+        // a revalidation is answered from the stat alone, the file is never opened.
+        // The validators are those of the representation load_file() would pick
+        if ( conditional() && range.empty() ) {
+            std::shared_ptr<file_entry> validated = std::make_shared<file_entry>();
+            validated->url = m_url;
+            validated->st = st;
+            build_header( *validated, st, predict_encoding( st, cacheable ), compressible( m_url ) );
+            if ( not_modified( *validated ) ) {
+                m_ws->file = validated;
+                m_file_fd = -1;
+                return NOT_MODIFIED;
+            }
+        }
+        std::shared_ptr<file_entry> loaded;
+        ret = load_file( loaded, st, cacheable );
+        if ( ret != FILE_REQUEST ) {
+            return ret;
+        }
+        if ( cacheable ) {
+            m_file_cache->insert( loaded, generation );
+        }
+        entry = loaded;
+    }
+
+    // byte ranges are served from the file itself, never from a compressed copy.
+    // If-Range falls back to the whole file when the client's copy is out of date
+    int ranges = 0;
+    if ( !range.empty() && if_range( *entry ) ) {
+        ranges = parse_ranges( range, entry->st.st_size, m_ws->ranges, MAX_RANGES );
+    }
+
+    // br beats gzip, both beat identity
+    if ( ranges != 0 ) {
+        m_ws->file = entry;
+    } else if ( ( m_accept_encoding & ENCODING_BR ) && entry->br ) {
+        m_ws->file = entry->br;
+    } else if ( ( m_accept_encoding & ENCODING_GZIP ) && entry->gzip ) {
+        m_ws->file = entry->gzip;
+    } else {
+        m_ws->file = entry;
+    }
+    m_ws->file_stat = m_ws->file->st;
+    if ( conditional() && not_modified( *m_ws->file ) ) {
+        m_file_fd = -1;
+        return NOT_MODIFIED;
+    }
+    if ( m_ws->file->streamed ) {
+        // compressed from the identity file as it is sent
+        if ( m_method != HEAD ) {
+            m_ws->stream = new gzip_stream( entry );
+        }
+        m_file_fd = -1;
+        return STREAM_REQUEST;
+    }
+    if ( ranges < 0 ) {
+        return RANGE_NOT_SATISFIABLE;
+    }
+    m_range_count = ranges;
+    // a HEAD response has no body to send from the file
+    m_file_fd = ( m_method == HEAD ) ? -1 : m_ws->file->fd;
+    return FILE_REQUEST;
+}
+
+// the request carries a validator of a copy the client already has
+bool http_conn::conditional() const {
+    return m_known_set & ( 1ULL << HEADER_IF_NONE_MATCH | 1ULL << HEADER_IF_MODIFIED_SINCE );
+}
+
+// If-None-Match: "a", W/"b" or If-Modified-Since: <date>, the latter only counts
+// without the former. Weak comparison, W/"x" matches "x"
+bool http_conn::not_modified( const file_entry& entry ) const {
+    std::string_view tags = header( HEADER_IF_NONE_MATCH );
+    if ( !tags.empty() ) {
+        std::string_view tag;
+        while ( next_element( tags, tag ) ) {
+            if ( tag.size() > 2 && tag[ 0 ] == 'W' && tag[ 1 ] == '/' ) {
+                tag.remove_prefix( 2 );
+            }
+            if ( tag == entry.etag || tag == "*" ) {
+                return true;
             }
+        }
+        return false;
+    }
+    std::string_view since = header( HEADER_IF_MODIFIED_SINCE );
+    if ( since.empty() ) {
+        return false;
+    }
+    // browsers send back the Last-Modified they got, so the date rarely needs parsing
+    if ( since == entry.last_modified ) {
+        return true;
+    }
+    time_t t;
+    return parse_http_date( since, t ) && entry.modified <= t;
+}
+
+// If-Range: "etag" or <date>, strong comparison against the identity entry
+bool http_conn::if_range( const file_entry& entry ) const {
+    std::string_view value = header( HEADER_IF_RANGE );
+    if ( value.empty() ) {
+        return true;
+    }
+    if ( value[ 0 ] == '"' ) {
+        return value == entry.etag;
+    }
+    return value == entry.last_modified;
+}
+
+// build real_file and check that it is a regular file everybody may read
+http_conn::HTTP_CODE http_conn::stat_file( struct stat& st )
+{
+    // "/home/non-fire/桌面/webserver/resources" 
+    strcpy( m_ws->real_file, doc_root );
+    int len = strlen( doc_root );
+    strncpy( m_ws->real_file + len, m_url, FILENAME_LEN - len - 1 );
+    m_ws->real_file[ FILENAME_LEN - 1 ] = '\0';
+
+    // get the file state
+    if ( stat( m_ws->real_file, &st ) < 0 ) {
+        return NO_RESOURCE;
+    }
+
+    // readable for other groups
+    if ( ! ( st.st_mode & S_IROTH ) ) {
+        return FORBIDDEN_REQUEST;
+    }
+
+    // whether is a dir
+    if ( S_ISDIR( st.st_mode ) ) {
+        return BAD_REQUEST;
+    }
+    return FILE_REQUEST;
+}
+
+// stat the precompressed copy real_file + suffix, real_file is left as it was
+bool http_conn::stat_sidecar( const char* suffix, struct stat& st )
+{
+    int len = strlen( m_ws->real_file );
+    if ( len + (int)strlen( suffix ) >= FILENAME_LEN ) {
+        return false;
+    }
+    strcpy( m_ws->real_file + len, suffix );
+    bool found = stat( m_ws->real_file, &st ) == 0 && S_ISREG( st.st_mode ) && ( st.st_mode & S_IROTH );
+    m_ws->real_file[ len ] = '\0';
+    return found;
+}
+
+// the encoding do_request() would send if load_file() opened the file now, found
+// with stat() only. Guessing gzip when the in-memory copy turns out no smaller only
+// costs a 200 instead of a 304; a file too large for that is always streamed gzipped
+const char* http_conn::predict_encoding( const struct stat& st, bool compress )
+{
+    if ( !compressible( m_url ) ) {
+        return NULL;
+    }
+    struct stat sidecar;
+    if ( ( m_accept_encoding & ENCODING_BR ) && stat_sidecar( ".br", sidecar ) ) {
+        return "br";
+    }
+    if ( ( m_accept_encoding & ENCODING_GZIP )
+            && ( stat_sidecar( ".gz", sidecar ) || ( compress && st.st_size <= COMPRESS_MAX_SIZE )
+                 || st.st_size > COMPRESS_MAX_SIZE ) ) {
+        return "gzip";
+    }
+    return NULL;
+}
+
+// open the file stat_file() found, together with its .br/.gz sidecars. Without a
+// .gz sidecar and with compress set, a gzip copy is made once in memory, which is
+// only worth it when the entry is going to be cached. A file larger than
+// COMPRESS_MAX_SIZE gets a streamed copy instead, compressed for each response.
+http_conn::HTTP_CODE http_conn::load_file( std::shared_ptr<file_entry>& entry, const struct stat& st, bool compress )
+{
+    bool vary = compressible( m_url );
+    entry = std::make_shared<file_entry>();
+    entry->url = m_url;
+    if ( !open_variant( *entry, st, st, NULL, vary ) ) {
+        return INTERNAL_ERROR;
+    }
+    if ( !vary ) {
+        return FILE_REQUEST;
+    }
+
+    // precompressed sidecars next to the file
+    int len = strlen( m_ws->real_file );
+    static const char* suffixes[] = { ".br", ".gz" };
+    static const char* encodings[] = { "br", "gzip" };
+    for ( int i = 0; i < 2; ++i ) {
+        struct stat sidecar;
+        if ( !stat_sidecar( suffixes[ i ], sidecar ) ) {
+            continue;
+        }
+        strcpy( m_ws->real_file + len, suffixes[ i ] );
+        std::shared_ptr<file_entry> variant = std::make_shared<file_entry>();
+        if ( open_variant( *variant, sidecar, st, encodings[ i ], true ) ) {
+            ( i == 0 ? entry->br : entry->gzip ) = variant;
+        }
+        m_ws->real_file[ len ] = '\0';
+    }
+
+    if ( !entry->gzip && compress && st.st_size <= COMPRESS_MAX_SIZE ) {
+        std::string body;
+        if ( entry->fd == -1 ) {
+            body = entry->data;
+        } else {
+            body.resize( st.st_size );
+            if ( pread( entry->fd, &body[ 0 ], st.st_size, 0 ) != st.st_size ) {
+                return FILE_REQUEST;
+            }
+        }
+        std::shared_ptr<file_entry> variant = std::make_shared<file_entry>();
+        if ( gzip_compress( body, variant->data ) ) {
+            variant->st = st;
+            variant->st.st_size = variant->data.size();
+            build_header( *variant, st, "gzip", true );
+            entry->gzip = variant;
+        }
+    } else if ( !entry->gzip && st.st_size > COMPRESS_MAX_SIZE ) {
+        std::shared_ptr<file_entry> variant = std::make_shared<file_entry>();
+        variant->st = st;
+        variant->streamed = true;
+        build_header( *variant, st, "gzip", true );
+        entry->gzip = variant;
+    }
+    return FILE_REQUEST;
+}
+
+// open real_file into entry: a small file is read into memory, a bigger one keeps its fd.
+// origin is the identity file, the validators come from it
+bool http_conn::open_variant( file_entry& entry, const struct stat& st, const struct stat& origin,
+                              const char* encoding, bool vary )
+{
+    // read only, the body is sent from it with sendfile() and nothing is mapped
+    int fd = open( m_ws->real_file, O_RDONLY );
+    if ( fd < 0 ) {
+        return false;
+    }
+    entry.st = st;
+    if ( st.st_size <= SMALL_FILE_SIZE ) {
+        entry.data.resize( st.st_size );
+        ssize_t len = pread( fd, &entry.data[ 0 ], st.st_size, 0 );
+        close( fd );
+        if ( len != st.st_size ) {
+            return false;
+        }
+    } else {
+        entry.fd = fd;  // the entry owns the fd from now on
+    }
+    build_header( entry, origin, encoding, vary );
+    return true;
+}
+
+static char* append_hex( char* out, unsigned long long v ) {
+    static const char hex[] = "0123456789abcdef";
+    char buf[ 16 ];
+    char* p = buf + sizeof( buf );
+    do {
+        *--p = hex[ v & 15 ];
+        v >>= 4;
+    } while ( v );
+    size_t len = buf + sizeof( buf ) - p;
+    memcpy( out, p, len );
+    return out + len;
+}
+
+// "inode-size-mtime" of the identity file, a compressed copy adds its encoding. A
+// sidecar is a derived copy of its base file, so it is versioned by the base file
+static std::string make_etag( const struct stat& origin, const char* encoding ) {
+    char text[ 3 * 17 + 8 ];
+    char* p = text;
+    *p++ = '"';
+    p = append_hex( p, origin.st_ino );
+    *p++ = '-';
+    p = append_hex( p, origin.st_size );
+    *p++ = '-';
+    p = append_hex( p, (unsigned long long)origin.st_mtim.tv_sec * 1000000000ULL + origin.st_mtim.tv_nsec );
+    std::string etag( text, p - text );
+    if ( encoding ) {
+        etag.append( "-" ).append( encoding );
+    }
+    return etag.append( "\"" );
+}
+
+// the status line and entity headers, the same for every response with this entry
+void http_conn::build_header( file_entry& entry, const struct stat& origin, const char* encoding, bool vary )
+{
+    char date[ HTTP_DATE_LEN ];
+    entry.etag = make_etag( origin, encoding );
+    entry.last_modified.assign( date, append_http_date( date, origin.st_mtime ) - date );
+    entry.modified = origin.st_mtime;
+
+    std::string& validators = entry.validators;
+    validators.assign( etag_prefix ).append( entry.etag ).append( crlf );
+    validators.append( last_modified_prefix ).append( entry.last_modified ).append( crlf );
+    if ( m_cache_control ) {
+        validators.append( m_cache_control->find( m_url ) );
+    }
+    if ( vary ) {
+        validators.append( vary_accept_encoding );
+    }
+
+    std::string& header = entry.header;
+    char length[ UINT_DIGITS ];
+    header.assign( status_line( 200 ) );
+    if ( !entry.streamed ) {
+        header.append( content_length_prefix );
+        header.append( length, append_uint( length, entry.st.st_size ) - length );
+        header.append( crlf );
+    }
+    header.append( content_type_prefix );
+    header.append( mime_type( m_url ) );
+    header.append( crlf );
+    if ( encoding ) {
+        header.append( content_encoding_prefix );
+        header.append( encoding );
+        header.append( crlf );
+    }
+    header.append( validators );
+    if ( !encoding ) {
+        header.append( accept_ranges_bytes );
+    }
+}
+
+// drop our references, an entry closes its fd once nobody uses it any more
+void http_conn::close_file() {
+    for ( int i = 0; i < m_pinned_count; ++i ) {
+        m_ws->pinned[ i ].reset();
+    }
+    m_pinned_count = 0;
+    m_file_fd = -1;
+}
+
+// queue len bytes at base behind the responses gathered so far
+void http_conn::add_iov( const char* base, size_t len ) {
+    if ( len == 0 ) {
+        return;
+    }
+    // headers of back-to-back responses are contiguous in write_buf, and so are the part
+    // headers of a multipart body, but those have file bytes between them: never merge
+    // across the end of a segment
+    bool boundary = m_segment_count > 0 && m_ws->segments[ m_segment_count - 1 ].iv_end == m_iv_count;
+    if ( m_iv_count > 0 && !boundary
+            && (char*)m_ws->iv[ m_iv_count - 1 ].iov_base + m_ws->iv[ m_iv_count - 1 ].iov_len == base ) {
+        m_ws->iv[ m_iv_count - 1 ].iov_len += len;
+        return;
+    }
+    if ( m_iv_count == (int)m_ws->iv.size() ) {
+        m_ws->iv.resize( 2 * m_iv_count );
+    }
+    m_ws->iv[ m_iv_count ].iov_base = (char*)base;
+    m_ws->iv[ m_iv_count ].iov_len = len;
+    ++m_iv_count;
+}
+
+bool http_conn::iov_run( struct msghdr& msg, bool& more ) const {
+    more = m_segment_idx < m_segment_count;
+    int iv_end = more ? m_ws->segments[ m_segment_idx ].iv_end : m_iv_count;
+    if ( m_iv_idx >= iv_end ) {
+        return false;
+    }
+    memset( &msg, 0, sizeof( msg ) );
+    msg.msg_iov = m_ws->iv.data() + m_iv_idx;
+    msg.msg_iovlen = iv_end - m_iv_idx;
+    return true;
+}
+
+// skip what has been sent completely and trim a partially sent iovec
+void http_conn::sent_iov( size_t bytes ) {
+    metrics::add( BYTES_SENT, bytes );
+    while ( bytes > 0 ) {
+        struct iovec& iv = m_ws->iv[ m_iv_idx ];
+        if ( bytes >= iv.iov_len ) {
+            bytes -= iv.iov_len;
+            ++m_iv_idx;
+        } else {
+            iv.iov_base = (char*)iv.iov_base + bytes;
+            iv.iov_len -= bytes;
+            bytes = 0;
+        }
+    }
+}
+
+// the range that follows the current run of iovecs
+bool http_conn::file_range( off_t& offset, off_t& count ) const {
+    if ( m_segment_idx == m_segment_count ) {
+        return false;
+    }
+    offset = m_ws->segments[ m_segment_idx ].file_offset;
+    count = m_ws->segments[ m_segment_idx ].file_end - offset;
+    return true;
+}
+
+void http_conn::sent_file( off_t bytes ) {
+    metrics::add( BYTES_SENT, bytes );
+    send_segment& seg = m_ws->segments[ m_segment_idx ];
+    seg.file_offset += bytes;
+    if ( seg.file_offset >= seg.file_end ) {
+        ++m_segment_idx;
+    }
+}
+
+// pipelined requests that are already in the read buffer set m_pipelined, so does
+// the next batch of a streamed body
+bool http_conn::end_response() {
+    if ( m_proxying ) {
+        // what was gathered before the proxied request is out, the reactor relays its
+        // response next and calls end_proxy()
+        init_response();
+        m_pipelined = false;
+        return true;
+    }
+    if ( m_streaming ) {
+        bool keep_alive = m_keep_alive;
+        init_response();
+        m_keep_alive = keep_alive;
+        m_pipelined = true;
+        return true;
+    }
+    delete m_ws->stream;
+    m_ws->stream = NULL;
+    uint64_t now = metrics::now();
+    metrics::record( PHASE_SEND, now - m_phase_start );
+    metrics::record( PHASE_REQUEST, now - m_request_start );
+    m_request_start = now;  // a pipelined request has been waiting since, at the latest
+    bool keep_alive = m_keep_alive;
+    init_response();
+    m_pipelined = keep_alive && m_read_idx > 0;
+    if ( keep_alive && !m_pipelined ) {
+        // an idle keep-alive connection holds no buffers
+        release_workspace();
+    }
+    return keep_alive;
+}
+
+// write the http answer
+bool http_conn::write() {
+    off_t budget = MAX_SEND_PER_CALL;
+
+    while ( true ) {
+        // headers and in-memory bodies go out with one sendmsg(), MSG_MORE corks
+        // them so they leave in the same segments as the start of a file range
+        struct msghdr msg;
+        bool more;
+        while ( iov_run( msg, more ) ) {
+            ssize_t temp = sendmsg( m_sockfd, &msg, more ? MSG_MORE : 0 );
+            if ( temp <= -1 ) {
+                // buffer has no space, wait for the next EPOLLOUT
+                if( errno == EAGAIN ) {
+                    modfd( m_epollfd, m_sockfd, EPOLLOUT );
+                    return true;
+                }
+                init_response();
+                return false;
+            }
+            sent_iov( temp );
+        }
+
+        // zero-copy body, a partial send resumes at the new offset
+        off_t offset, count;
+        if ( !file_range( offset, count ) ) {
             break;
-        case FILE_REQUEST:
-            add_status_line(200, ok_200_title );
-            add_headers(m_file_stat.st_size);
-            m_iv[ 0 ].iov_base = m_write_buf;
-            m_iv[ 0 ].iov_len = m_write_idx;
-            m_iv[ 1 ].iov_base = m_file_address;
-            m_iv[ 1 ].iov_len = m_file_stat.st_size;
-            m_iv_count = 2;
+        }
+        if ( count == 0 ) {
+            sent_file( 0 );
+            continue;
+        }
+        while ( count > 0 ) {
+            if ( budget <= 0 ) {
+                // give the other connections of the reactor a turn
+                modfd( m_epollfd, m_sockfd, EPOLLOUT );
+                return true;
+            }
+            ssize_t temp = sendfile( m_sockfd, m_file_fd, &offset, count < budget ? count : budget );
+            if ( temp <= -1 ) {
+                if( errno == EAGAIN ) {
+                    modfd( m_epollfd, m_sockfd, EPOLLOUT );
+                    return true;
+                }
+                init_response();
+                return false;
+            }
+            if ( temp == 0 ) {
+                // the file was truncated while we were sending it
+                init_response();
+                return false;
+            }
+            budget -= temp;
+            count -= temp;
+            sent_file( temp );
+        }
+    }
+
+    // no data need to be sent, keep-alive or not
+    if ( !end_response() ) {
+        return false;
+    }
+    if ( m_pipelined || m_proxying ) {
+        // pipelined requests are already waiting, the reactor hands us to a worker
+        // again instead of waiting for an EPOLLIN that may never come; or it starts
+        // forwarding the proxied request
+        return true;
+    }
+    modfd( m_epollfd, m_sockfd, EPOLLIN );
+    return true;
+}
+
+bool http_conn::end_proxy( int status, bool keep_alive ) {
+    m_proxying = false;
+    metrics::status( status );
+    uint64_t now = metrics::now();
+    metrics::record( PHASE_SEND, now - m_phase_start );
+    metrics::record( PHASE_REQUEST, now - m_request_start );
+    m_request_start = now;
+    m_pipelined = keep_alive && m_read_idx > 0;
+    if ( keep_alive && !m_pipelined ) {
+        release_workspace();
+    }
+    return keep_alive;
+}
+
+// 502, 503 or 504 in place of the upstream's response, write() sends it
+bool http_conn::proxy_error( int status ) {
+    const proxy_job& job = m_ws->proxy;
+    int start = m_write_idx;
+    m_proxying = false;
+    metrics::status( status );
+    error_page page = find_error_page( status );
+    add_iov( page.head.data(), page.head.size() );
+    if ( ! add_date() || ! add_text( job.keep_alive ? connection_keep_alive : connection_close ) || ! add_blank_line() ) {
+        return false;
+    }
+    add_iov( m_ws->write_buf + start, m_write_idx - start );
+    if ( !job.head ) {
+        add_iov( page.body.data(), page.body.size() );
+    }
+    m_keep_alive = job.keep_alive;
+    return true;
+}
+
+// append text to the write buffer
+bool http_conn::add_text( std::string_view text ) {
+    if ( text.size() > (size_t)( WRITE_BUFFER_SIZE - m_write_idx ) ) {
+        return false;
+    }
+    memcpy( m_ws->write_buf + m_write_idx, text.data(), text.size() );
+    m_write_idx += text.size();
+    return true;
+}
+
+bool http_conn::add_date() {
+    return add_text( date_header() );
+}
+
+bool http_conn::add_linger()
+{
+    return add_text( m_linger ? connection_keep_alive : connection_close );
+}
+
+bool http_conn::add_blank_line()
+{
+    return add_text( crlf );
+}
+
+bool http_conn::add_field( std::string_view prefix, std::string_view value ) {
+    return add_text( prefix ) && add_text( value ) && add_text( crlf );
+}
+
+bool http_conn::add_content_length( off_t content_length ) {
+    char digits[ UINT_DIGITS ];
+    return add_field( content_length_prefix,
+        std::string_view( digits, append_uint( digits, content_length ) - digits ) );
+}
+
+// "0-499/1234", out needs RANGE_TEXT_LEN bytes
+static const int RANGE_TEXT_LEN = 3 * UINT_DIGITS + 2;
+
+static char* append_range( char* out, off_t first, off_t last, off_t size ) {
+    out = append_uint( out, first );
+    *out++ = '-';
+    out = append_uint( out, last );
+    *out++ = '/';
+    return append_uint( out, size );
+}
+
+bool http_conn::add_content_range( off_t first, off_t last, off_t size ) {
+    char text[ RANGE_TEXT_LEN ];
+    return add_field( content_range_prefix, std::string_view( text, append_range( text, first, last, size ) - text ) );
+}
+
+// queue [first, end) of the body of file, from memory or as a range of the file.
+// A HEAD response gets the headers only
+void http_conn::add_body( off_t first, off_t end ) {
+    if ( m_method == HEAD ) {
+        return;
+    }
+    if ( m_file_fd == -1 ) {
+        add_iov( m_ws->file->data.data() + first, end - first );
+    } else {
+        add_file_range( first, end );
+    }
+}
+
+// send [first, end) of m_file_fd after the iovecs queued so far
+void http_conn::add_file_range( off_t first, off_t end ) {
+    send_segment& seg = m_ws->segments[ m_segment_count++ ];
+    seg.iv_end = m_iv_count;
+    seg.file_offset = first;
+    seg.file_end = end;
+}
+
+// a random boundary for this process, so that it can't be guessed and put into a file
+static const std::string& multipart_boundary() {
+    static const std::string boundary = [] {
+        char text[ 2 * UINT_DIGITS ];
+        unsigned long long seed = (unsigned long long)time( NULL ) * 6364136223846793005ULL ^ getpid();
+        return std::string( text, append_uint( text, seed ) - text );
+    }();
+    return boundary;
+}
+
+// 206 Partial Content: one range is sent as it is, several as multipart/byteranges
+bool http_conn::add_ranges() {
+    int start = m_write_idx;
+    off_t size = m_ws->file_stat.st_size;
+    std::string_view type = mime_type( m_url );
+    if ( ! add_text( status_line( 206 ) ) ) {
+        return false;
+    }
+
+    if ( m_range_count == 1 ) {
+        const byte_range& range = m_ws->ranges[ 0 ];
+        if ( ! add_content_range( range.first, range.last, size )
+                || ! add_content_length( range.last - range.first + 1 )
+                || ! add_field( content_type_prefix, type ) ) {
+            return false;
+        }
+        add_iov( m_ws->write_buf + start, m_write_idx - start );
+        add_iov( m_ws->file->validators.data(), m_ws->file->validators.size() );
+        start = m_write_idx;
+        if ( ! add_date() || ! add_linger() || ! add_blank_line() ) {
+            return false;
+        }
+        add_iov( m_ws->write_buf + start, m_write_idx - start );
+        add_body( range.first, range.last + 1 );
+        m_ws->pinned[ m_pinned_count++ ] = m_ws->file;
+        return true;
+    }
+
+    // every part starts with its own headers, they are all laid out before the
+    // first iovec points into part_headers
+    const std::string& boundary = multipart_boundary();
+    size_t part_start[ MAX_RANGES + 1 ];
+    off_t length = 0;
+    m_ws->part_headers.clear();
+    for ( int i = 0; i < m_range_count; ++i ) {
+        char text[ RANGE_TEXT_LEN ];
+        char* p = append_range( text, m_ws->ranges[ i ].first, m_ws->ranges[ i ].last, size );
+        part_start[ i ] = m_ws->part_headers.size();
+        m_ws->part_headers.append( "\r\n--" ).append( boundary ).append( crlf );
+        m_ws->part_headers.append( content_type_prefix ).append( type ).append( crlf );
+        m_ws->part_headers.append( content_range_prefix ).append( text, p - text ).append( crlf );
+        m_ws->part_headers.append( crlf );
+        length += m_ws->ranges[ i ].last - m_ws->ranges[ i ].first + 1;
+    }
+    part_start[ m_range_count ] = m_ws->part_headers.size();
+    m_ws->part_headers.append( "\r\n--" ).append( boundary ).append( "--\r\n" );
+    length += m_ws->part_headers.size();
+
+    if ( ! add_text( content_type_prefix ) || ! add_text( "multipart/byteranges; boundary=" )
+            || ! add_text( boundary ) || ! add_text( crlf ) || ! add_content_length( length ) ) {
+        return false;
+    }
+    add_iov( m_ws->write_buf + start, m_write_idx - start );
+    add_iov( m_ws->file->validators.data(), m_ws->file->validators.size() );
+    start = m_write_idx;
+    if ( ! add_date() || ! add_linger() || ! add_blank_line() ) {
+        return false;
+    }
+    add_iov( m_ws->write_buf + start, m_write_idx - start );
+    if ( m_method != HEAD ) {
+        for ( int i = 0; i < m_range_count; ++i ) {
+            add_iov( m_ws->part_headers.data() + part_start[ i ], part_start[ i + 1 ] - part_start[ i ] );
+            add_body( m_ws->ranges[ i ].first, m_ws->ranges[ i ].last + 1 );
+        }
+        add_iov( m_ws->part_headers.data() + part_start[ m_range_count ],
+                 m_ws->part_headers.size() - part_start[ m_range_count ] );
+    }
+    m_ws->pinned[ m_pinned_count++ ] = m_ws->file;
+    return true;
+}
 
-            bytes_to_send = m_write_idx + m_file_stat.st_size;
+// no Content-Length: the body is chunked, an HTTP/1.0 client reads it until the connection closes
+bool http_conn::add_stream_headers() {
+    m_chunked = strcasecmp( m_version, "HTTP/1.1" ) == 0;
+    if ( !m_chunked ) {
+        m_linger = false;
+        return true;
+    }
+    return add_text( transfer_encoding_chunked );
+}
 
+// whether the Connection header of the request names the header field name
+static bool connection_names( std::string_view connection, std::string_view name ) {
+    std::string_view token;
+    while ( next_element( connection, token ) ) {
+        if ( iequals( token, name ) ) {
             return true;
-        default:
+        }
+    }
+    return false;
+}
+
+// the request as the upstream gets it, nothing goes to the client yet. The headers
+// that only concern the hop to us stay behind, and so do the ones the client's
+// Connection names; the client's address is added to X-Forwarded-For
+bool http_conn::add_proxy_request() {
+    static const char* const methods[] = { "GET", "POST", "HEAD", "PUT" };
+    proxy_job& job = m_ws->proxy;
+    job.group = m_ws->reply.upstream;
+    job.conn = NULL;
+    job.head = m_method == HEAD;
+    job.http11 = strcasecmp( m_version, "HTTP/1.1" ) == 0;
+    job.keep_alive = m_linger;
+    job.idempotent = m_method != POST;
+    job.attempts = 0;
+
+    std::string& out = job.request;
+    out.assign( methods[ m_method ] ).append( " " ).append( m_url ).append( " HTTP/1.1\r\n" );
+    std::string_view connection = header( HEADER_CONNECTION );
+    std::string_view forwarded = header_names[ HEADER_X_FORWARDED_FOR ];
+    for ( int i = 0; i < m_header_count; ++i ) {
+        const http_header_field& field = m_ws->headers[ i ];
+        // the body has arrived already, nobody waits for a 100 Continue
+        if ( hop_by_hop_header( field.name ) || field.name == header_names[ HEADER_EXPECT ]
+                || field.name == forwarded || connection_names( connection, field.name ) ) {
+            continue;
+        }
+        out.append( field.name ).append( ": " ).append( field.value ).append( crlf );
+    }
+    out.append( forwarded ).append( ": " );
+    for ( int i = 0; i < m_header_count; ++i ) {
+        if ( m_ws->headers[ i ].name == forwarded ) {
+            out.append( m_ws->headers[ i ].value ).append( ", " );
+        }
+    }
+    char ip[ INET_ADDRSTRLEN ];
+    out.append( inet_ntop( AF_INET, &m_address.sin_addr, ip, sizeof( ip ) ) ).append( crlf ).append( crlf );
+    out.append( m_read_buf + m_checked_idx, m_content_length );
+    m_proxying = true;
+    return true;
+}
+
+// a status without a line of its own gets an empty reason phrase, "HTTP/1.1 422 \r\n"
+bool http_conn::add_status_line( int status ) {
+    std::string_view line = status_line( status );
+    if ( !line.empty() ) {
+        return add_text( line );
+    }
+    char text[ 16 ] = "HTTP/1.1 ";
+    char* p = append_uint( text + 9, status );
+    *p++ = ' ';
+    *p++ = '\r';
+    *p++ = '\n';
+    return add_text( std::string_view( text, p - text ) );
+}
+
+// one produce() of the stream is one chunk: its size line, the fragments and CRLF. The
+// last chunk follows the final data, the stream itself is dropped once that is sent
+bool http_conn::add_stream_chunk() {
+    stream_chunk& chunk = m_ws->chunk;
+    chunk.clear();
+    response_stream::STATUS status = m_ws->stream->produce( chunk, STREAM_BATCH );
+    if ( status == response_stream::FAILED ) {
+        LOG_WARN( "streamed response on fd %d failed, errno is: %d", m_sockfd, errno );
+        m_streaming = false;
+        return false;
+    }
+    if ( chunk.size() > 0 ) {
+        if ( m_chunked ) {
+            int start = m_write_idx;
+            char size[ 2 * sizeof( size_t ) + 2 ];
+            char* p = append_hex( size, chunk.size() );
+            *p++ = '\r';
+            *p++ = '\n';
+            if ( ! add_text( std::string_view( size, p - size ) ) ) {
+                return false;
+            }
+            add_iov( m_ws->write_buf + start, m_write_idx - start );
+        }
+        for ( const struct iovec& fragment : chunk.fragments() ) {
+            add_iov( (const char*)fragment.iov_base, fragment.iov_len );
+        }
+        if ( m_chunked ) {
+            add_iov( crlf.data(), crlf.size() );
+        }
+    }
+    if ( status == response_stream::DONE ) {
+        m_streaming = false;
+        if ( m_chunked ) {
+            add_iov( last_chunk.data(), last_chunk.size() );
+        }
+    }
+    return true;
+}
+
+// the response to a request that can't be served, everything but the
+// per-response headers comes from a page built at compile time
+static int error_status( http_conn::HTTP_CODE ret ) {
+    switch ( ret ) {
+        case http_conn::BAD_REQUEST: return 400;
+        case http_conn::FORBIDDEN_REQUEST: return 403;
+        case http_conn::NO_RESOURCE: return 404;
+        case http_conn::METHOD_NOT_ALLOWED: return 405;
+        case http_conn::BODY_TOO_LARGE: return 413;
+        case http_conn::HEADER_TOO_LARGE: return 431;
+        case http_conn::INTERNAL_ERROR: return 500;
+        case http_conn::NOT_IMPLEMENTED: return 501;
+        default: return 0;
+    }
+}
+
+int http_conn::response_status( HTTP_CODE ret ) const {
+    switch ( ret ) {
+        case FILE_REQUEST: return m_range_count > 0 ? 206 : 200;
+        case ROUTE_REQUEST: return m_ws->reply.status;
+        case STREAM_REQUEST: return 200;
+        case NOT_MODIFIED: return 304;
+        case RANGE_NOT_SATISFIABLE: return 416;
+        case UPLOAD_STORED: return m_ws->body->created() ? 201 : 204;
+        default: return error_status( ret );
+    }
+}
+
+bool http_conn::process_write( http_conn::HTTP_CODE ret ) {
+    int start = m_write_idx;
+    if ( ret == FILE_REQUEST && m_range_count > 0 ) {
+        return add_ranges();
+    }
+    if ( ret == FILE_REQUEST ) {
+        // prebuilt status line and entity headers straight from the entry, then the
+        // per-request ones; a long Cache-Control rule never eats into write_buf
+        add_iov( m_ws->file->header.data(), m_ws->file->header.size() );
+        if ( ! add_date() || ! add_linger() || ! add_blank_line() ) {
+            return false;
+        }
+        add_iov( m_ws->write_buf + start, m_write_idx - start );
+        add_body( 0, m_ws->file_stat.st_size );
+        // keeps the headers, the body or the fd alive until the response has been sent
+        m_ws->pinned[ m_pinned_count++ ] = m_ws->file;
+        return true;
+    }
+    if ( ret == NOT_MODIFIED ) {
+        // the validators the client already has, no body and nothing from the file
+        std::string_view status = status_line( 304 );
+        add_iov( status.data(), status.size() );
+        add_iov( m_ws->file->validators.data(), m_ws->file->validators.size() );
+        if ( ! add_date() || ! add_linger() || ! add_blank_line() ) {
             return false;
+        }
+        add_iov( m_ws->write_buf + start, m_write_idx - start );
+        m_ws->pinned[ m_pinned_count++ ] = m_ws->file;
+        return true;
+    }
+    if ( ret == ROUTE_REQUEST ) {
+        handler_reply& reply = m_ws->reply;
+        // the connection owns the stream from here on, a HEAD response only tells about it
+        m_ws->stream = reply.stream;
+        reply.stream = NULL;
+        bool streamed = m_ws->stream != NULL;
+        // 204 and 304 have neither a body nor a Content-Length
+        bool bodiless = reply.status == 204 || reply.status == 304;
+        if ( m_method == HEAD || bodiless ) {
+            delete m_ws->stream;
+            m_ws->stream = NULL;
+        }
+        if ( ! add_status_line( reply.status )
+                || ( !bodiless && !reply.content_type.empty() && ! add_field( content_type_prefix, reply.content_type ) )
+                || ( !bodiless && ! ( streamed ? add_stream_headers() : add_content_length( reply.body.size() ) ) ) ) {
+            return false;
+        }
+        add_iov( m_ws->write_buf + start, m_write_idx - start );
+        add_iov( reply.headers.data(), reply.headers.size() );
+        start = m_write_idx;
+        if ( ! add_date() || ! add_linger() || ! add_blank_line() ) {
+            return false;
+        }
+        add_iov( m_ws->write_buf + start, m_write_idx - start );
+        if ( m_method != HEAD && !bodiless ) {
+            add_iov( reply.body.data(), reply.body.size() );
+        }
+        m_streaming = m_ws->stream != NULL;
+        return !m_streaming || add_stream_chunk();
+    }
+    if ( ret == STREAM_REQUEST ) {
+        add_iov( m_ws->file->header.data(), m_ws->file->header.size() );
+        if ( ! add_stream_headers() || ! add_date() || ! add_linger() || ! add_blank_line() ) {
+            return false;
+        }
+        add_iov( m_ws->write_buf + start, m_write_idx - start );
+        m_ws->pinned[ m_pinned_count++ ] = m_ws->file;
+        // the first batch leaves together with the headers
+        m_streaming = m_ws->stream != NULL;
+        return !m_streaming || add_stream_chunk();
+    }
+    if ( ret == PROXY_REQUEST ) {
+        return add_proxy_request();
+    }
+    if ( ret == UPLOAD_STORED ) {
+        // a 204 has no Content-Length at all
+        int status = response_status( ret );
+        if ( ! add_text( status_line( status ) ) || ( status == 201 && ! add_content_length( 0 ) )
+                || ! add_date() || ! add_linger() || ! add_blank_line() ) {
+            return false;
+        }
+        add_iov( m_ws->write_buf + start, m_write_idx - start );
+        return true;
+    }
+    if ( ret == RANGE_NOT_SATISFIABLE ) {
+        char digits[ UINT_DIGITS ];
+        std::string_view size( digits, append_uint( digits, m_ws->file_stat.st_size ) - digits );
+        if ( ! add_text( status_line( 416 ) ) || ! add_field( content_range_unsatisfied, size )
+                || ! add_content_length( 0 ) || ! add_date() || ! add_linger() || ! add_blank_line() ) {
+            return false;
+        }
+        add_iov( m_ws->write_buf + start, m_write_idx - start );
+        return true;
     }
 
-    m_iv[ 0 ].iov_base = m_write_buf;
-    m_iv[ 0 ].iov_len = m_write_idx;
-    m_iv_count = 1;
-    bytes_to_send = m_write_idx;
+    error_page page = find_error_page( error_status( ret ) );
+    if ( page.head.empty() ) {
+        return false;
+    }
+    add_iov( page.head.data(), page.head.size() );
+    if ( ( ret == METHOD_NOT_ALLOWED && ! add_text( allow_get_head ) )
+            || ! add_date() || ! add_linger() || ! add_blank_line() ) {
+        return false;
+    }
+    add_iov( m_ws->write_buf + start, m_write_idx - start );
+    if ( m_method != HEAD ) {
+        add_iov( page.body.data(), page.body.size() );
+    }
     return true;
-}
\ No newline at end of file
+}
@@ -19,15 +19,41 @@
 #include <stdarg.h>
 #include <errno.h>
 #include "locker.h"
+#include "file_cache.h"
+#include "buffer_pool.h"
+#include "http_header.h"
+#include "cache_control.h"
+#include "metrics.h"
+#include "logger.h"
+#include "upload.h"
+#include "response_stream.h"
+#include "router.h"
+#include "proxy.h"
 #include <sys/uio.h>
+#include <sys/sendfile.h>
 #include <cstdio>
 
+class reactor;
+
 class http_conn {
+    friend class http_conn_bench;   // bench/ drives the parser and the response builder without a socket
 public:
     static const int FILENAME_LEN = 200;        // 文件名的最大长度
-    static const int READ_BUFFER_SIZE = 2048;   // 读缓冲区的大小
+    static const int READ_BUFFER_SIZE = 2048;   // 读缓冲区内联段的大小，更大的请求换用 m_read_pool 中的块
+    static const int DEFAULT_MAX_HEADER_SIZE = 16384;   // 默认能接受的最大请求（请求行 + 头部 + 请求体）
     static const int WRITE_BUFFER_SIZE = 1024;  // 写缓冲区的大小
-    // HTTP请求方法，这里只支持GET
+    static const int SMALL_FILE_SIZE = 512;     // 不超过该大小的文件直接拷贝到写缓冲区，更大的文件用 sendfile 发送
+    static const int MAX_SEND_PER_CALL = 4 << 20;   // 一次 write() 最多发送的字节数，避免大文件独占 reactor
+    static const int COMPRESS_MAX_SIZE = 8 << 20;   // 没有 .gz 文件时，不超过该大小的文件才会在内存中压缩
+    static const int MAX_PIPELINE = 16;         // 一次 process() 最多合并发送的流水线响应数
+    static const int RESPONSE_HEADER_RESERVE = 320; // 写缓冲区剩余空间少于该值时不再合并下一个响应
+    static const int MAX_HEADERS = 64;          // 一个请求最多的头部字段数，超出时返回 431
+    static const int MAX_RANGES = 16;           // Range 中最多的区间数，更多时忽略 Range 发送整个文件
+    static const int WORKSPACE_CACHE_MAX = 64;  // 每个线程缓存的空闲 workspace 数
+    static const int MAX_RECEIVE_PER_CALL = 4 << 20;    // 一次 read() 最多写入文件的请求体字节数，避免大上传独占 reactor
+    static const int64_t DEFAULT_MAX_UPLOAD = 1LL << 30;    // 默认能接受的最大上传请求体
+    static const int STREAM_BATCH = 64 << 10;   // 流式响应体每批生成的字节数，上一批写入 socket 后才生成下一批
+    // HTTP请求方法，支持GET和HEAD，设置了上传目录时还支持PUT和POST
     enum METHOD {GET = 0, POST, HEAD, PUT, DELETE, TRACE, OPTIONS, CONNECT};
     
     /*
@@ -35,9 +61,10 @@ public:
         CHECK_STATE_REQUESTLINE:当前正在分析请求行
         CHECK_STATE_HEADER:当前正在分析头部字段
         CHECK_STATE_CONTENT:当前正在解析请求体
-        requestline -> header -> content
+        CHECK_STATE_BODY:PUT/POST 的请求体正在写入文件
+        requestline -> header -> content / body
     */
-    enum CHECK_STATE { CHECK_STATE_REQUESTLINE = 0, CHECK_STATE_HEADER, CHECK_STATE_CONTENT };
+    enum CHECK_STATE { CHECK_STATE_REQUESTLINE = 0, CHECK_STATE_HEADER, CHECK_STATE_CONTENT, CHECK_STATE_BODY };
     
     /*
         服务器处理HTTP请求的可能结果，报文解析的结果
@@ -49,8 +76,22 @@ public:
         FILE_REQUEST        :   文件请求,获取文件成功
         INTERNAL_ERROR      :   表示服务器内部错误
         CLOSED_CONNECTION   :   表示客户端已经关闭连接了
+        HEADER_TOO_LARGE    :   读缓冲区已经不能再扩大，请求头仍不完整 (431)
+        BODY_TOO_LARGE      :   读缓冲区已经不能再扩大，请求体仍不完整 (413)
+        RANGE_NOT_SATISFIABLE : Range 中没有一个区间落在文件内 (416)
+        NOT_MODIFIED        :   客户端缓存的版本仍然有效，只发送响应头 (304)
+        ROUTE_REQUEST       :   由 m_router 中注册的处理函数回答，响应在 m_ws->reply 中
+        BODY_REQUEST        :   PUT/POST 的请求头已解析，请求体要写入 m_upload_dir 下的文件
+        UPLOAD_STORED       :   请求体已完整写入文件 (201，覆盖已有文件时 204)
+        METHOD_NOT_ALLOWED  :   没有设置上传目录时的 PUT/POST (405)
+        NOT_IMPLEMENTED     :   chunked 以外的 Transfer-Encoding (501)
+        STREAM_REQUEST      :   响应体由 m_ws->stream 边生成边发送，长度事先未知
+        PROXY_REQUEST       :   转发给 m_ws->proxy.group 中的上游服务器，响应由 reactor 转发
     */
-    enum HTTP_CODE { NO_REQUEST, GET_REQUEST, BAD_REQUEST, NO_RESOURCE, FORBIDDEN_REQUEST, FILE_REQUEST, INTERNAL_ERROR, CLOSED_CONNECTION };
+    enum HTTP_CODE { NO_REQUEST, GET_REQUEST, BAD_REQUEST, NO_RESOURCE, FORBIDDEN_REQUEST, FILE_REQUEST, INTERNAL_ERROR, CLOSED_CONNECTION,
+                     HEADER_TOO_LARGE, BODY_TOO_LARGE, RANGE_NOT_SATISFIABLE, NOT_MODIFIED, ROUTE_REQUEST,
+                     BODY_REQUEST, UPLOAD_STORED, METHOD_NOT_ALLOWED, NOT_IMPLEMENTED, STREAM_REQUEST,
+                     PROXY_REQUEST };
     
     // 从状态机的三种可能状态，即行的读取状态，分别表示
     // 1.读取到一个完整的行 2.行出错 3.行数据尚且不完整
@@ -61,51 +102,188 @@ public:
     '/r' or '/n' appears alone in a http request: OPEN -> BAD
     */
     enum LINE_STATUS { LINE_OK = 0, LINE_BAD, LINE_OPEN };
+
+    // 客户端在 Accept-Encoding 中接受的内容编码
+    enum CONTENT_ENCODING { ENCODING_GZIP = 1, ENCODING_BR = 2 };
+
+    // 谁在使用连接：epoll 的 reactor 把它交给 worker 时改为 OWNER_WORKER，worker 交回时改回；
+    // 这期间 reactor 要关闭它只能改为 OWNER_CLOSING，由 worker 在交回时关闭
+    enum OWNER { OWNER_REACTOR = 0, OWNER_WORKER, OWNER_CLOSING };
+
+    // Range 中的一个区间，first 和 last 都包含在内
+    struct byte_range {
+        off_t first;
+        off_t last;
+    };
 public:
-    http_conn(){}
-    ~http_conn(){}
-    
-public:
-    void init(int sockfd, const sockaddr_in& addr); // initialize new connection
-    void close_conn();  // close the connection
+    // initialize new connection; with ring set it is driven by that reactor's io_uring
+    // instead of epoll and a worker hands it back with reactor::resume()
+    void init(int sockfd, const sockaddr_in& addr, int epollfd, reactor* ring = NULL);
+    void close_conn();  // close the connection, or have the worker that has it close it at hand-back
     void process(); // process the request
+    void queued();  // the threadpool took it, process() follows
+    void rejected();    // the threadpool's queue was full, the reactor has it again
     bool read();// nonblocking read
     bool write();// nonblocking write
+    // write() finished a response and buffered requests are waiting, or a batch of a streamed
+    // body is out and a worker produces the next one
+    bool pipelined() const { return m_pipelined; }
+    bool has_input() const { return m_read_idx > 0; }
+    // the body of an upload is still arriving, the reactor keeps reading it without a worker
+    bool receiving() const { return m_ws && m_ws->body && m_ws->body->receiving(); }
+
+    // io_uring: what the connection waits for after process(), EPOLLIN, EPOLLOUT or 0 to be closed
+    int next_event() const { return m_next_event; }
+    // io_uring: received bytes are copied in rather than read, returns how many fit
+    size_t feed( const char* data, size_t len );
+    // io_uring: received bytes of an upload's body go to its file, returns how many belonged to it
+    size_t feed_body( const char* data, size_t len );
+
+    // the gathered responses are runs of iovecs, each but the last one followed by a range of
+    // file_fd(). write() and the io_uring reactor both send them with these
+    bool iov_run( struct msghdr& msg, bool& more ) const;  // the iovecs up to the next file range
+    void sent_iov( size_t bytes );
+    bool file_range( off_t& offset, off_t& count ) const;  // the range behind the iovecs just sent
+    void sent_file( off_t bytes );
+    int file_fd() const { return m_file_fd; }
+    bool sent_all() const { return m_iv_idx == m_iv_count && m_segment_idx == m_segment_count; }
+    bool end_response();    // forget what was sent, true to keep the connection
+
+    // reverse proxy: the request the reactor forwards once the responses before it are out, NULL if there is none
+    proxy_job* proxy() { return m_proxying ? &m_ws->proxy : NULL; }
+    bool end_proxy( int status, bool keep_alive );  // the upstream's response has been relayed, like end_response()
+    bool proxy_error( int status );     // there is no response from upstream, gather an error page for write()
+
+    // headers of the request being processed, the views are valid until the next request is parsed
+    std::string_view header( HEADER id ) const;         // empty if the request doesn't have it
+    std::string_view header( std::string_view name ) const; // any header, name is matched ignoring case
+    int header_count() const { return m_header_count; }
+    const http_header_field& header_field( int i ) const { return m_ws->headers[ i ]; }
 
 public:
-    static int m_epollfd;       // all socket events are registered on one epoll
-    static int m_user_count;    // number of users
+    static file_cache* m_file_cache;    // shared by all connections, NULL when caching is off
+    static buffer_pool* m_read_pool;    // overflow blocks of the read buffers, the block size is the
+                                        // largest request accepted; NULL keeps requests inline
+    static cache_control* m_cache_control;  // Cache-Control rules by URL prefix, NULL when there are none
+    static router* m_router;            // in-process handlers, they take a request before the files and uploads do; NULL when there are none
+    static const char* m_upload_dir;    // PUT/POST store their body under it at the request's URL, NULL refuses them
+    static int64_t m_max_upload;        // largest body of an upload, a bigger one gets 413
+    static std::atomic<bool> m_draining;    // the server stops: every response from now on closes its connection
 
 private:
     void init(); // initialize the connection
+    void init_request();    // get ready to parse the next request
+    void init_response();   // get ready to gather the next responses
+    void consume_request(); // drop the request just answered from the read buffer
+    void switch_read_buf( char* block );    // move the inline bytes to the front of a pooled block
+    void release_read_buf();    // go back to the inline segment
+    void acquire_workspace();   // before the first byte of a request is stored
+    void release_workspace();   // once nothing is buffered and nothing is left to send
+    void hand_back( int ev );   // give the connection back to its reactor after process()
+    void close_socket();        // what close_conn() does once no worker has the connection
 
     HTTP_CODE process_read();    // process the http request
     bool process_write( HTTP_CODE ret );    // return the http answer
+    int response_status( HTTP_CODE ret ) const; // the status process_write() answers ret with
 
     // called by process_read()
     HTTP_CODE parse_request_line( char* text );
     HTTP_CODE parse_headers( char* text );
-    HTTP_CODE parse_content( char* text );
+    HTTP_CODE end_headers();
+    HTTP_CODE parse_content();
     HTTP_CODE do_request();
+    HTTP_CODE route_request();
+    bool routed() const;
+    HTTP_CODE begin_upload();
+    HTTP_CODE open_upload();
+    HTTP_CODE finish_upload();
+    bool receive_body();
+    HTTP_CODE stat_file( struct stat& st );
+    bool stat_sidecar( const char* suffix, struct stat& st );
+    const char* predict_encoding( const struct stat& st, bool compress );
+    HTTP_CODE load_file( std::shared_ptr<file_entry>& entry, const struct stat& st, bool compress );
+    bool open_variant( file_entry& entry, const struct stat& st, const struct stat& origin,
+                       const char* encoding, bool vary );
+    void build_header( file_entry& entry, const struct stat& origin, const char* encoding, bool vary );
+    bool conditional() const;
+    bool not_modified( const file_entry& entry ) const;
+    bool if_range( const file_entry& entry ) const;
     char* get_line() { return m_read_buf + m_start_line; }
     LINE_STATUS parse_line();
 
     // called by process_write()
-    void unmap();
-    bool add_response( const char* format, ... );
-    bool add_content( const char* content );
-    bool add_content_type();
-    bool add_status_line( int status, const char* title );
-    bool add_headers( int content_length );
-    bool add_content_length( int content_length );
+    void close_file();
+    void add_iov( const char* base, size_t len );
+    void add_body( off_t first, off_t end );
+    void add_file_range( off_t first, off_t end );
+    bool add_ranges();
+    bool add_stream_chunk();
+    bool add_stream_headers();
+    bool add_proxy_request();
+    bool add_status_line( int status );
+    bool add_text( std::string_view text );
+    bool add_field( std::string_view prefix, std::string_view value );
+    bool add_content_length( off_t content_length );
+    bool add_content_range( off_t first, off_t last, off_t size );
+    bool add_date();
     bool add_linger();
     bool add_blank_line();
  
 private:
+    // 多区间响应中的一段：先发送 iv_end 之前的 iovec，再用 sendfile 发送 m_file_fd 的
+    // [file_offset, file_end)，file_offset 随发送前进，EAGAIN 后从这里继续
+    struct send_segment {
+        int iv_end;
+        off_t file_offset;
+        off_t file_end;
+    };
+
+    /*
+        只在请求进行中才需要的状态：缓冲区、解析出的头部、合并的响应。连接读到请求的
+        第一个字节时借来，响应发送完且没有流水线请求时还回，所以空闲的长连接只占用
+        http_conn 本身的几百字节。每个线程缓存最多 WORKSPACE_CACHE_MAX 个空闲的，
+        借还都不加锁；借和还几乎都在 reactor 线程上。
+    */
+    struct workspace {
+        char inline_buf[ READ_BUFFER_SIZE ];    // 读缓冲区的内联段，绝大多数请求只用到它
+        char write_buf[ WRITE_BUFFER_SIZE ];    // 写缓冲区
+        char real_file[ FILENAME_LEN ];         // 客户请求的目标文件的完整路径，其内容等于 doc_root + m_url
+        http_header_field headers[ MAX_HEADERS ];   // 请求的全部头部字段，按出现顺序，指向读缓冲区
+        std::string_view known[ HEADER_COUNT ];     // 已知头部字段的值，同名字段以第一个为准，m_known_set 标记有效的项
+        byte_range ranges[ MAX_RANGES ];        // Range 请求的区间，已限制在文件大小以内
+        file_ref file;                          // 当前请求要发送的文件条目（可能是压缩后的版本）
+        file_ref pinned[ MAX_PIPELINE ];        // 已合并的响应所引用的文件条目，发送完之前保持有效
+        // 已合并的响应：预先生成的响应头、写缓冲区中的响应头和内存中的响应体（206 还有一段验证器），
+        // 多区间响应的每个部分还要两个。流式响应体的一批可以有任意多段，不够时才会增长
+        std::vector<struct iovec> iv = std::vector<struct iovec>( 4 * MAX_PIPELINE + 2 * MAX_RANGES + 2 );
+        send_segment segments[ MAX_RANGES ];
+        std::string part_headers;               // multipart/byteranges 响应中每个部分的头部
+        handler_request request;                // 交给处理函数的请求，各字段指向读缓冲区
+        handler_reply reply;                    // 处理函数生成的响应，这样的响应总是一批中的最后一个
+        upload* body = NULL;                    // 正在写入文件的 PUT/POST 请求体
+        response_stream* stream = NULL;         // 正在发送的流式响应体，最后一批发送完后删除
+        stream_chunk chunk;                     // stream 最近一次生成的片段
+        proxy_job proxy;                        // 转发给上游的请求，reactor 转发完响应之前保持有效
+        struct stat file_stat;                  // 目标文件的状态
+        workspace* next;                        // 线程缓存中的下一个
+    };
+    struct workspace_cache {
+        workspace* head = NULL;
+        int count = 0;
+        ~workspace_cache();
+    };
+    static thread_local workspace_cache m_workspaces;
+
+    int m_epollfd;          // epoll of the reactor that owns this connection
+    reactor* m_ring;        // the io_uring reactor that owns it instead, NULL with epoll
+    std::atomic<int> m_owner;   // OWNER, epoll only: io_uring tracks the worker in ring_conn
+    int m_next_event;       // see next_event()
     int m_sockfd;           // the socket fd & address that the http connects to
     sockaddr_in m_address;
 
-    char m_read_buf[ READ_BUFFER_SIZE ];    // 读缓冲区
+    workspace* m_ws;                        // NULL while the connection is idle
+    char* m_read_buf;                       // 读缓冲区，指向 inline_buf 或者 m_read_pool 中的一块，空闲时为 NULL
+    int m_read_size;                        // 读缓冲区的大小
     int m_read_idx;                         // 标识读缓冲区中已经读入的客户端数据的最后一个字节的下一个位置
     int m_checked_idx;                      // 当前正在分析的字符在读缓冲区中的位置
     int m_start_line;                       // 当前正在解析的行的起始位置
@@ -113,22 +291,29 @@ private:
     CHECK_STATE m_check_state;              // 主状态机当前所处的状态
     METHOD m_method;                        // 请求方法
 
-    char m_real_file[ FILENAME_LEN ];       // 客户请求的目标文件的完整路径，其内容等于 doc_root + m_url, doc_root是网站根目录  
     char* m_url;                            // 客户请求的目标文件的文件名
     char* m_version;                        // HTTP协议版本号，我们仅支持HTTP1.1
-    char* m_host;                           // 主机名
+    int m_header_count;
+    uint64_t m_known_set;                   // known 中有效的项，每个 HEADER 一位，换请求时只需清零它
     int m_content_length;                   // HTTP请求的消息总长度
     bool m_linger;                          // HTTP请求是否要求保持连接
+    int m_accept_encoding;                  // CONTENT_ENCODING 的组合
+    int m_range_count;                      // 0 表示发送整个文件
 
-    char m_write_buf[ WRITE_BUFFER_SIZE ];  // 写缓冲区
     int m_write_idx;                        // 写缓冲区中待发送的字节数
-    char* m_file_address;                   // 客户请求的目标文件被mmap到内存中的起始位置
-    struct stat m_file_stat;                // 目标文件的状态。通过它我们可以判断文件是否存在、是否为目录、是否可读，并获取文件大小等信息
-    struct iovec m_iv[2];                   // 我们将采用writev来执行写操作，所以定义下面两个成员，其中m_iv_count表示被写内存块的数量。
+    int m_pinned_count;
     int m_iv_count;
-
-    int bytes_to_send;              // 将要发送的数据的字节数
-    int bytes_have_send;            // 已经发送的字节数
+    int m_iv_idx;                           // 第一个还没有发送完的 iovec
+    int m_file_fd;                          // 最后一个响应用 sendfile 发送的文件，-1 表示没有
+    int m_segment_count;
+    int m_segment_idx;                      // 第一个还没有发送完的段
+    bool m_keep_alive;                      // 已合并的响应发送完后是否保持连接
+    bool m_pipelined;                       // 见 pipelined()
+    bool m_streaming;                       // stream 还有没生成的部分
+    bool m_chunked;                         // 流式响应体按 chunked 编码发送，否则以关闭连接结束（HTTP/1.0）
+    bool m_proxying;                        // 最后一个请求已交给 reactor 转发，见 proxy()
+    uint64_t m_request_start;               // 读到请求第一个字节的时间，见 METRIC_PHASE
+    uint64_t m_phase_start;                 // 进入线程池队列或开始发送响应的时间
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,141 @@
+#ifndef HTTP_HEADER_H
+#define HTTP_HEADER_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string_view>
+
+// request headers the server knows by name, header_names[] holds them in the same order
+enum HEADER {
+    HEADER_ACCEPT = 0, HEADER_ACCEPT_ENCODING, HEADER_ACCEPT_LANGUAGE, HEADER_AUTHORIZATION,
+    HEADER_CACHE_CONTROL, HEADER_CONNECTION, HEADER_CONTENT_LENGTH, HEADER_CONTENT_TYPE,
+    HEADER_COOKIE, HEADER_EXPECT, HEADER_HOST, HEADER_IF_MATCH, HEADER_IF_MODIFIED_SINCE,
+    HEADER_IF_NONE_MATCH, HEADER_IF_RANGE, HEADER_IF_UNMODIFIED_SINCE, HEADER_ORIGIN,
+    HEADER_RANGE, HEADER_REFERER, HEADER_TE, HEADER_TRANSFER_ENCODING, HEADER_UPGRADE,
+    HEADER_USER_AGENT, HEADER_X_FORWARDED_FOR, HEADER_X_REAL_IP,
+    HEADER_COUNT,
+    HEADER_UNKNOWN = HEADER_COUNT
+};
+
+// lower case, the parser folds every header name once before looking it up
+constexpr std::string_view header_names[HEADER_COUNT] = {
+    "accept", "accept-encoding", "accept-language", "authorization",
+    "cache-control", "connection", "content-length", "content-type",
+    "cookie", "expect", "host", "if-match", "if-modified-since",
+    "if-none-match", "if-range", "if-unmodified-since", "origin",
+    "range", "referer", "te", "transfer-encoding", "upgrade",
+    "user-agent", "x-forwarded-for", "x-real-ip"
+};
+
+// one request header, both views point into the read buffer of the connection
+struct http_header_field {
+    std::string_view name;      // folded to lower case
+    std::string_view value;     // without the surrounding whitespace
+};
+
+/*
+    Perfect hash of header_names[]: the length, first and last byte of the folded
+    name tell the known names apart, the seed is searched at compile time so that
+    each of them lands in its own slot of a 128 entry table. A lookup is one hash
+    and one compare.
+*/
+namespace header_hash {
+
+constexpr int TABLE_BITS = 7;
+constexpr int TABLE_SIZE = 1 << TABLE_BITS;
+
+constexpr uint32_t hash(size_t len, unsigned char first, unsigned char last) {
+    return (uint32_t)len << 16 | (uint32_t)first << 8 | last;
+}
+
+constexpr uint32_t hash(std::string_view name) {
+    return hash(name.size(), name.front(), name.back());
+}
+
+constexpr uint32_t slot(uint32_t hash, uint32_t seed) {
+    return ((hash ^ seed) * 2654435761u) >> (32 - TABLE_BITS);
+}
+
+constexpr bool collides(uint32_t seed) {
+    bool used[TABLE_SIZE] = {};
+    for (int i = 0; i < HEADER_COUNT; ++i) {
+        uint32_t s = slot(hash(header_names[i]), seed);
+        if (used[s]) {
+            return true;
+        }
+        used[s] = true;
+    }
+    return false;
+}
+
+constexpr uint32_t find_seed() {
+    uint32_t seed = 0;
+    while (collides(seed)) {
+        ++seed;
+    }
+    return seed;
+}
+
+constexpr uint32_t SEED = find_seed();
+
+struct table {
+    uint8_t ids[TABLE_SIZE];
+};
+
+constexpr table make_table() {
+    table t = {};
+    for (int i = 0; i < TABLE_SIZE; ++i) {
+        t.ids[i] = HEADER_UNKNOWN;
+    }
+    for (int i = 0; i < HEADER_COUNT; ++i) {
+        t.ids[slot(hash(header_names[i]), SEED)] = i;
+    }
+    return t;
+}
+
+constexpr table TABLE = make_table();
+
+// tchar of RFC 9110, what a header name is made of
+struct token_chars {
+    bool ok[256];
+};
+
+constexpr token_chars make_token_chars() {
+    token_chars t = {};
+    for (int c = '0'; c <= '9'; ++c) t.ok[c] = true;
+    for (int c = 'a'; c <= 'z'; ++c) t.ok[c] = true;
+    for (int c = 'A'; c <= 'Z'; ++c) t.ok[c] = true;
+    for (const char* p = "!#$%&'*+-.^_`|~"; *p; ++p) t.ok[(unsigned char)*p] = true;
+    return t;
+}
+
+constexpr token_chars TOKEN = make_token_chars();
+
+}
+
+/*
+    Fold the header name at the start of line to lower case in place and find out
+    which known header it is, in one pass. Returns the end of the name, the caller
+    checks that a ':' is there.
+*/
+inline char* find_header(char* line, HEADER& id) {
+    char* p = line;
+    while (header_hash::TOKEN.ok[(unsigned char)*p]) {
+        if (*p >= 'A' && *p <= 'Z') {
+            *p += 'a' - 'A';
+        }
+        ++p;
+    }
+    size_t len = p - line;
+    id = HEADER_UNKNOWN;
+    if (len > 0) {
+        uint32_t h = header_hash::hash(len, line[0], p[-1]);
+        id = (HEADER)header_hash::TABLE.ids[header_hash::slot(h, header_hash::SEED)];
+        if (id != HEADER_UNKNOWN && header_names[id] != std::string_view(line, len)) {
+            id = HEADER_UNKNOWN;
+        }
+    }
+    return p;
+}
+
+#endif
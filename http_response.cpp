@@ -0,0 +1,256 @@
+#include <time.h>
+#include <string.h>
+#include "http_response.h"
+
+// "00010203...99", two digits at a time
+struct digit_pairs {
+    char data[200];
+};
+
+static constexpr digit_pairs make_digit_pairs() {
+    digit_pairs d = {};
+    for (int i = 0; i < 100; ++i) {
+        d.data[2 * i] = '0' + i / 10;
+        d.data[2 * i + 1] = '0' + i % 10;
+    }
+    return d;
+}
+
+static constexpr digit_pairs DIGITS = make_digit_pairs();
+
+char* append_uint(char* out, unsigned long long v) {
+    char buf[UINT_DIGITS];
+    char* p = buf + UINT_DIGITS;
+    while (v >= 100) {
+        p -= 2;
+        memcpy(p, DIGITS.data + 2 * (v % 100), 2);
+        v /= 100;
+    }
+    if (v >= 10) {
+        p -= 2;
+        memcpy(p, DIGITS.data + 2 * v, 2);
+    } else {
+        *--p = '0' + v;
+    }
+    size_t len = buf + UINT_DIGITS - p;
+    memcpy(out, p, len);
+    return out + len;
+}
+
+struct mime {
+    std::string_view ext;       // lower case, without the dot
+    std::string_view type;
+};
+
+// sorted by ext, checked below
+static constexpr mime mime_types[] = {
+    { "avif", "image/avif" },
+    { "bmp", "image/bmp" },
+    { "css", "text/css; charset=utf-8" },
+    { "csv", "text/csv; charset=utf-8" },
+    { "gif", "image/gif" },
+    { "gz", "application/gzip" },
+    { "htm", "text/html; charset=utf-8" },
+    { "html", "text/html; charset=utf-8" },
+    { "ico", "image/x-icon" },
+    { "jpeg", "image/jpeg" },
+    { "jpg", "image/jpeg" },
+    { "js", "text/javascript; charset=utf-8" },
+    { "json", "application/json" },
+    { "map", "application/json" },
+    { "mjs", "text/javascript; charset=utf-8" },
+    { "mp3", "audio/mpeg" },
+    { "mp4", "video/mp4" },
+    { "ogg", "audio/ogg" },
+    { "otf", "font/otf" },
+    { "pdf", "application/pdf" },
+    { "png", "image/png" },
+    { "svg", "image/svg+xml" },
+    { "tar", "application/x-tar" },
+    { "ttf", "font/ttf" },
+    { "txt", "text/plain; charset=utf-8" },
+    { "wasm", "application/wasm" },
+    { "wav", "audio/wav" },
+    { "webm", "video/webm" },
+    { "webp", "image/webp" },
+    { "woff", "font/woff" },
+    { "woff2", "font/woff2" },
+    { "xml", "application/xml" },
+    { "zip", "application/zip" },
+};
+
+static constexpr size_t MIME_COUNT = sizeof(mime_types) / sizeof(mime_types[0]);
+
+static constexpr bool mime_sorted() {
+    for (size_t i = 1; i < MIME_COUNT; ++i) {
+        if (!(mime_types[i - 1].ext < mime_types[i].ext)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static_assert(mime_sorted(), "mime_types must be sorted by extension for the binary search");
+
+static constexpr std::string_view default_mime_type = "application/octet-stream";
+
+std::string_view mime_type(std::string_view path) {
+    size_t dot = path.rfind('.');
+    if (dot == std::string_view::npos || path.find('/', dot) != std::string_view::npos) {
+        return default_mime_type;
+    }
+    std::string_view ext = path.substr(dot + 1);
+    char lower[8];
+    if (ext.empty() || ext.size() > sizeof(lower)) {
+        return default_mime_type;
+    }
+    for (size_t i = 0; i < ext.size(); ++i) {
+        char c = ext[i];
+        lower[i] = (c >= 'A' && c <= 'Z') ? c + ('a' - 'A') : c;
+    }
+    ext = std::string_view(lower, ext.size());
+
+    size_t lo = 0, hi = MIME_COUNT;
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if (mime_types[mid].ext < ext) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    if (lo < MIME_COUNT && mime_types[lo].ext == ext) {
+        return mime_types[lo].type;
+    }
+    return default_mime_type;
+}
+
+static const char week_days[7][4] = { "Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat" };
+static const char months[12][4] = { "Jan", "Feb", "Mar", "Apr", "May", "Jun",
+                                    "Jul", "Aug", "Sep", "Oct", "Nov", "Dec" };
+
+// fixed width, so no strftime() and no locale
+char* append_http_date(char* out, time_t t) {
+    struct tm tm;
+    gmtime_r(&t, &tm);
+    memcpy(out, week_days[tm.tm_wday], 3);
+    memcpy(out + 3, ", ", 2);
+    memcpy(out + 5, DIGITS.data + 2 * tm.tm_mday, 2);
+    out[7] = ' ';
+    memcpy(out + 8, months[tm.tm_mon], 3);
+    out[11] = ' ';
+    int year = tm.tm_year + 1900;
+    memcpy(out + 12, DIGITS.data + 2 * (year / 100 % 100), 2);
+    memcpy(out + 14, DIGITS.data + 2 * (year % 100), 2);
+    out[16] = ' ';
+    memcpy(out + 17, DIGITS.data + 2 * tm.tm_hour, 2);
+    out[19] = ':';
+    memcpy(out + 20, DIGITS.data + 2 * tm.tm_min, 2);
+    out[22] = ':';
+    memcpy(out + 23, DIGITS.data + 2 * tm.tm_sec, 2);
+    memcpy(out + 25, " GMT", 4);
+    return out + HTTP_DATE_LEN;
+}
+
+bool parse_http_date(std::string_view text, time_t& t) {
+    // IMF-fixdate, then the obsolete RFC 850 and asctime() forms
+    static const char* formats[] = { "%a, %d %b %Y %H:%M:%S GMT", "%A, %d-%b-%y %H:%M:%S GMT",
+                                     "%a %b %e %H:%M:%S %Y" };
+    char buf[64];
+    if (text.size() >= sizeof(buf)) {
+        return false;
+    }
+    memcpy(buf, text.data(), text.size());
+    buf[text.size()] = '\0';
+    for (const char* format : formats) {
+        struct tm tm;
+        memset(&tm, 0, sizeof(tm));
+        const char* end = strptime(buf, format, &tm);
+        if (end && *end == '\0') {
+            t = timegm(&tm);
+            return true;
+        }
+    }
+    return false;
+}
+
+std::string_view date_header() {
+    static thread_local time_t cached = 0;
+    static thread_local char buf[64] = "Date: ";
+    static const size_t len = 6 + HTTP_DATE_LEN + 2;
+    time_t now = time(NULL);
+    if (now != cached) {
+        memcpy(append_http_date(buf + 6, now), "\r\n", 2);
+        cached = now;
+    }
+    return std::string_view(buf, len);
+}
+
+// an error response head, laid out by the compiler
+struct page_head {
+    char data[128];
+    size_t size;
+
+    constexpr void append(std::string_view s) {
+        for (char c : s) {
+            data[size++] = c;
+        }
+    }
+
+    constexpr void append_number(size_t v) {
+        char digits[UINT_DIGITS] = {};
+        int n = 0;
+        do {
+            digits[n++] = '0' + v % 10;
+            v /= 10;
+        } while (v);
+        while (n) {
+            data[size++] = digits[--n];
+        }
+    }
+};
+
+static constexpr page_head make_head(int status, std::string_view body) {
+    page_head head = {};
+    head.append(status_line(status));
+    head.append(content_length_prefix);
+    head.append_number(body.size());
+    head.append(crlf);
+    head.append(content_type_prefix);
+    head.append("text/html; charset=utf-8");
+    head.append(crlf);
+    return head;
+}
+
+struct prebuilt_page {
+    int status;
+    std::string_view body;
+    page_head head;
+};
+
+static constexpr prebuilt_page make_page(int status, std::string_view body) {
+    return prebuilt_page{ status, body, make_head(status, body) };
+}
+
+static constexpr prebuilt_page prebuilt_pages[] = {
+    make_page(400, error_400_form),
+    make_page(403, error_403_form),
+    make_page(404, error_404_form),
+    make_page(405, error_405_form),
+    make_page(413, error_413_form),
+    make_page(431, error_431_form),
+    make_page(500, error_500_form),
+    make_page(501, error_501_form),
+    make_page(502, error_502_form),
+    make_page(503, error_503_form),
+    make_page(504, error_504_form),
+};
+
+error_page find_error_page(int status) {
+    for (const prebuilt_page& page : prebuilt_pages) {
+        if (page.status == status) {
+            return error_page{ std::string_view(page.head.data, page.head.size), page.body };
+        }
+    }
+    return error_page();
+}
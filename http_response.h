@@ -0,0 +1,103 @@
+#ifndef HTTP_RESPONSE_H
+#define HTTP_RESPONSE_H
+
+#include <stddef.h>
+#include <time.h>
+#include <string_view>
+
+/*
+    Pieces the response builder appends instead of formatting them: status lines
+    and header fragments are constants, lengths go through append_uint(), the
+    Content-Type comes from a table built at compile time and the Date header is
+    formatted once a second per thread. Fixed error responses are built
+    completely at compile time.
+*/
+
+// 定义HTTP响应的一些状态信息，错误响应的内容
+constexpr std::string_view error_400_form = "Your request has bad syntax or is inherently impossible to satisfy.\n";
+constexpr std::string_view error_403_form = "You do not have permission to get file from this server.\n";
+constexpr std::string_view error_404_form = "The requested file was not found on this server.\n";
+constexpr std::string_view error_405_form = "The requested method is not allowed on this server.\n";
+constexpr std::string_view error_413_form = "Your request body is larger than the server is willing to accept.\n";
+constexpr std::string_view error_431_form = "Your request header is larger than the server is willing to accept.\n";
+constexpr std::string_view error_500_form = "There was an unusual problem serving the requested file.\n";
+constexpr std::string_view error_501_form = "The transfer coding of your request body is not supported.\n";
+constexpr std::string_view error_502_form = "The upstream server failed to answer your request.\n";
+constexpr std::string_view error_503_form = "No upstream server is available to answer your request.\n";
+constexpr std::string_view error_504_form = "The upstream server did not answer your request in time.\n";
+
+// header fragments, the complete ones end with "\r\n"
+constexpr std::string_view content_length_prefix = "Content-Length: ";
+constexpr std::string_view content_type_prefix = "Content-Type: ";
+constexpr std::string_view content_encoding_prefix = "Content-Encoding: ";
+constexpr std::string_view content_range_prefix = "Content-Range: bytes ";
+constexpr std::string_view content_range_unsatisfied = "Content-Range: bytes */";
+constexpr std::string_view etag_prefix = "ETag: ";
+constexpr std::string_view last_modified_prefix = "Last-Modified: ";
+constexpr std::string_view accept_ranges_bytes = "Accept-Ranges: bytes\r\n";
+constexpr std::string_view vary_accept_encoding = "Vary: Accept-Encoding\r\n";
+constexpr std::string_view connection_keep_alive = "Connection: keep-alive\r\n";
+constexpr std::string_view connection_close = "Connection: close\r\n";
+constexpr std::string_view crlf = "\r\n";
+constexpr std::string_view transfer_encoding_chunked = "Transfer-Encoding: chunked\r\n";
+constexpr std::string_view last_chunk = "0\r\n\r\n";
+constexpr std::string_view cache_control_no_store = "Cache-Control: no-store\r\n";
+constexpr std::string_view allow_get_head = "Allow: GET, HEAD\r\n";
+constexpr std::string_view continue_100 = "HTTP/1.1 100 Continue\r\n\r\n";
+constexpr std::string_view metrics_content_type = "text/plain; version=0.0.4; charset=utf-8";
+
+// "HTTP/1.1 404 Not Found\r\n", empty for a status the server never sends
+constexpr std::string_view status_line(int status) {
+    switch (status) {
+        case 200: return "HTTP/1.1 200 OK\r\n";
+        case 201: return "HTTP/1.1 201 Created\r\n";
+        case 204: return "HTTP/1.1 204 No Content\r\n";
+        case 206: return "HTTP/1.1 206 Partial Content\r\n";
+        case 304: return "HTTP/1.1 304 Not Modified\r\n";
+        case 400: return "HTTP/1.1 400 Bad Request\r\n";
+        case 403: return "HTTP/1.1 403 Forbidden\r\n";
+        case 404: return "HTTP/1.1 404 Not Found\r\n";
+        case 405: return "HTTP/1.1 405 Method Not Allowed\r\n";
+        case 413: return "HTTP/1.1 413 Payload Too Large\r\n";
+        case 416: return "HTTP/1.1 416 Range Not Satisfiable\r\n";
+        case 431: return "HTTP/1.1 431 Request Header Fields Too Large\r\n";
+        case 500: return "HTTP/1.1 500 Internal Error\r\n";
+        case 501: return "HTTP/1.1 501 Not Implemented\r\n";
+        case 502: return "HTTP/1.1 502 Bad Gateway\r\n";
+        case 503: return "HTTP/1.1 503 Service Unavailable\r\n";
+        case 504: return "HTTP/1.1 504 Gateway Timeout\r\n";
+        default: return std::string_view();
+    }
+}
+
+// the longest decimal of an unsigned long long
+const int UINT_DIGITS = 20;
+
+// write v in decimal at out and return the end, two digits per step
+char* append_uint(char* out, unsigned long long v);
+
+// "Sun, 06 Nov 1994 08:49:37 GMT", out needs HTTP_DATE_LEN bytes
+const int HTTP_DATE_LEN = 29;
+char* append_http_date(char* out, time_t t);
+
+// any of the three HTTP-date formats, false if text is none of them
+bool parse_http_date(std::string_view text, time_t& t);
+
+// Content-Type of a path by its extension, application/octet-stream if unknown
+std::string_view mime_type(std::string_view path);
+
+// "Date: Sun, 06 Nov 1994 08:49:37 GMT\r\n", the view stays valid until the
+// same thread calls it again
+std::string_view date_header();
+
+// a complete error response apart from the Date and Connection headers:
+// head is status line, Content-Length and Content-Type, body follows the blank line
+struct error_page {
+    std::string_view head;
+    std::string_view body;
+};
+
+// empty for a status without a prebuilt page
+error_page find_error_page(int status);
+
+#endif
@@ -0,0 +1,152 @@
+#include <string.h>
+#include "http_scan.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HTTP_SCAN_X86
+#endif
+
+static inline bool line_stop(char c) {
+    unsigned char b = (unsigned char)c;
+    return (b < 0x20 && b != '\t') || b == 0x7f;
+}
+
+static const char* line_end_scalar(const char* p, const char* end) {
+    while (p < end && !line_stop(*p)) {
+        ++p;
+    }
+    return p;
+}
+
+static const char* space_scalar(const char* p, const char* end) {
+    while (p < end && *p != ' ' && *p != '\t') {
+        ++p;
+    }
+    return p;
+}
+
+#ifdef HTTP_SCAN_X86
+// PCMPESTRI over 16 bytes: the index of the first byte in one of the ranges
+__attribute__((target("sse4.2")))
+static const char* line_end_sse42(const char* p, const char* end) {
+    static const char ranges[16] = "\x00\x08\x0a\x1f\x7f\x7f";
+    const __m128i r = _mm_loadu_si128((const __m128i*)ranges);
+    for (; end - p >= 16; p += 16) {
+        __m128i b = _mm_loadu_si128((const __m128i*)p);
+        int i = _mm_cmpestri(r, 6, b, 16, _SIDD_UBYTE_OPS | _SIDD_CMP_RANGES | _SIDD_LEAST_SIGNIFICANT);
+        if (i != 16) {
+            return p + i;
+        }
+    }
+    return line_end_scalar(p, end);
+}
+
+__attribute__((target("sse4.2")))
+static const char* space_sse42(const char* p, const char* end) {
+    static const char set[16] = " \t";
+    const __m128i s = _mm_loadu_si128((const __m128i*)set);
+    for (; end - p >= 16; p += 16) {
+        __m128i b = _mm_loadu_si128((const __m128i*)p);
+        int i = _mm_cmpestri(s, 2, b, 16, _SIDD_UBYTE_OPS | _SIDD_CMP_EQUAL_ANY | _SIDD_LEAST_SIGNIFICANT);
+        if (i != 16) {
+            return p + i;
+        }
+    }
+    return space_scalar(p, end);
+}
+
+// 32 bytes per step, then one 16 byte step. The tail stays in this function on
+// purpose: calling the legacy encoded SSE version after AVX code costs more than
+// it saves. b <= 0x1f unsigned is min(b, 0x1f) == b
+__attribute__((target("avx2")))
+static const char* line_end_avx2(const char* p, const char* end) {
+    const __m256i ctl = _mm256_set1_epi8(0x1f);
+    const __m256i tab = _mm256_set1_epi8('\t');
+    const __m256i del = _mm256_set1_epi8(0x7f);
+    for (; end - p >= 32; p += 32) {
+        __m256i b = _mm256_loadu_si256((const __m256i*)p);
+        __m256i stop = _mm256_andnot_si256(_mm256_cmpeq_epi8(b, tab),
+                                           _mm256_cmpeq_epi8(_mm256_min_epu8(b, ctl), b));
+        stop = _mm256_or_si256(stop, _mm256_cmpeq_epi8(b, del));
+        unsigned int mask = (unsigned int)_mm256_movemask_epi8(stop);
+        if (mask) {
+            return p + __builtin_ctz(mask);
+        }
+    }
+    if (end - p >= 16) {
+        __m128i b = _mm_loadu_si128((const __m128i*)p);
+        __m128i stop = _mm_andnot_si128(_mm_cmpeq_epi8(b, _mm256_castsi256_si128(tab)),
+                                        _mm_cmpeq_epi8(_mm_min_epu8(b, _mm256_castsi256_si128(ctl)), b));
+        stop = _mm_or_si128(stop, _mm_cmpeq_epi8(b, _mm256_castsi256_si128(del)));
+        unsigned int mask = (unsigned int)_mm_movemask_epi8(stop);
+        if (mask) {
+            return p + __builtin_ctz(mask);
+        }
+        p += 16;
+    }
+    return line_end_scalar(p, end);
+}
+
+__attribute__((target("avx2")))
+static const char* space_avx2(const char* p, const char* end) {
+    const __m256i sp = _mm256_set1_epi8(' ');
+    const __m256i tab = _mm256_set1_epi8('\t');
+    for (; end - p >= 32; p += 32) {
+        __m256i b = _mm256_loadu_si256((const __m256i*)p);
+        unsigned int mask = (unsigned int)_mm256_movemask_epi8(
+            _mm256_or_si256(_mm256_cmpeq_epi8(b, sp), _mm256_cmpeq_epi8(b, tab)));
+        if (mask) {
+            return p + __builtin_ctz(mask);
+        }
+    }
+    if (end - p >= 16) {
+        __m128i b = _mm_loadu_si128((const __m128i*)p);
+        unsigned int mask = (unsigned int)_mm_movemask_epi8(
+            _mm_or_si128(_mm_cmpeq_epi8(b, _mm256_castsi256_si128(sp)),
+                         _mm_cmpeq_epi8(b, _mm256_castsi256_si128(tab))));
+        if (mask) {
+            return p + __builtin_ctz(mask);
+        }
+        p += 16;
+    }
+    return space_scalar(p, end);
+}
+#endif
+
+http_scan::scan_func http_scan::m_line_end = line_end_scalar;
+http_scan::scan_func http_scan::m_space = space_scalar;
+const char* http_scan::m_isa = "scalar";
+
+bool http_scan::select(const char* isa) {
+    if (strcmp(isa, "scalar") == 0) {
+        m_line_end = line_end_scalar;
+        m_space = space_scalar;
+        m_isa = "scalar";
+        return true;
+    }
+#ifdef HTTP_SCAN_X86
+    __builtin_cpu_init();
+    if (strcmp(isa, "avx2") == 0 && __builtin_cpu_supports("avx2")) {
+        m_line_end = line_end_avx2;
+        m_space = space_avx2;
+        m_isa = "avx2";
+        return true;
+    }
+    if (strcmp(isa, "sse4.2") == 0 && __builtin_cpu_supports("sse4.2")) {
+        m_line_end = line_end_sse42;
+        m_space = space_sse42;
+        m_isa = "sse4.2";
+        return true;
+    }
+#endif
+    return false;
+}
+
+// pick the best scanners before main() runs
+static struct scan_init {
+    scan_init() {
+        if (!http_scan::select("avx2")) {
+            http_scan::select("sse4.2");
+        }
+    }
+} init;
@@ -0,0 +1,34 @@
+#ifndef HTTP_SCAN_H
+#define HTTP_SCAN_H
+
+/*
+    Byte scanners used by the request parser. Each has an AVX2, an SSE4.2 and a
+    scalar version; the best one the CPU supports is picked once at startup.
+    They never read outside [p, end), the tail shorter than a vector is scanned
+    byte by byte.
+*/
+class http_scan {
+public:
+    typedef const char* (*scan_func)(const char* p, const char* end);
+
+    // the first byte in [p, end) that ends a line or may not appear in one: CR, LF,
+    // any other control character except HTAB, and DEL. end if there is none
+    static const char* line_end(const char* p, const char* end) { return m_line_end(p, end); }
+
+    // the first SP or HTAB in [p, end), end if there is none
+    static const char* space(const char* p, const char* end) { return m_space(p, end); }
+
+    // "avx2", "sse4.2" or "scalar"
+    static const char* isa() { return m_isa; }
+
+    // use the given implementation instead of the detected one, false if the CPU
+    // doesn't have it. Not thread safe, meant for benchmarks
+    static bool select(const char* isa);
+
+private:
+    static scan_func m_line_end;
+    static scan_func m_space;
+    static const char* m_isa;
+};
+
+#endif
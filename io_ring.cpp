@@ -0,0 +1,219 @@
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include "io_ring.h"
+
+static int io_uring_setup(unsigned entries, struct io_uring_params* p) {
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int io_uring_register(int fd, unsigned opcode, void* arg, unsigned nr_args) {
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+io_ring::io_ring() :
+m_fd(-1), m_sq_entries(0), m_cq_entries(0), m_sq_map(MAP_FAILED), m_sq_map_size(0),
+m_cq_map(MAP_FAILED), m_cq_map_size(0), m_sqes((struct io_uring_sqe*)MAP_FAILED), m_sqes_size(0),
+m_sq_head(NULL), m_sq_tail(NULL), m_sq_mask(0), m_sq_local_tail(0),
+m_cq_head(NULL), m_cq_tail(NULL), m_cq_mask(0), m_cqes(NULL), m_cq_local_head(0),
+m_buf_ring((struct io_uring_buf_ring*)MAP_FAILED), m_buf_ring_size(0), m_buf_mask(0), m_buf_tail(0),
+m_buffers(NULL), m_buffer_size(0), m_files(0) {}
+
+io_ring::~io_ring() {
+    if (m_fd != -1) {
+        close(m_fd);
+    }
+    if (m_sqes != MAP_FAILED) {
+        munmap(m_sqes, m_sqes_size);
+    }
+    if (m_cq_map != MAP_FAILED && m_cq_map != m_sq_map) {
+        munmap(m_cq_map, m_cq_map_size);
+    }
+    if (m_sq_map != MAP_FAILED) {
+        munmap(m_sq_map, m_sq_map_size);
+    }
+    if (m_buf_ring != MAP_FAILED) {
+        munmap(m_buf_ring, m_buf_ring_size);
+    }
+    free(m_buffers);
+}
+
+bool io_ring::init(unsigned entries, unsigned buffers, unsigned buffer_size, unsigned files) {
+    // SINGLE_ISSUER and DEFER_TASKRUN (6.1) also tell us that multishot recv (6.0) is there
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_R_DISABLED | IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN
+        | IORING_SETUP_SUBMIT_ALL | IORING_SETUP_CQSIZE;
+    p.cq_entries = entries * 4;
+    m_fd = io_uring_setup(entries, &p);
+    if (m_fd < 0) {
+        m_fd = -1;
+        return false;
+    }
+    if (!(p.features & IORING_FEAT_NODROP)) {
+        return false;
+    }
+    m_sq_entries = p.sq_entries;
+    m_cq_entries = p.cq_entries;
+
+    m_sq_map_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    m_cq_map_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (m_cq_map_size > m_sq_map_size) {
+            m_sq_map_size = m_cq_map_size;
+        }
+        m_cq_map_size = m_sq_map_size;
+    }
+    m_sq_map = mmap(NULL, m_sq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_SQ_RING);
+    if (m_sq_map == MAP_FAILED) {
+        return false;
+    }
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        m_cq_map = m_sq_map;
+    } else {
+        m_cq_map = mmap(NULL, m_cq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_CQ_RING);
+        if (m_cq_map == MAP_FAILED) {
+            return false;
+        }
+    }
+    m_sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    m_sqes = (struct io_uring_sqe*)mmap(NULL, m_sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                                         m_fd, IORING_OFF_SQES);
+    if (m_sqes == MAP_FAILED) {
+        return false;
+    }
+
+    char* sq = (char*)m_sq_map;
+    m_sq_head = (unsigned*)(sq + p.sq_off.head);
+    m_sq_tail = (unsigned*)(sq + p.sq_off.tail);
+    m_sq_mask = *(unsigned*)(sq + p.sq_off.ring_mask);
+    m_sq_local_tail = *m_sq_tail;
+    // SQE i always sits in slot i, so the index array is filled once
+    unsigned* array = (unsigned*)(sq + p.sq_off.array);
+    for (unsigned i = 0; i < p.sq_entries; ++i) {
+        array[i] = i;
+    }
+    char* cq = (char*)m_cq_map;
+    m_cq_head = (unsigned*)(cq + p.cq_off.head);
+    m_cq_tail = (unsigned*)(cq + p.cq_off.tail);
+    m_cq_mask = *(unsigned*)(cq + p.cq_off.ring_mask);
+    m_cqes = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+    m_cq_local_head = *m_cq_head;
+
+    // every opcode the reactor submits
+    static const uint8_t needed[] = { IORING_OP_ACCEPT, IORING_OP_RECV, IORING_OP_SEND, IORING_OP_SENDMSG,
+                                      IORING_OP_READ, IORING_OP_ASYNC_CANCEL, IORING_OP_FILES_UPDATE };
+    size_t probe_size = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe* probe = (struct io_uring_probe*)calloc(1, probe_size);
+    if (!probe || io_uring_register(m_fd, IORING_REGISTER_PROBE, probe, 256) < 0) {
+        free(probe);
+        return false;
+    }
+    for (uint8_t op : needed) {
+        if (op > probe->last_op || !(probe->ops[op].flags & IO_URING_OP_SUPPORTED)) {
+            free(probe);
+            return false;
+        }
+    }
+    free(probe);
+
+    // provided buffer ring, entries must be a power of two
+    unsigned count = 1;
+    while (count < buffers) {
+        count <<= 1;
+    }
+    if (count > 32768) {
+        return false;
+    }
+    m_buf_ring_size = count * sizeof(struct io_uring_buf);
+    m_buf_ring = (struct io_uring_buf_ring*)mmap(NULL, m_buf_ring_size, PROT_READ | PROT_WRITE,
+                                                  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (m_buf_ring == MAP_FAILED) {
+        return false;
+    }
+    m_buffer_size = buffer_size;
+    if (posix_memalign((void**)&m_buffers, 4096, (size_t)count * buffer_size) != 0) {
+        m_buffers = NULL;
+        return false;
+    }
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)m_buf_ring;
+    reg.ring_entries = count;
+    reg.bgid = BUFFER_GROUP;
+    if (io_uring_register(m_fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        return false;
+    }
+    m_buf_mask = count - 1;
+    for (unsigned i = 0; i < count; ++i) {
+        recycle(i);
+    }
+
+    // registered fds are optional, without them every op looks the fd up
+    struct io_uring_rsrc_register files_reg;
+    memset(&files_reg, 0, sizeof(files_reg));
+    files_reg.nr = files;
+    files_reg.flags = IORING_RSRC_REGISTER_SPARSE;
+    if (io_uring_register(m_fd, IORING_REGISTER_FILES2, &files_reg, sizeof(files_reg)) == 0) {
+        m_files = files;
+    }
+    return true;
+}
+
+bool io_ring::enable() {
+    return io_uring_register(m_fd, IORING_REGISTER_ENABLE_RINGS, NULL, 0) == 0;
+}
+
+struct io_uring_sqe* io_ring::get_sqe() {
+    unsigned head = __atomic_load_n(m_sq_head, __ATOMIC_ACQUIRE);
+    if (m_sq_local_tail - head >= m_sq_entries) {
+        submit(0);
+        head = __atomic_load_n(m_sq_head, __ATOMIC_ACQUIRE);
+        if (m_sq_local_tail - head >= m_sq_entries) {
+            return NULL;
+        }
+    }
+    struct io_uring_sqe* sqe = &m_sqes[m_sq_local_tail & m_sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    ++m_sq_local_tail;
+    return sqe;
+}
+
+int io_ring::submit(unsigned wait_nr) {
+    unsigned tail = *m_sq_tail;
+    unsigned to_submit = m_sq_local_tail - tail;
+    __atomic_store_n(m_sq_tail, m_sq_local_tail, __ATOMIC_RELEASE);
+    // DEFER_TASKRUN only runs completions when we ask for events
+    int ret = io_uring_enter(m_fd, to_submit, wait_nr, IORING_ENTER_GETEVENTS);
+    return ret < 0 ? -errno : ret;
+}
+
+struct io_uring_cqe* io_ring::peek_cqe() {
+    unsigned tail = __atomic_load_n(m_cq_tail, __ATOMIC_ACQUIRE);
+    if (m_cq_local_head == tail) {
+        return NULL;
+    }
+    return &m_cqes[m_cq_local_head++ & m_cq_mask];
+}
+
+void io_ring::seen() {
+    __atomic_store_n(m_cq_head, m_cq_local_head, __ATOMIC_RELEASE);
+}
+
+void io_ring::recycle(uint16_t bid) {
+    // not m_buf_ring->bufs: in C++ the empty struct __DECLARE_FLEX_ARRAY puts in front of it
+    // takes a byte and moves the array off the tail it has to overlay
+    struct io_uring_buf* buf = (struct io_uring_buf*)m_buf_ring + (m_buf_tail & m_buf_mask);
+    buf->addr = (uint64_t)(uintptr_t)buffer(bid);
+    buf->len = m_buffer_size;
+    buf->bid = bid;
+    ++m_buf_tail;
+    __atomic_store_n(&m_buf_ring->tail, m_buf_tail, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,74 @@
+#ifndef IO_RING_H
+#define IO_RING_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <linux/io_uring.h>
+
+/*
+    A minimal io_uring on raw syscalls, enough for one reactor: the SQ/CQ rings,
+    one ring of provided receive buffers and a sparse table of registered fds.
+    Only the thread that enabled the ring may touch it (IORING_SETUP_SINGLE_ISSUER),
+    so nothing here is locked.
+*/
+class io_ring {
+public:
+    io_ring();
+    ~io_ring();
+
+    // create a disabled ring, false if the kernel lacks anything the reactor needs.
+    // Registration happens here, enable() is called by the thread that uses the ring
+    bool init(unsigned entries, unsigned buffers, unsigned buffer_size, unsigned files);
+    bool enable();
+
+    // NULL when the submission queue is full even after submitting it
+    struct io_uring_sqe* get_sqe();
+
+    // submit what is queued and wait for at least wait_nr completions, -errno on failure
+    int submit(unsigned wait_nr);
+
+    // completions are consumed in order, seen() releases the ones looked at so far
+    struct io_uring_cqe* peek_cqe();
+    void seen();
+
+    // provided buffers, picked by the kernel for IOSQE_BUFFER_SELECT from group BUFFER_GROUP
+    static const uint16_t BUFFER_GROUP = 0;
+    char* buffer(uint16_t bid) const { return m_buffers + (size_t)bid * m_buffer_size; }
+    unsigned buffer_count() const { return m_buf_mask + 1; }
+    void recycle(uint16_t bid);
+
+    bool fixed_files() const { return m_files > 0; }
+
+private:
+    int m_fd;
+    unsigned m_sq_entries;
+    unsigned m_cq_entries;
+
+    // mappings of the kernel rings
+    void* m_sq_map;
+    size_t m_sq_map_size;
+    void* m_cq_map;
+    size_t m_cq_map_size;
+    struct io_uring_sqe* m_sqes;
+    size_t m_sqes_size;
+
+    unsigned* m_sq_head;
+    unsigned* m_sq_tail;
+    unsigned m_sq_mask;
+    unsigned m_sq_local_tail;   // SQEs handed out but not yet published to the kernel
+    unsigned* m_cq_head;
+    unsigned* m_cq_tail;
+    unsigned m_cq_mask;
+    struct io_uring_cqe* m_cqes;
+    unsigned m_cq_local_head;
+
+    struct io_uring_buf_ring* m_buf_ring;
+    size_t m_buf_ring_size;
+    unsigned m_buf_mask;
+    uint16_t m_buf_tail;
+    char* m_buffers;
+    unsigned m_buffer_size;
+    unsigned m_files;
+};
+
+#endif
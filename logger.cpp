@@ -0,0 +1,236 @@
+#include <sys/eventfd.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "logger.h"
+
+int logger::m_level = LEVEL_INFO;
+thread_local logger::thread_ring* logger::m_ring = NULL;
+std::atomic<logger::thread_ring*> logger::m_rings(NULL);
+std::atomic<bool> logger::m_started(false);
+
+// the flusher, only touched by start(), stop() and the flusher thread itself
+static int log_fd = STDOUT_FILENO;
+static int log_wakefd = -1;
+static pthread_t log_thread;
+static volatile bool log_stop = false;
+static uint64_t log_reported = 0;              // drops already reported
+
+static const char* const level_names[] = { "DEBUG", "INFO ", "WARN ", "ERROR" };
+
+static const int BATCH_SIZE = 64 * 1024;
+static const int PREFIX_LEN = 33;              // "2026-10-18 05:20:47.123456 ERROR "
+
+static uint64_t realtime_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// "2026-10-18 05:20:47.123456 INFO  ", the date part is formatted once a second
+static int format_prefix(char* out, uint64_t time, int level) {
+    static thread_local time_t last = -1;
+    static thread_local char date[24];
+    time_t sec = time / 1000000000;
+    if (sec != last) {
+        struct tm tm;
+        localtime_r(&sec, &tm);
+        strftime(date, sizeof(date), "%Y-%m-%d %H:%M:%S", &tm);
+        last = sec;
+    }
+    if (level < LEVEL_DEBUG || level > LEVEL_ERROR) {
+        level = LEVEL_ERROR;
+    }
+    return snprintf(out, PREFIX_LEN + 1, "%s.%06u %s ", date, (unsigned)(time % 1000000000 / 1000),
+                    level_names[level]);
+}
+
+static void write_all(const char* data, size_t len) {
+    while (len > 0) {
+        ssize_t n = ::write(log_fd, data, len);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return;     // nowhere left to complain to
+        }
+        data += n;
+        len -= n;
+    }
+}
+
+// a trailing "\n" is dropped, every record gets exactly one
+static size_t trim_newline(const char* text, size_t len) {
+    while (len > 0 && text[len - 1] == '\n') {
+        --len;
+    }
+    return len;
+}
+
+bool logger::start(const char* path) {
+    if (path && strcmp(path, "-") != 0) {
+        log_fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        if (log_fd == -1) {
+            log_fd = STDOUT_FILENO;
+            return false;
+        }
+    }
+    log_wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (log_wakefd == -1) {
+        return false;
+    }
+    log_stop = false;
+    if (pthread_create(&log_thread, NULL, flusher, NULL) != 0) {
+        close(log_wakefd);
+        log_wakefd = -1;
+        return false;
+    }
+    m_started.store(true, std::memory_order_release);
+    return true;
+}
+
+// the other threads are done logging by now, whatever they left in their rings is written
+void logger::stop() {
+    if (!m_started.load(std::memory_order_relaxed)) {
+        return;
+    }
+    m_started.store(false, std::memory_order_release);
+    log_stop = true;
+    uint64_t one = 1;
+    ::write(log_wakefd, &one, sizeof(one));
+    pthread_join(log_thread, NULL);
+    close(log_wakefd);
+    log_wakefd = -1;
+    if (log_fd != STDOUT_FILENO) {
+        close(log_fd);
+        log_fd = STDOUT_FILENO;
+    }
+}
+
+// once per thread, the ring outlives the thread so nothing it logged is lost
+logger::thread_ring* logger::enroll() {
+    thread_ring* r = new thread_ring;
+    r->head.store(0, std::memory_order_relaxed);
+    r->tail.store(0, std::memory_order_relaxed);
+    r->dropped.store(0, std::memory_order_relaxed);
+    r->next = m_rings.load(std::memory_order_relaxed);
+    while (!m_rings.compare_exchange_weak(r->next, r, std::memory_order_release, std::memory_order_relaxed)) {
+    }
+    m_ring = r;
+    return r;
+}
+
+void logger::write(int level, const char* fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    if (!m_started.load(std::memory_order_acquire)) {
+        write_sync(level, fmt, args);
+        va_end(args);
+        return;
+    }
+    thread_ring* r = m_ring ? m_ring : enroll();
+    uint32_t tail = r->tail.load(std::memory_order_relaxed);
+    uint32_t used = tail - r->head.load(std::memory_order_acquire);
+    if (used == RING_RECORDS) {
+        r->dropped.store(r->dropped.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        va_end(args);
+        return;
+    }
+    record& rec = r->records[tail & (RING_RECORDS - 1)];
+    rec.time = realtime_ns();
+    rec.level = level;
+    int n = vsnprintf(rec.text, sizeof(rec.text), fmt, args);
+    va_end(args);
+    if (n < 0) {
+        n = 0;
+    } else if (n >= (int)sizeof(rec.text)) {
+        n = sizeof(rec.text) - 1;
+    }
+    rec.len = trim_newline(rec.text, n);
+    r->tail.store(tail + 1, std::memory_order_release);
+    // a ring filling up doesn't wait for the next FLUSH_MS
+    if (used + 1 == RING_RECORDS / 2) {
+        uint64_t one = 1;
+        ::write(log_wakefd, &one, sizeof(one));
+    }
+}
+
+void logger::write_sync(int level, const char* fmt, va_list args) {
+    char line[PREFIX_LEN + RECORD_SIZE + 1];
+    int len = format_prefix(line, realtime_ns(), level);
+    int n = vsnprintf(line + len, RECORD_SIZE, fmt, args);
+    if (n < 0) {
+        n = 0;
+    } else if (n >= RECORD_SIZE) {
+        n = RECORD_SIZE - 1;
+    }
+    len += trim_newline(line + len, n);
+    line[len++] = '\n';
+    write_all(line, len);
+}
+
+uint64_t logger::dropped() {
+    uint64_t total = 0;
+    for (thread_ring* r = m_rings.load(std::memory_order_acquire); r; r = r->next) {
+        total += r->dropped.load(std::memory_order_relaxed);
+    }
+    return total;
+}
+
+// one pass over every ring, false if there was nothing to write
+bool logger::drain() {
+    static char batch[BATCH_SIZE];
+    size_t len = 0;
+    bool any = false;
+    for (thread_ring* r = m_rings.load(std::memory_order_acquire); r; r = r->next) {
+        uint32_t head = r->head.load(std::memory_order_relaxed);
+        uint32_t tail = r->tail.load(std::memory_order_acquire);
+        for (; head != tail; ++head) {
+            const record& rec = r->records[head & (RING_RECORDS - 1)];
+            if (len + PREFIX_LEN + rec.len + 1 > sizeof(batch)) {
+                write_all(batch, len);
+                len = 0;
+            }
+            len += format_prefix(batch + len, rec.time, rec.level);
+            memcpy(batch + len, rec.text, rec.len);
+            len += rec.len;
+            batch[len++] = '\n';
+            any = true;
+        }
+        // the records are copied, the owner may reuse their slots
+        r->head.store(tail, std::memory_order_release);
+    }
+    uint64_t total = dropped();
+    if (total > log_reported) {
+        if (len + PREFIX_LEN + 64 > sizeof(batch)) {
+            write_all(batch, len);
+            len = 0;
+        }
+        len += format_prefix(batch + len, realtime_ns(), LEVEL_WARN);
+        len += snprintf(batch + len, 64, "%llu log records dropped\n", (unsigned long long)(total - log_reported));
+        log_reported = total;
+    }
+    write_all(batch, len);
+    return any;
+}
+
+void* logger::flusher(void*) {
+    struct pollfd pfd;
+    pfd.fd = log_wakefd;
+    pfd.events = POLLIN;
+    while (!log_stop) {
+        if (poll(&pfd, 1, FLUSH_MS) > 0) {
+            uint64_t count;
+            ::read(log_wakefd, &count, sizeof(count));
+        }
+        while (drain()) {
+        }
+    }
+    drain();
+    return NULL;
+}
@@ -0,0 +1,74 @@
+#ifndef LOGGER_H
+#define LOGGER_H
+
+#include <stdint.h>
+#include <stdarg.h>
+#include <atomic>
+
+enum LOG_LEVEL { LEVEL_DEBUG = 0, LEVEL_INFO, LEVEL_WARN, LEVEL_ERROR, LEVEL_OFF };
+
+// calls below this level are compiled out, e.g. -DLOG_COMPILE_LEVEL=1 drops LOG_DEBUG
+#ifndef LOG_COMPILE_LEVEL
+#define LOG_COMPILE_LEVEL LEVEL_DEBUG
+#endif
+
+#define LOG_AT(level, fmt, ...) \
+    do { \
+        if ((level) >= LOG_COMPILE_LEVEL && (level) >= logger::m_level) { \
+            logger::write((level), fmt, ##__VA_ARGS__); \
+        } \
+    } while (0)
+
+#define LOG_DEBUG(fmt, ...) LOG_AT(LEVEL_DEBUG, fmt, ##__VA_ARGS__)
+#define LOG_INFO(fmt, ...) LOG_AT(LEVEL_INFO, fmt, ##__VA_ARGS__)
+#define LOG_WARN(fmt, ...) LOG_AT(LEVEL_WARN, fmt, ##__VA_ARGS__)
+#define LOG_ERROR(fmt, ...) LOG_AT(LEVEL_ERROR, fmt, ##__VA_ARGS__)
+
+/*
+    Asynchronous logger. A thread formats its records straight into a ring of its own
+    (single producer, single consumer, fixed-size records, no lock and no allocation),
+    and a background thread drains every ring in batches with one write() per batch.
+    When a ring is full the record is dropped and counted instead of waiting, so a
+    reactor never blocks on the log; the flusher reports the drops as a record of its
+    own. Before start() and after stop() records are written synchronously.
+*/
+class logger {
+public:
+    static const int RECORD_SIZE = 256;         // a longer message is cut
+    static const int RING_RECORDS = 1024;       // per thread, a power of two
+    static const int FLUSH_MS = 50;             // the flusher wakes at least this often
+
+    static bool start(const char* path);        // NULL or "-" is stdout
+    static void stop();                         // drain everything and join the flusher
+
+    static void write(int level, const char* fmt, ...) __attribute__((format(printf, 2, 3)));
+    static uint64_t dropped();
+
+    static int m_level;                         // runtime level, set before the threads start
+
+private:
+    struct record {
+        uint64_t time;                          // CLOCK_REALTIME, ns
+        uint16_t len;
+        uint8_t level;
+        char text[RECORD_SIZE - 11];
+    };
+    struct thread_ring {
+        alignas(64) std::atomic<uint32_t> head; // the flusher's
+        alignas(64) std::atomic<uint32_t> tail; // the owner's
+        std::atomic<uint64_t> dropped;
+        thread_ring* next;
+        record records[RING_RECORDS];
+    };
+
+    static thread_ring* enroll();
+    static void write_sync(int level, const char* fmt, va_list args);
+    static void* flusher(void* arg);
+    static bool drain();
+
+    static thread_local thread_ring* m_ring;
+    static std::atomic<thread_ring*> m_rings;
+    static std::atomic<bool> m_started;
+};
+
+#endif
@@ -1,203 +1,175 @@
 #ifndef LST_TIMER
 #define LST_TIMER
 
-#include <stdio.h>
-#include <time.h>
+#include <stdint.h>
+#include <stddef.h>
 #include <arpa/inet.h>
 
 #define BUFFER_SIZE 64
-class util_timer;   // 前向声明
+struct client_data;   // 前向声明
 
-// 用户数据结构
-struct client_data
-{
-    sockaddr_in address;    // 客户端socket地址
-    int sockfd;             // socket文件描述符
-    util_timer* timer;          // 定时器
-};
-
-// 定时器类
+// 定时器，直接嵌入在 client_data 中（侵入式），挂在时间轮某个槽位的双向循环链表上。
+// 没有构造函数：按 fd 索引的表由零页组成，全零就是一个没挂上的定时器，回调和用户数据
+// 由 start_timer() 设置，不按 fd 索引的要值初始化
 class util_timer {
 public:
-    util_timer() : prev(NULL), next(NULL){}
+    bool linked() const { return next != NULL; }
 
 public:
-   time_t expire;   // 任务超时时间，这里使用绝对时间
+   uint64_t expire;   // 任务超时时间，以时间轮的滴答数表示的绝对时间
    void (*cb_func)( client_data*); // 任务回调函数，回调函数处理的客户数据，由定时器的执行者传递给回调函数
-   client_data* user_data; 
+   client_data* user_data;
    util_timer* prev;    // 指向前一个定时器
    util_timer* next;    // 指向后一个定时器
 };
 
-// 定时器链表，它是一个升序、双向链表，且带有头节点和尾节点。
-class sort_timer_lst {
+// 用户数据结构
+struct client_data
+{
+    sockaddr_in address;    // 客户端socket地址
+    int sockfd;             // socket文件描述符
+    util_timer timer;       // 定时器，随连接一起分配，不再单独 new
+};
+
+/*
+    分层时间轮。共 WHEEL_LEVELS 层，每层 WHEEL_SIZE 个槽，第 0 层每个槽代表一个滴答，
+    第 n 层每个槽代表 WHEEL_SIZE^n 个滴答。添加、调整、删除定时器都是 O(1) 的链表操作；
+    当低层转完一圈时，把高一层当前槽中的定时器重新分配（cascade）到低层。
+    时间轮本身不读时钟，由调用者（reactor 中的 timerfd）驱动 tick()。
+*/
+class time_wheel {
 public:
-    sort_timer_lst() : head( NULL ), tail( NULL ) {}
-    // 链表被销毁时，删除其中所有的定时器
-    ~sort_timer_lst() {
-        util_timer* tmp = head;
-        while( tmp ) {
-            head = tmp->next;
-            delete tmp;
-            tmp = head;
-        }
-    }
-    
-    // 将目标定时器timer添加到链表中
-    void add_timer( util_timer* timer ) {
-        printf("%d\n", head);
-        printf("%d\n", timer);
-        if( !timer ) {
-            printf("add_timer: timer is null\n");
-            return;
-        }
-        if( !head ) {
-            head = timer;
-            tail = timer;
-            printf("add_timer: head is not null\n");
-            return; 
-        }
-        /* 如果目标定时器的超时时间小于当前链表中所有定时器的超时时间，则把该定时器插入链表头部,作为链表新的头节点，
-           否则就需要调用重载函数 add_timer(),把它插入链表中合适的位置，以保证链表的升序特性 */
-        if( timer->expire < head->expire ) {
-            timer->next = head;
-            head->prev = timer;
-            head = timer;
-            return;
+    static const int WHEEL_BITS = 6;
+    static const int WHEEL_SIZE = 1 << WHEEL_BITS;
+    static const int WHEEL_MASK = WHEEL_SIZE - 1;
+    static const int WHEEL_LEVELS = 4;
+    static const uint64_t MAX_TIMEOUT = ( 1ULL << ( WHEEL_BITS * WHEEL_LEVELS ) ) - 1;
+
+    time_wheel() : m_now( 0 ), m_count( 0 ) {
+        for( int l = 0; l < WHEEL_LEVELS; ++l ) {
+            for( int i = 0; i < WHEEL_SIZE; ++i ) {
+                m_slots[ l ][ i ].prev = &m_slots[ l ][ i ];
+                m_slots[ l ][ i ].next = &m_slots[ l ][ i ];
+            }
         }
-        add_timer(timer, head);
-        printf("%d\n", head);
     }
-    
-    /* 当某个定时任务发生变化时，调整对应的定时器在链表中的位置。这个函数只考虑被调整的定时器的
-    超时时间延长的情况，即该定时器需要往链表的尾部移动。*/
-    void adjust_timer(util_timer* timer)
-    {
-        printf("%d\n", head);
-        printf("%d\n", timer);
-        if( !timer )  {
-            printf("adjust_timer: timer is null\n");
-            return;
-        }
-        if(!head) {
-            printf("adjust_timer: head is null\n");
-        }
-        util_timer* tmp = timer->next;
-        // 如果被调整的目标定时器处在链表的尾部，或者该定时器新的超时时间值仍然小于其下一个定时器的超时时间则不用调整
-        if( !tmp || ( timer->expire < tmp->expire ) ) {
-            return;
-        }
-        // 如果目标定时器是链表的头节点，则将该定时器从链表中取出并重新插入链表
-        if( timer == head ) {
-            head = head->next;
-            head->prev = NULL;
-            timer->next = NULL;
-            add_timer( timer, head );
-        } else {
-            // 如果目标定时器不是链表的头节点，则将该定时器从链表中取出，然后插入其原来所在位置后的部分链表中
-            timer->prev->next = timer->next;
-            timer->next->prev = timer->prev;
-            add_timer( timer, timer->next );
+
+    // 定时器由 client_data 持有，时间轮销毁时只需把它们摘下
+    ~time_wheel() {
+        for( int l = 0; l < WHEEL_LEVELS; ++l ) {
+            for( int i = 0; i < WHEEL_SIZE; ++i ) {
+                util_timer* head = &m_slots[ l ][ i ];
+                while( head->next != head ) {
+                    unlink( head->next );
+                }
+            }
         }
-        printf("%d\n", head);
     }
-    // 将目标定时器 timer 从链表中删除
-    void del_timer( util_timer* timer )
-    {
+
+    // 在 timeout 个滴答后触发 timer；如果 timer 已在时间轮上，则相当于调整
+    void add_timer( util_timer* timer, uint64_t timeout ) {
         if( !timer ) {
             return;
         }
-        // 下面这个条件成立表示链表中只有一个定时器，即目标定时器
-        if( ( timer == head ) && ( timer == tail ) ) {
-            delete timer;
-            head = NULL;
-            tail = NULL;
-            return;
+        if( timer->linked() ) {
+            unlink( timer );
         }
-        /* 如果链表中至少有两个定时器，且目标定时器是链表的头节点，
-         则将链表的头节点重置为原头节点的下一个节点，然后删除目标定时器。 */
-        if( timer == head ) {
-            head = head->next;
-            head->prev = NULL;
-            delete timer;
-            return;
+        if( timeout == 0 ) {
+            timeout = 1;    // 当前槽已经处理过，最早只能在下一个滴答触发
         }
-        /* 如果链表中至少有两个定时器，且目标定时器是链表的尾节点，
-        则将链表的尾节点重置为原尾节点的前一个节点，然后删除目标定时器。*/
-        if( timer == tail ) {
-            tail = tail->prev;
-            tail->next = NULL;
-            delete timer;
-            return;
+        if( timeout > MAX_TIMEOUT ) {
+            timeout = MAX_TIMEOUT;
         }
-        // 如果目标定时器位于链表的中间，则把它前后的定时器串联起来，然后删除目标定时器
-        timer->prev->next = timer->next;
-        timer->next->prev = timer->prev;
-        delete timer;
+        timer->expire = m_now + timeout;
+        place( timer );
     }
 
-    /* SIGALARM 信号每次被触发就在其信号处理函数中执行一次 tick() 函数，以处理链表上到期任务。*/
-    void tick_() {
-        printf("%d\n", head);
-        if( !head ) {
-            printf("tick fail\n");
-            return;
+    // 连接上有新的活动时延长其超时时间
+    void adjust_timer( util_timer* timer, uint64_t timeout ) {
+        add_timer( timer, timeout );
+    }
+
+    // 将目标定时器从时间轮上摘下，对未挂上的定时器调用是安全的
+    void del_timer( util_timer* timer ) {
+        if( timer && timer->linked() ) {
+            unlink( timer );
         }
-        printf( "timer tick\n" );
-        time_t cur = time( NULL );  // 获取当前系统时间
-        util_timer* tmp = head;
-        // 从头节点开始依次处理每个定时器，直到遇到一个尚未到期的定时器
-        while( tmp ) {
-            /* 因为每个定时器都使用绝对时间作为超时值，所以可以把定时器的超时值和系统当前时间，
-            比较以判断定时器是否到期*/
-            if( cur < tmp->expire ) {
-                break;
-            }
+    }
 
-            // 调用定时器的回调函数，以执行定时任务
-            tmp->cb_func( tmp->user_data);
-            // 执行完定时器中的定时任务之后，就将它从链表中删除，并重置链表头节点
-            head = tmp->next;
-            if( head ) {
-                head->prev = NULL;
+    // 时间轮前进 ticks 个滴答，依次执行到期定时器的回调函数
+    void tick( uint64_t ticks = 1 ) {
+        while( ticks-- ) {
+            ++m_now;
+            int idx = m_now & WHEEL_MASK;
+            // 第 0 层转完一圈，从高层依次向下分配
+            if( idx == 0 ) {
+                for( int l = 1; l < WHEEL_LEVELS; ++l ) {
+                    int i = ( m_now >> ( l * WHEEL_BITS ) ) & WHEEL_MASK;
+                    cascade( l, i );
+                    if( i != 0 ) {
+                        break;
+                    }
+                }
+            }
+            // 先摘下再回调，回调中可以安全地删除或重新添加任何定时器
+            util_timer* head = &m_slots[ 0 ][ idx ];
+            while( head->next != head ) {
+                util_timer* tmp = head->next;
+                unlink( tmp );
+                tmp->cb_func( tmp->user_data );
             }
-            delete tmp;
-            tmp = head;
         }
     }
 
+    size_t size() const { return m_count; }
+    uint64_t now() const { return m_now; }
+
 private:
-    /* 一个重载的辅助函数，它被公有的 add_timer 函数和 adjust_timer 函数调用
-    该函数表示将目标定时器 timer 添加到节点 lst_head 之后的部分链表中 */
-    void add_timer(util_timer* timer, util_timer* lst_head)  {
-        util_timer* prev = lst_head;
-        util_timer* tmp = prev->next;
-        /* 遍历 list_head 节点之后的部分链表，直到找到一个超时时间大于目标定时器的超时时间节点
-        并将目标定时器插入该节点之前 */
-        while(tmp) {
-            if( timer->expire < tmp->expire ) {
-                prev->next = timer;
-                timer->next = tmp;
-                tmp->prev = timer;
-                timer->prev = prev;
-                break;
-            }
-            prev = tmp;
-            tmp = tmp->next;
-        }
-        /* 如果遍历完 lst_head 节点之后的部分链表，仍未找到超时时间大于目标定时器的超时时间的节点，
-           则将目标定时器插入链表尾部，并把它设置为链表新的尾节点。*/
-        if( !tmp ) {
-            prev->next = timer;
-            timer->prev = prev;
-            timer->next = NULL;
-            tail = timer;
+    // 根据剩余滴答数选择层和槽
+    void place( util_timer* timer ) {
+        uint64_t expire = timer->expire;
+        uint64_t delta = expire > m_now ? expire - m_now : 0;
+        int level = 0;
+        while( level < WHEEL_LEVELS - 1 && delta >= ( 1ULL << ( ( level + 1 ) * WHEEL_BITS ) ) ) {
+            ++level;
+        }
+        if( delta == 0 ) {
+            expire = m_now;
+        }
+        util_timer* head = &m_slots[ level ][ ( expire >> ( level * WHEEL_BITS ) ) & WHEEL_MASK ];
+        timer->next = head;
+        timer->prev = head->prev;
+        head->prev->next = timer;
+        head->prev = timer;
+        ++m_count;
+    }
+
+    void unlink( util_timer* timer ) {
+        timer->prev->next = timer->next;
+        timer->next->prev = timer->prev;
+        timer->prev = NULL;
+        timer->next = NULL;
+        --m_count;
+    }
+
+    // 把第 level 层第 idx 个槽中的定时器重新放到更低的层
+    void cascade( int level, int idx ) {
+        util_timer* head = &m_slots[ level ][ idx ];
+        util_timer* tmp = head->next;
+        head->prev = head;
+        head->next = head;
+        while( tmp != head ) {
+            util_timer* next = tmp->next;
+            --m_count;
+            place( tmp );
+            tmp = next;
         }
     }
 
 private:
-    util_timer* head;   // 头结点
-    util_timer* tail;   // 尾结点
+    uint64_t m_now;     // 已经处理到的滴答
+    size_t m_count;     // 时间轮上的定时器数目
+    util_timer m_slots[ WHEEL_LEVELS ][ WHEEL_SIZE ];   // 每个槽是一个带头节点的双向循环链表
 };
 
 #endif
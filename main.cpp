@@ -7,32 +7,38 @@
 #include <string.h>
 #include <fcntl.h>
 #include <stdlib.h>
-#include <sys/epoll.h>
+#include <assert.h>
+#include <signal.h>
+#include <sys/resource.h>
+#include <sys/mman.h>
+#include <poll.h>
+#include <vector>
+#include <type_traits>
 #include "locker.h"
 #include "threadpool.h"
 #include "http_conn.h"
+#include "http_response.h"
+#include "router.h"
+#include "proxy.h"
 #include "lst_timer.h"
+#include "reactor.h"
+#include "file_cache.h"
+#include "cache_control.h"
+#include "metrics.h"
+#include "logger.h"
+#include "handoff.h"
 
-#define MAX_FD 65536           // max num of fd
-#define MAX_EVENT_NUMBER 10000 // max num of listened events
-#define TIMESLOT 5
+#define CACHE_MAX_ENTRIES 8192  // every cached file larger than SMALL_FILE_SIZE holds an fd
+#define READ_POOL_MAX_FREE 1024 // idle overflow blocks of the read buffers kept for reuse
+#define METRICS_EXPORT_MS 1000  // how often the shared memory copy of the metrics is refreshed
+#define HEALTH_CHECK_MS 2000    // how often every upstream server of the reverse proxy is connected to
+#define DRAIN_TIMEOUT_S 30      // default time the connections get to finish once the server stops accepting
+#define DRAIN_POLL_MS 100       // how often a draining server looks whether connections are left
 
 static int pipefd[2];
-static sort_timer_lst timer_lst;
-static int epoll_fd = 0;
 
-extern void addfd(int epollfd, int fd, bool one_shot);
-extern void removefd(int epollfd, int fd);
 extern int setnonblocking(int fd);
-
-void addfd(int epollfd, int fd)
-{
-    epoll_event event;
-    event.data.fd = fd;
-    event.events = EPOLLIN | EPOLLET;
-    epoll_ctl(epollfd, EPOLL_CTL_ADD, fd, &event);
-    setnonblocking(fd);
-}
+extern const char *doc_root;
 
 void sig_handler(int sig)
 {
@@ -44,7 +50,7 @@ void sig_handler(int sig)
 
 void addsig(int sig)
 {
-    printf("addsig\n");
+    LOG_DEBUG("addsig %d", sig);
     struct sigaction sa;
     memset(&sa, '\0', sizeof(sa));
     sa.sa_handler = sig_handler;
@@ -53,23 +59,6 @@ void addsig(int sig)
     assert(sigaction(sig, &sa, NULL) != -1);
 }
 
-void timer_handler()
-{
-    // 定时处理任务，实际上就是调用tick()函数
-    timer_lst.tick_();
-    // 因为一次 alarm 调用只会引起一次SIGALARM 信号，所以我们要重新定时，以不断触发 SIGALARM信号。
-    alarm(TIMESLOT);
-}
-
-// 定时器回调函数，它删除非活动连接socket上的注册事件，并关闭之。
-void cb_func(client_data *user_data)
-{
-    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, user_data->sockfd, 0);
-    assert(user_data);
-    close(user_data->sockfd);
-    printf("close fd %d\n", user_data->sockfd);
-}
-
 void addsig(int sig, void(handler)(int))
 {
     struct sigaction sa;
@@ -79,212 +68,513 @@ void addsig(int sig, void(handler)(int))
     assert(sigaction(sig, &sa, NULL) != -1);
 }
 
+// an fd-indexed table of n zeroed slots. The pages come from the kernel as they are
+// first touched, so slots of fds that are never used don't become resident
+template <typename T>
+static T *new_fd_table(size_t n)
+{
+    static_assert(std::is_trivially_default_constructible<T>::value && std::is_trivially_destructible<T>::value,
+                  "the slots are never constructed nor destroyed");
+    void *p = mmap(NULL, n * sizeof(T), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    return p == MAP_FAILED ? NULL : (T *)p;
+}
+
+template <typename T>
+static void delete_fd_table(T *table, size_t n)
+{
+    if (table)
+    {
+        munmap(table, n * sizeof(T));
+    }
+}
+
+// the reserved metrics URL, every scrape merges the values of all threads
+static bool serve_metrics(const handler_request &req, handler_reply &reply)
+{
+    if (req.method != http_conn::GET && req.method != http_conn::HEAD)
+    {
+        reply.status = 405;
+        reply.headers.assign(allow_get_head);
+        return true;
+    }
+    reply.content_type = metrics_content_type;
+    reply.headers.assign(cache_control_no_store);
+    metrics::prometheus(reply.body);
+    return true;
+}
+
+// a proxied prefix, the reactor forwards the request to a server of the group
+static bool proxy_pass(const handler_request &req, handler_reply &reply)
+{
+    reply.upstream = (upstream_group *)req.arg;
+    return true;
+}
+
+// the listeners a previous process handed over, if they listen on our port. They
+// decide how the reactors listen: one shared socket or one SO_REUSEPORT socket each,
+// and then at least one reactor per socket so none of them is left without a loop
+static bool adopt_listeners(std::vector<int> &fds, int port, int &reactor_num)
+{
+    for (int fd : fds)
+    {
+        struct sockaddr_in address;
+        socklen_t len = sizeof(address);
+        int listening = 0;
+        socklen_t optlen = sizeof(listening);
+        if (getsockname(fd, (struct sockaddr *)&address, &len) == -1 || address.sin_family != AF_INET
+            || ntohs(address.sin_port) != port
+            || getsockopt(fd, SOL_SOCKET, SO_ACCEPTCONN, &listening, &optlen) == -1 || !listening)
+        {
+            return false;
+        }
+    }
+    int reuseport = 0;
+    socklen_t optlen = sizeof(reuseport);
+    getsockopt(fds[0], SOL_SOCKET, SO_REUSEPORT, &reuseport, &optlen);
+    reactor::m_listen.exclusive = !reuseport;
+    if (!reuseport)
+    {
+        // a shared listener comes alone
+        for (size_t i = 1; i < fds.size(); ++i)
+        {
+            close(fds[i]);
+        }
+        fds.resize(1);
+    }
+    else if (reactor_num < (int)fds.size())
+    {
+        LOG_INFO("%d listeners handed over, starting as many reactors", (int)fds.size());
+        reactor_num = fds.size();
+    }
+    reactor::m_listen.inherited = fds;
+    return true;
+}
+
+// stop accepting, every response from now on says Connection: close
+static void start_drain(reactor **reactors, int count)
+{
+    http_conn::m_draining = true;
+    for (int i = 0; i < count; i++)
+    {
+        reactors[i]->drain();
+    }
+}
+
+static int64_t open_connections()
+{
+    return (int64_t)(metrics::total(CONNECTIONS_ACCEPTED) - metrics::total(CONNECTIONS_CLOSED));
+}
+
 int main(int argc, char *argv[])
 {
-    if (argc <= 1)
+    // -r: number of reactors (event loops), 0 means one per online core
+    // -c: file cache budget in MB, 0 turns the cache off
+    // -H: largest request in bytes, a bigger header gets 431 and a bigger body 413
+    // -C: Cache-Control rule "prefix=value", repeatable, the longest matching prefix wins
+    // -e: event backend, epoll or uring (falls back to epoll when the kernel can't)
+    // -b: listen backlog, -d: TCP_DEFER_ACCEPT seconds (0 off)
+    // -x: one listener shared with EPOLLEXCLUSIVE instead of one SO_REUSEPORT listener per reactor
+    // -m: URL reserved for the Prometheus metrics, "" for none; -M: also export them to this shared memory segment
+    // -l: log file, stdout by default; -L: log level, debug|info|warn|error|off
+    // -u: directory PUT/POST bodies are stored in at their URL, uploads are refused without it; -B: largest upload body in bytes
+    // -P: reverse proxy rule "prefix=host:port,host:port", repeatable; -S: pick upstream servers by least connections instead of round robin
+    // -U: Unix socket of the restart handoff, a new process started with the same path takes the listeners over
+    // -T: seconds the connections get to finish after SIGTERM or a handoff
+    int reactor_num = 1;
+    int cache_mb = 64;
+    int max_header = http_conn::DEFAULT_MAX_HEADER_SIZE;
+    cache_control *rules = NULL;
+    bool uring = false;
+    const char *metrics_url = "/metrics";
+    const char *metrics_shm = NULL;
+    const char *log_file = NULL;
+    std::vector<const char *> proxy_rules;
+    upstream_group::BALANCE balance = upstream_group::ROUND_ROBIN;
+    const char *handoff_path = NULL;
+    int drain_timeout = DRAIN_TIMEOUT_S;
+    int opt;
+    while ((opt = getopt(argc, argv, "r:c:H:C:e:b:d:xm:M:l:L:u:B:P:SU:T:")) != -1)
     {
-        printf("port number need to be provided");
+        switch (opt)
+        {
+        case 'r':
+            reactor_num = atoi(optarg);
+            break;
+        case 'c':
+            cache_mb = atoi(optarg);
+            break;
+        case 'H':
+            max_header = atoi(optarg);
+            break;
+        case 'C':
+            if (!rules)
+            {
+                rules = new cache_control;
+            }
+            if (!rules->add(optarg))
+            {
+                LOG_ERROR("bad Cache-Control rule %s, expected /prefix=value", optarg);
+                return 1;
+            }
+            break;
+        case 'e':
+            if (strcmp(optarg, "uring") == 0)
+            {
+                uring = true;
+            }
+            else if (strcmp(optarg, "epoll") != 0)
+            {
+                LOG_ERROR("unknown backend %s, expected epoll or uring", optarg);
+                return 1;
+            }
+            break;
+        case 'b':
+            reactor::m_listen.backlog = atoi(optarg);
+            break;
+        case 'd':
+            reactor::m_listen.defer_accept = atoi(optarg);
+            break;
+        case 'x':
+            reactor::m_listen.exclusive = true;
+            break;
+        case 'm':
+            metrics_url = optarg;
+            break;
+        case 'M':
+            metrics_shm = optarg;
+            break;
+        case 'l':
+            log_file = optarg;
+            break;
+        case 'u':
+            http_conn::m_upload_dir = optarg;
+            break;
+        case 'B':
+            http_conn::m_max_upload = atoll(optarg);
+            break;
+        case 'P':
+            proxy_rules.push_back(optarg);
+            break;
+        case 'S':
+            balance = upstream_group::LEAST_CONN;
+            break;
+        case 'U':
+            handoff_path = optarg;
+            break;
+        case 'T':
+            drain_timeout = atoi(optarg);
+            break;
+        case 'L':
+        {
+            static const char *const levels[] = {"debug", "info", "warn", "error", "off"};
+            int level = LEVEL_DEBUG;
+            while (level <= LEVEL_OFF && strcmp(optarg, levels[level]) != 0)
+            {
+                level++;
+            }
+            if (level > LEVEL_OFF)
+            {
+                LOG_ERROR("unknown log level %s, expected debug, info, warn, error or off", optarg);
+                return 1;
+            }
+            logger::m_level = level;
+            break;
+        }
+        default:
+            printf("usage: %s [-r reactors] [-c cache_mb] [-H max_header] [-C prefix=cache-control] [-e epoll|uring]"
+                   " [-b backlog] [-d defer_accept_s] [-x] [-m metrics_url] [-M shm_name] [-l log_file]"
+                   " [-L log_level] [-u upload_dir] [-B max_upload] [-P prefix=host:port,...] [-S]"
+                   " [-U handoff_socket] [-T drain_timeout_s] port\n", argv[0]);
+            return 1;
+        }
+    }
+    if (optind >= argc)
+    {
+        LOG_ERROR("port number need to be provided");
+        return 1;
+    }
+    // from here on records are queued and written by the flusher thread
+    if (!logger::start(log_file))
+    {
+        LOG_ERROR("can't open the log %s, errno is: %d", log_file, errno);
         return 1;
     }
+    if (reactor_num <= 0)
+    {
+        reactor_num = sysconf(_SC_NPROCESSORS_ONLN);
+    }
 
-    int port = atoi(argv[1]);
+    int port = atoi(argv[optind]);
     addsig(SIGPIPE, SIG_IGN);
 
-    threadpool<http_conn> *pool = NULL;
+    conn_threadpool *pool = NULL;
     try
     {
-        pool = new threadpool<http_conn>;
+        pool = new conn_threadpool;
     }
     catch (...)
     {
+        logger::stop();
         return 1;
     }
 
-    http_conn *users = new http_conn[MAX_FD];
-
-    int ret = 0;
-    struct sockaddr_in address;
-    address.sin_family = AF_INET;
-    address.sin_addr.s_addr = INADDR_ANY;
-    address.sin_port = htons(port);
-
-    int listenfd = socket(PF_INET, SOCK_STREAM, 0);
-    assert(listen >= 0);
-
-    // 端口复用
-    int reuse = 1;
-    setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    // without inotify the cache could serve stale files, so run without it
+    file_cache *cache = NULL;
+    if (cache_mb > 0)
+    {
+        cache = new file_cache(doc_root, (size_t)cache_mb << 20, CACHE_MAX_ENTRIES);
+        if (!cache->start())
+        {
+            LOG_WARN("can't watch %s, errno is: %d, file cache disabled", doc_root, errno);
+            delete cache;
+            cache = NULL;
+        }
+    }
+    http_conn::m_file_cache = cache;
 
-    ret = bind(listenfd, (struct sockaddr *)&address, sizeof(address));
-    assert(ret != -1);
+    // requests up to READ_BUFFER_SIZE never touch the pool
+    buffer_pool *read_pool = NULL;
+    if (max_header > http_conn::READ_BUFFER_SIZE)
+    {
+        read_pool = new buffer_pool(max_header, READ_POOL_MAX_FREE);
+    }
+    http_conn::m_read_pool = read_pool;
+    http_conn::m_cache_control = rules;
 
-    ret = listen(listenfd, 5);
-    assert(ret != -1);
+    // in-process handlers, the trie is complete before the first request arrives
+    router *routes = new router;
+    if (metrics_url[0] && !routes->add(metrics_url, serve_metrics))
+    {
+        LOG_ERROR("bad metrics URL %s", metrics_url);
+        logger::stop();
+        return 1;
+    }
+    // every proxied prefix is a prefix route of its own group
+    std::vector<upstream_group *> groups;
+    for (const char *rule : proxy_rules)
+    {
+        const char *eq = strchr(rule, '=');
+        upstream_group *group = new upstream_group(balance);
+        groups.push_back(group);
+        std::string pattern(rule, eq ? eq - rule : 0);
+        if (!pattern.empty() && pattern.back() != '*')
+        {
+            pattern += '*';
+        }
+        if (!eq || !group->add(eq + 1) || !routes->add(pattern, proxy_pass, group))
+        {
+            LOG_ERROR("bad proxy rule %s, expected /prefix=host:port,...", rule);
+            logger::stop();
+            return 1;
+        }
+        if (!group->start_checks(HEALTH_CHECK_MS))
+        {
+            LOG_WARN("can't check the upstreams of %s, errno is: %d", rule, errno);
+        }
+    }
+    if (!groups.empty() && uring)
+    {
+        // upstream connections are driven by the epoll loop
+        LOG_WARN("the reverse proxy needs the epoll backend, -e uring is ignored");
+        uring = false;
+    }
+    http_conn::m_router = routes->empty() ? NULL : routes;
 
-    epoll_event events[MAX_EVENT_NUMBER];
-    int epollfd = epoll_create(5);
-    assert(epollfd != -1);
+    // one slot per fd the process may open, the soft limit goes up to the hard one. An
+    // http_conn holds no buffers while idle and the tables are zero pages, so only slots
+    // of fds that have been used become resident
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0)
+    {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+        getrlimit(RLIMIT_NOFILE, &rl);
+        reactor::m_max_fd = rl.rlim_cur < MAX_FD ? (int)rl.rlim_cur : MAX_FD;
+    }
 
-    addfd(epollfd, listenfd, false);
-    http_conn::m_epollfd = epollfd;
+    // indexed by fd, every fd belongs to exactly one reactor at a time
+    http_conn *users = new_fd_table<http_conn>(reactor::m_max_fd);
+    client_data *users_timer = new_fd_table<client_data>(reactor::m_max_fd);
+    ring_conn *ring_conns = uring ? new_fd_table<ring_conn>(reactor::m_max_fd) : NULL;
+    if (!users || !users_timer || (uring && !ring_conns))
+    {
+        LOG_ERROR("can't map the tables of %d fds, errno is: %d", reactor::m_max_fd, errno);
+        logger::stop();
+        return 1;
+    }
 
-    // 创建管道
-    ret = socketpair(PF_UNIX, SOCK_STREAM, 0, pipefd);
+    // 创建管道, signals are forwarded to the main thread through it
+    int ret = socketpair(PF_UNIX, SOCK_STREAM, 0, pipefd);
     assert(ret != -1);
     setnonblocking(pipefd[1]);
-    addfd(epollfd, pipefd[0]);
 
     // 设置信号处理函数
-    addsig(SIGALRM);
     addsig(SIGTERM);
-    bool stop_server = false;
-
-    client_data *users_timer = new client_data[MAX_FD];
-    bool timeout = false;
-    alarm(TIMESLOT); // 定时,5秒后产生SIGALARM信号
 
-    while (!stop_server)
+    // a server running at handoff_path passes its listeners on and keeps serving until we confirm.
+    // One we don't replace keeps the path for its own restarts
+    std::vector<int> inherited;
+    int handoff_conn = -1;
+    bool handoff_owner = handoff_path != NULL;
+    if (handoff_path && !handoff::receive(handoff_path, inherited, handoff_conn))
+    {
+        LOG_WARN("can't take the listeners over from %s, errno is: %d", handoff_path, errno);
+        handoff_owner = false;
+    }
+    if (!inherited.empty() && !adopt_listeners(inherited, port, reactor_num))
     {
-        int number = epoll_wait(epollfd, events, MAX_EVENT_NUMBER, -1);
-        if (number < 0 && errno != EINTR)
+        LOG_WARN("the listeners handed over by %s aren't on port %d, opening new ones", handoff_path, port);
+        for (int fd : inherited)
         {
-            printf("epoll failure\n");
-            break;
+            close(fd);
         }
+        inherited.clear();
+        close(handoff_conn);
+        handoff_conn = -1;
+        handoff_owner = false;
+    }
 
-        for (int i = 0; i < number; i++)
+    reactor **reactors = new reactor *[reactor_num];
+    int started = 0;
+    for (; started < reactor_num; started++)
+    {
+        reactors[started] = new reactor(port, users, users_timer, pool, ring_conns);
+        if (!reactors[started]->start())
         {
-            int socketfd = events[i].data.fd;
-            if (socketfd == listenfd)
-            {
-
-                struct sockaddr_in client_address;
-                socklen_t client_addrlength = sizeof(client_address);
-
-                int connfd = accept(socketfd, (struct sockaddr *)&client_address, &client_addrlength);
-                if (connfd < 0)
-                {
-                    printf("errno is: %d\n", errno);
-                    continue;
-                }
+            LOG_ERROR("can't start reactor %d, errno is: %d", started, errno);
+            delete reactors[started];
+            break;
+        }
+    }
 
-                if (http_conn::m_user_count >= MAX_FD)
-                {
-                    close(connfd);
-                    continue;
-                }
-                users[connfd].init(connfd, client_address);
+    if (metrics_shm && !metrics::start_export(metrics_shm, METRICS_EXPORT_MS))
+    {
+        LOG_WARN("can't export the metrics to %s, errno is: %d", metrics_shm, errno);
+    }
 
-                users_timer[connfd].address = client_address;
-                users_timer[connfd].sockfd = connfd;
+    bool stop_server = started < reactor_num;
+    if (handoff_conn != -1)
+    {
+        // without the confirmation the old process goes on serving
+        if (!stop_server && handoff::confirm(handoff_conn))
+        {
+            LOG_INFO("took over %d listeners from %s", (int)inherited.size(), handoff_path);
+        }
+        else if (stop_server)
+        {
+            close(handoff_conn);
+        }
+    }
+    int handoff_fd = -1;
+    if (handoff_owner && !stop_server)
+    {
+        handoff_fd = handoff::listen_at(handoff_path);
+        if (handoff_fd == -1)
+        {
+            LOG_WARN("can't listen for a restart at %s, errno is: %d", handoff_path, errno);
+        }
+    }
 
-                // 创建定时器，设置其回调函数与超时时间，然后绑定定时器与用户数据，最后将定时器添加到链表timer_lst中
-                util_timer *timer = new util_timer;
-                timer->user_data = &users_timer[connfd];
-                timer->cb_func = cb_func;
-                time_t cur = time(NULL);
-                timer->expire = cur + 3 * TIMESLOT;
-                users_timer[connfd].timer = timer;
-                timer_lst.add_timer(timer);
+    // SIGTERM or a handoff: stop accepting and give the connections until the deadline
+    // to finish, a second SIGTERM stops at once
+    uint64_t drain_deadline = 0;
+    while (!stop_server)
+    {
+        struct pollfd fds[2] = {{pipefd[0], POLLIN, 0}, {handoff_fd, POLLIN, 0}};
+        ret = poll(fds, 2, drain_deadline ? DRAIN_POLL_MS : -1);
+        if (ret == -1 && errno != EINTR)
+        {
+            break;
+        }
+        bool drain = false;
+        if (ret > 0 && fds[0].revents)
+        {
+            // 处理信号
+            char signals[1024];
+            ret = recv(pipefd[0], signals, sizeof(signals), 0);
+            if (ret <= 0)
+            {
+                break;
             }
-            else if ((socketfd == pipefd[0]) && (events[i].events & EPOLLIN))
+            for (int i = 0; i < ret; ++i)
             {
-                // 处理信号
-                printf("sig\n");
-                int sig;
-                char signals[1024];
-                ret = recv(pipefd[0], signals, sizeof(signals), 0);
-                if (ret == -1)
+                if (signals[i] == SIGTERM)
                 {
-                    continue;
-                }
-                else if (ret == 0)
-                {
-                    continue;
-                }
-                else
-                {
-                    for (int i = 0; i < ret; ++i)
-                    {
-                        switch (signals[i])
-                        {
-                        case SIGALRM:
-                        {
-                            // 用timeout变量标记有定时任务需要处理，但不立即处理定时任务
-                            // 这是因为定时任务的优先级不是很高，我们优先处理其他更重要的任务。
-                            timeout = true;
-                            break;
-                        }
-                        case SIGTERM:
-                        {
-                            stop_server = true;
-                        }
-                        }
-                    }
+                    stop_server = drain_deadline != 0;
+                    drain = true;
                 }
             }
-            else if (events[i].events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+        }
+        if (!drain && handoff_fd != -1 && fds[1].revents)
+        {
+            // a shared listener is the same socket in every reactor
+            std::vector<int> listeners;
+            for (int i = 0; i < (reactor::m_listen.exclusive ? 1 : started); i++)
             {
-                util_timer *timer = users_timer[socketfd].timer;
-                users[socketfd].close_conn();
-                if (timer)
-                {
-                    timer_lst.del_timer(timer);
-                }
+                listeners.push_back(reactors[i]->listenfd());
             }
-            else if (events[i].events & EPOLLIN)
+            if (handoff::give(handoff_fd, listeners))
             {
-                util_timer *timer = users_timer[socketfd].timer;
-                if (users[socketfd].read())
-                {
-                    pool->append(users + socketfd);
-                    if (timer)
-                    {
-                        time_t cur = time(NULL);
-                        timer->expire = cur + 3 * TIMESLOT;
-                        printf("adjust timer once\n");
-                        timer_lst.adjust_timer(timer);
-                    }
-                }
-                else
-                {
-                    users[socketfd].close_conn();
-                    if (timer)
-                    {
-                        timer_lst.del_timer(timer);
-                    }
-                }
+                LOG_INFO("listeners handed over through %s", handoff_path);
+                drain = true;
             }
-            else if (events[i].events & EPOLLOUT)
+            else
             {
-                util_timer *timer = users_timer[socketfd].timer;
-                if (!users[socketfd].write())
-                {
-                    users[socketfd].close_conn();
-                    if (timer)
-                    {
-                        timer_lst.del_timer(timer);
-                    }
-                }
+                LOG_WARN("the handover through %s failed, errno is: %d, still serving", handoff_path, errno);
             }
         }
-        // 最后处理定时事件，因为I/O事件有更高的优先级。当然，这样做将导致定时任务不能精准的按照预定的时间执行。
-        if (timeout)
+        if (drain && !drain_deadline)
         {
-            printf("timeout\n");
-            // 定时处理任务，实际上就是调用tick()函数
-            timer_lst.tick_();
-            // 因为一次 alarm 调用只会引起一次SIGALARM 信号，所以我们要重新定时，以不断触发 SIGALARM信号。
-            alarm(TIMESLOT);
-            timeout = false;
+            LOG_INFO("draining %lld connections for up to %ds", (long long)open_connections(), drain_timeout);
+            start_drain(reactors, started);
+            drain_deadline = metrics::now() + (uint64_t)drain_timeout * 1000000000;
+            // the path belongs to the next process now, or to nobody
+            if (handoff_fd != -1)
+            {
+                close(handoff_fd);
+                handoff_fd = -1;
+            }
+        }
+        if (drain_deadline && !stop_server)
+        {
+            int64_t left = open_connections();
+            if (left <= 0)
+            {
+                LOG_INFO("every connection is done");
+                stop_server = true;
+            }
+            else if (metrics::now() >= drain_deadline)
+            {
+                LOG_INFO("closing %lld connections at the deadline", (long long)left);
+                stop_server = true;
+            }
         }
     }
-    close(epollfd);
-    close(listenfd);
+    if (handoff_fd != -1)
+    {
+        close(handoff_fd);
+    }
+
+    metrics::stop_export();
+    for (int i = 0; i < started; i++)
+    {
+        delete reactors[i];
+    }
+    delete[] reactors;
     close(pipefd[1]);
     close(pipefd[0]);
-    delete[] users;
-    delete[] users_timer;
+    delete_fd_table(users, reactor::m_max_fd);
+    delete_fd_table(users_timer, reactor::m_max_fd);
+    delete_fd_table(ring_conns, reactor::m_max_fd);
     delete pool;
+    delete cache;
+    delete read_pool;
+    delete rules;
+    delete routes;
+    for (upstream_group *group : groups)
+    {
+        delete group;
+    }
+    logger::stop();
     return 0;
-}
\ No newline at end of file
+}
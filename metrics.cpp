@@ -0,0 +1,238 @@
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include "metrics.h"
+
+thread_local metrics::thread_slot* metrics::m_slot = NULL;
+std::atomic<metrics::thread_slot*> metrics::m_slots(NULL);
+
+// the exporter, only touched by start_export() and stop_export()
+static std::string shm_name;
+static metrics_shm* shm = NULL;
+static int shm_interval;
+static int shm_wakefd = -1;
+static pthread_t shm_thread;
+
+// once per thread, the slot outlives the thread so its counts are never lost
+metrics::thread_slot& metrics::enroll() {
+    thread_slot* s = new thread_slot();
+    s->next = m_slots.load(std::memory_order_relaxed);
+    while (!m_slots.compare_exchange_weak(s->next, s, std::memory_order_release, std::memory_order_relaxed)) {
+    }
+    m_slot = s;
+    return *s;
+}
+
+void metrics::status(int code) {
+    int i = 0;
+    while (i < STATUS_SLOTS - 1 && METRIC_STATUSES[i] != code) {
+        ++i;
+    }
+    bump(slot().statuses[i], 1);
+}
+
+uint64_t metrics::total(METRIC_COUNTER c) {
+    uint64_t n = 0;
+    for (thread_slot* s = m_slots.load(std::memory_order_acquire); s; s = s->next) {
+        n += s->counters[c].load(std::memory_order_relaxed);
+    }
+    return n;
+}
+
+void metrics::snapshot(metrics_snapshot& out) {
+    memset(out.counters, 0, sizeof(out.counters));
+    memset(out.statuses, 0, sizeof(out.statuses));
+    memset(out.gauges, 0, sizeof(out.gauges));
+    for (int p = 0; p < PHASE_COUNT; ++p) {
+        out.phases[p].reset();
+    }
+    for (thread_slot* s = m_slots.load(std::memory_order_acquire); s; s = s->next) {
+        for (int i = 0; i < COUNTER_COUNT; ++i) {
+            out.counters[i] += s->counters[i].load(std::memory_order_relaxed);
+        }
+        for (int i = 0; i < STATUS_SLOTS; ++i) {
+            out.statuses[i] += s->statuses[i].load(std::memory_order_relaxed);
+        }
+        for (int i = 0; i < GAUGE_COUNT; ++i) {
+            out.gauges[i] += s->gauges[i].load(std::memory_order_relaxed);
+        }
+        for (int p = 0; p < PHASE_COUNT; ++p) {
+            for (int i = 0; i < hdr_histogram::BUCKETS; ++i) {
+                uint64_t n = s->phases[p][i].load(std::memory_order_relaxed);
+                if (n) {
+                    // the largest value of the bucket lands in the same bucket
+                    out.phases[p].record(hdr_histogram::highest_equivalent(i), n);
+                }
+            }
+        }
+    }
+}
+
+static void append_metric(std::string& out, const char* name, const char* type, const char* help) {
+    char line[256];
+    snprintf(line, sizeof(line), "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+    out += line;
+}
+
+static void append_value(std::string& out, const char* name, const char* labels, double value) {
+    char line[256];
+    snprintf(line, sizeof(line), "%s%s %.9g\n", name, labels, value);
+    out += line;
+}
+
+static void append_value(std::string& out, const char* name, const char* labels, uint64_t value) {
+    char line[256];
+    snprintf(line, sizeof(line), "%s%s %llu\n", name, labels, (unsigned long long)value);
+    out += line;
+}
+
+static const char* const phase_names[PHASE_COUNT] = { "queue", "process", "send", "request" };
+
+// the slots are read one after the other, a close or a pop may be seen without the
+// accept or the push before it, so the differences are clamped at 0
+void metrics::prometheus(std::string& out) {
+    metrics_snapshot* snap = new metrics_snapshot;
+    snapshot(*snap);
+    const uint64_t* c = snap->counters;
+    out.clear();
+
+    append_metric(out, "webserver_connections_accepted_total", "counter", "Connections accepted.");
+    append_value(out, "webserver_connections_accepted_total", "", c[CONNECTIONS_ACCEPTED]);
+    append_metric(out, "webserver_connections_open", "gauge", "Connections accepted and not closed yet.");
+    int64_t open = (int64_t)(c[CONNECTIONS_ACCEPTED] - c[CONNECTIONS_CLOSED]);
+    append_value(out, "webserver_connections_open", "", (uint64_t)(open > 0 ? open : 0));
+
+    append_metric(out, "webserver_responses_total", "counter", "Responses by status, code 0 is any other status.");
+    for (int i = 0; i < STATUS_SLOTS; ++i) {
+        char labels[32];
+        snprintf(labels, sizeof(labels), "{code=\"%d\"}", METRIC_STATUSES[i]);
+        append_value(out, "webserver_responses_total", labels, snap->statuses[i]);
+    }
+
+    append_metric(out, "webserver_received_bytes_total", "counter", "Bytes read from clients.");
+    append_value(out, "webserver_received_bytes_total", "", c[BYTES_RECEIVED]);
+    append_metric(out, "webserver_sent_bytes_total", "counter", "Bytes sent to clients, headers and bodies.");
+    append_value(out, "webserver_sent_bytes_total", "", c[BYTES_SENT]);
+
+    append_metric(out, "webserver_queued_total", "counter", "Connections handed to the threadpool.");
+    append_value(out, "webserver_queued_total", "", c[REQUESTS_QUEUED]);
+    append_metric(out, "webserver_queue_depth", "gauge", "Connections waiting in the threadpool queue.");
+    int64_t depth = (int64_t)(c[REQUESTS_QUEUED] - c[REQUESTS_DEQUEUED]);
+    append_value(out, "webserver_queue_depth", "", (uint64_t)(depth > 0 ? depth : 0));
+    append_metric(out, "webserver_timers", "gauge", "Connection timers on the timing wheels.");
+    append_value(out, "webserver_timers", "", (uint64_t)snap->gauges[GAUGE_TIMERS]);
+
+    append_metric(out, "webserver_cache_hits_total", "counter", "File cache lookups that hit.");
+    append_value(out, "webserver_cache_hits_total", "", c[CACHE_HITS]);
+    append_metric(out, "webserver_cache_misses_total", "counter", "File cache lookups that missed.");
+    append_value(out, "webserver_cache_misses_total", "", c[CACHE_MISSES]);
+    uint64_t lookups = c[CACHE_HITS] + c[CACHE_MISSES];
+    append_metric(out, "webserver_cache_hit_ratio", "gauge", "Hits of all file cache lookups so far.");
+    append_value(out, "webserver_cache_hit_ratio", "", lookups ? (double)c[CACHE_HITS] / lookups : 0);
+
+    append_metric(out, "webserver_upstream_connects_total", "counter", "Connections opened to upstream servers.");
+    append_value(out, "webserver_upstream_connects_total", "", c[UPSTREAM_CONNECTS]);
+    append_metric(out, "webserver_upstream_reuses_total", "counter", "Proxied requests sent over a pooled upstream connection.");
+    append_value(out, "webserver_upstream_reuses_total", "", c[UPSTREAM_REUSES]);
+    append_metric(out, "webserver_upstream_failures_total", "counter", "Upstream connections that failed before a complete response.");
+    append_value(out, "webserver_upstream_failures_total", "", c[UPSTREAM_FAILURES]);
+
+    static const double quantiles[] = { 0.5, 0.9, 0.99, 0.999, 1 };
+    append_metric(out, "webserver_phase_seconds", "summary",
+                  "Latency of queue wait, processing, sending and whole requests.");
+    for (int p = 0; p < PHASE_COUNT; ++p) {
+        const hdr_histogram& h = snap->phases[p];
+        char labels[64];
+        for (double q : quantiles) {
+            snprintf(labels, sizeof(labels), "{phase=\"%s\",quantile=\"%g\"}", phase_names[p], q);
+            append_value(out, "webserver_phase_seconds", labels, h.percentile(q * 100) / 1e9);
+        }
+        snprintf(labels, sizeof(labels), "{phase=\"%s\"}", phase_names[p]);
+        append_value(out, "webserver_phase_seconds_sum", labels, h.sum() / 1e9);
+        append_value(out, "webserver_phase_seconds_count", labels, h.count());
+    }
+    delete snap;
+}
+
+bool metrics::start_export(const char* name, int interval_ms) {
+    int fd = shm_open(name, O_CREAT | O_RDWR | O_CLOEXEC, 0644);
+    if (fd == -1) {
+        return false;
+    }
+    if (ftruncate(fd, sizeof(metrics_shm)) == -1) {
+        close(fd);
+        shm_unlink(name);
+        return false;
+    }
+    void* p = mmap(NULL, sizeof(metrics_shm), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED) {
+        shm_unlink(name);
+        return false;
+    }
+    shm = (metrics_shm*)p;
+    shm->magic = METRICS_SHM_MAGIC;
+    shm->size = sizeof(metrics_shm);
+    shm->seq.store(0, std::memory_order_relaxed);
+    shm_name = name;
+    shm_interval = interval_ms;
+
+    shm_wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (shm_wakefd == -1 || pthread_create(&shm_thread, NULL, exporter, NULL) != 0) {
+        if (shm_wakefd != -1) {
+            close(shm_wakefd);
+            shm_wakefd = -1;
+        }
+        munmap(shm, sizeof(metrics_shm));
+        shm = NULL;
+        shm_unlink(name);
+        return false;
+    }
+    return true;
+}
+
+void metrics::stop_export() {
+    if (!shm) {
+        return;
+    }
+    uint64_t one = 1;
+    ::write(shm_wakefd, &one, sizeof(one));
+    pthread_join(shm_thread, NULL);
+    close(shm_wakefd);
+    shm_wakefd = -1;
+    munmap(shm, sizeof(metrics_shm));
+    shm = NULL;
+    shm_unlink(shm_name.c_str());
+}
+
+// the snapshot is taken aside, only the copy into the segment is inside the odd seq
+void* metrics::exporter(void*) {
+    metrics_snapshot* snap = new metrics_snapshot;
+    struct pollfd pfd;
+    pfd.fd = shm_wakefd;
+    pfd.events = POLLIN;
+    for (;;) {
+        snapshot(*snap);
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        uint64_t seq = shm->seq.load(std::memory_order_relaxed);
+        shm->seq.store(seq + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        memcpy((void*)&shm->data, snap, sizeof(*snap));
+        shm->updated = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+        shm->seq.store(seq + 2, std::memory_order_release);
+
+        int ret = poll(&pfd, 1, shm_interval);
+        if (ret > 0 || (ret < 0 && errno != EINTR)) {
+            break;
+        }
+    }
+    delete snap;
+    return NULL;
+}
@@ -0,0 +1,118 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdint.h>
+#include <time.h>
+#include <atomic>
+#include <string>
+#include "hdr_histogram.h"
+
+enum METRIC_COUNTER {
+    CONNECTIONS_ACCEPTED = 0,
+    CONNECTIONS_CLOSED,
+    REQUESTS_QUEUED,        // handed to the threadpool
+    REQUESTS_DEQUEUED,      // taken by a worker, the queue depth is the difference
+    BYTES_RECEIVED,
+    BYTES_SENT,
+    CACHE_HITS,
+    CACHE_MISSES,
+    UPSTREAM_CONNECTS,      // connections opened to upstream servers of the reverse proxy
+    UPSTREAM_REUSES,        // requests sent over a pooled upstream connection instead
+    UPSTREAM_FAILURES,      // upstream connections that failed before a complete response
+    COUNTER_COUNT
+};
+
+// the value of a gauge is the sum over the threads
+enum METRIC_GAUGE {
+    GAUGE_TIMERS = 0,       // timers on the wheel of each reactor
+    GAUGE_COUNT
+};
+
+// latency in ns of the steps of a request
+enum METRIC_PHASE {
+    PHASE_QUEUE = 0,        // handed to the threadpool -> a worker starts it
+    PHASE_PROCESS,          // one process(): parsing, do_request() and gathering the responses
+    PHASE_SEND,             // the responses gathered -> their last byte is sent
+    PHASE_REQUEST,          // the first byte of the request read -> the last byte of the response sent
+    PHASE_COUNT
+};
+
+// responses are counted by status, every status the server sends has a slot and the last one takes the rest
+const int METRIC_STATUSES[] = { 200, 201, 204, 206, 304, 400, 403, 404, 405, 413, 416, 431, 500, 501, 502, 503, 504, 0 };
+const int STATUS_SLOTS = sizeof(METRIC_STATUSES) / sizeof(METRIC_STATUSES[0]);
+
+// every thread's values merged, what a scrape is rendered from and the shared memory holds
+struct metrics_snapshot {
+    uint64_t counters[COUNTER_COUNT];
+    uint64_t statuses[STATUS_SLOTS];
+    int64_t gauges[GAUGE_COUNT];
+    hdr_histogram phases[PHASE_COUNT];
+};
+
+/*
+    Layout of the shared memory segment written by the exporter. seq is odd while an
+    update is in progress: a reader loads seq (acquire), copies data, issues an acquire
+    fence and loads seq again, and keeps the copy if both were the same even number.
+*/
+const uint32_t METRICS_SHM_MAGIC = 0x4d455452;  // "METR"
+
+struct metrics_shm {
+    uint32_t magic;
+    uint32_t size;                  // sizeof(metrics_shm), changes with the layout
+    std::atomic<uint64_t> seq;
+    uint64_t updated;               // CLOCK_REALTIME of the last update, ns
+    metrics_snapshot data;
+};
+
+/*
+    Counters and histograms kept per thread and merged only when they are read. A
+    thread gets a cache-line aligned slot the first time it records anything and is
+    the only one writing to it, so recording is a plain load and store of a relaxed
+    atomic: no lock and no locked instruction on the request path. Readers see every
+    slot through a list that only ever grows.
+*/
+class metrics {
+public:
+    static void add(METRIC_COUNTER c, uint64_t n = 1) { bump(slot().counters[c], n); }
+    static void set(METRIC_GAUGE g, int64_t value) { slot().gauges[g].store(value, std::memory_order_relaxed); }
+    static void record(METRIC_PHASE p, uint64_t ns) { bump(slot().phases[p][hdr_histogram::index(ns)], 1); }
+    static void status(int code);
+
+    static uint64_t now() {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+    }
+
+    static void snapshot(metrics_snapshot& out);
+    static uint64_t total(METRIC_COUNTER c);    // one counter over every thread, without the rest of a snapshot
+    static void prometheus(std::string& out);  // text exposition format 0.0.4
+
+    // copy a snapshot to the POSIX shared memory segment name every interval_ms, on a thread of its own
+    static bool start_export(const char* name, int interval_ms);
+    static void stop_export();
+
+private:
+    struct alignas(64) thread_slot {
+        std::atomic<uint64_t> counters[COUNTER_COUNT];
+        std::atomic<uint64_t> statuses[STATUS_SLOTS];
+        std::atomic<int64_t> gauges[GAUGE_COUNT];
+        std::atomic<uint64_t> phases[PHASE_COUNT][hdr_histogram::BUCKETS];
+        thread_slot* next;
+    };
+
+    static void bump(std::atomic<uint64_t>& c, uint64_t n) {
+        c.store(c.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    }
+    static thread_slot& slot() {
+        thread_slot* s = m_slot;
+        return s ? *s : enroll();
+    }
+    static thread_slot& enroll();
+    static void* exporter(void* arg);
+
+    static thread_local thread_slot* m_slot;
+    static std::atomic<thread_slot*> m_slots;  // every slot ever handed out
+};
+
+#endif
@@ -0,0 +1,421 @@
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <charconv>
+#include "proxy.h"
+#include "http_response.h"
+#include "logger.h"
+
+std::atomic<int> upstream_group::m_count(0);
+
+static bool is_space(char c) {
+    return c == ' ' || c == '\t';
+}
+
+static std::string_view trim(std::string_view text) {
+    while (!text.empty() && is_space(text.front())) {
+        text.remove_prefix(1);
+    }
+    while (!text.empty() && is_space(text.back())) {
+        text.remove_suffix(1);
+    }
+    return text;
+}
+
+static bool iequals(std::string_view a, std::string_view b) {
+    return a.size() == b.size() && strncasecmp(a.data(), b.data(), a.size()) == 0;
+}
+
+// take the next element off a comma separated list, false at the end of the list
+static bool next_element(std::string_view& list, std::string_view& element) {
+    while (!list.empty() && (list.front() == ',' || is_space(list.front()))) {
+        list.remove_prefix(1);
+    }
+    if (list.empty()) {
+        return false;
+    }
+    size_t end = list.find(',');
+    if (end == std::string_view::npos) {
+        end = list.size();
+    }
+    element = trim(list.substr(0, end));
+    list.remove_prefix(end);
+    return true;
+}
+
+bool hop_by_hop_header(std::string_view name) {
+    static const std::string_view names[] = {
+        "connection", "keep-alive", "proxy-connection", "te", "trailer", "transfer-encoding", "upgrade"
+    };
+    for (std::string_view n : names) {
+        if (iequals(name, n)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+upstream_group::upstream_group(BALANCE balance) :
+m_balance(balance), m_next(0), m_started(false), m_wakefd(-1), m_interval(0) {
+}
+
+upstream_group::~upstream_group() {
+    stop_checks();
+    for (upstream* server : m_servers) {
+        delete server;
+    }
+}
+
+bool upstream_group::add(std::string_view servers) {
+    std::string_view spec;
+    bool any = false;
+    while (next_element(servers, spec)) {
+        size_t colon = spec.rfind(':');
+        if (colon == std::string_view::npos || colon == 0) {
+            return false;
+        }
+        int port = 0;
+        std::string_view digits = spec.substr(colon + 1);
+        auto res = std::from_chars(digits.data(), digits.data() + digits.size(), port);
+        if (digits.empty() || res.ec != std::errc() || res.ptr != digits.data() + digits.size()
+                || port <= 0 || port > 65535) {
+            return false;
+        }
+        std::string host(spec.substr(0, colon));
+        struct addrinfo hints;
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_INET;
+        hints.ai_socktype = SOCK_STREAM;
+        struct addrinfo* result;
+        if (getaddrinfo(host.c_str(), NULL, &hints, &result) != 0) {
+            return false;
+        }
+        upstream* server = new upstream;
+        server->addr = *(const sockaddr_in*)result->ai_addr;
+        server->addr.sin_port = htons(port);
+        freeaddrinfo(result);
+        server->name = spec;
+        server->index = m_count++;
+        server->healthy = true;
+        server->active = 0;
+        m_servers.push_back(server);
+        any = true;
+    }
+    return any;
+}
+
+// least connections breaks ties in turn too, so an idle group still spreads the load
+upstream* upstream_group::pick() {
+    size_t n = m_servers.size();
+    size_t start = m_next.fetch_add(1, std::memory_order_relaxed) % n;
+    upstream* best = NULL;
+    for (size_t i = 0; i < n; ++i) {
+        upstream* server = m_servers[(start + i) % n];
+        if (!server->healthy.load(std::memory_order_relaxed)) {
+            continue;
+        }
+        if (m_balance == ROUND_ROBIN) {
+            return server;
+        }
+        if (!best || server->active.load(std::memory_order_relaxed) < best->active.load(std::memory_order_relaxed)) {
+            best = server;
+        }
+    }
+    return best;
+}
+
+void upstream_group::failed(upstream* server) {
+    if (server->healthy.exchange(false)) {
+        LOG_WARN("upstream %s is down, errno is: %d", server->name.c_str(), errno);
+    }
+}
+
+bool upstream_group::start_checks(int interval_ms) {
+    m_interval = interval_ms;
+    m_wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (m_wakefd == -1) {
+        return false;
+    }
+    if (pthread_create(&m_thread, NULL, checker, this) != 0) {
+        close(m_wakefd);
+        m_wakefd = -1;
+        return false;
+    }
+    m_started = true;
+    return true;
+}
+
+void upstream_group::stop_checks() {
+    if (!m_started) {
+        return;
+    }
+    uint64_t one = 1;
+    ::write(m_wakefd, &one, sizeof(one));
+    pthread_join(m_thread, NULL);
+    close(m_wakefd);
+    m_wakefd = -1;
+    m_started = false;
+}
+
+// a TCP handshake within the timeout, the server's HTTP is left alone
+bool upstream_group::probe(const upstream* server, int timeout_ms) {
+    int fd = socket(PF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+        return false;
+    }
+    bool up = connect(fd, (const struct sockaddr*)&server->addr, sizeof(server->addr)) == 0;
+    if (!up && errno == EINPROGRESS) {
+        struct pollfd pfd;
+        pfd.fd = fd;
+        pfd.events = POLLOUT;
+        int error = ETIMEDOUT;
+        socklen_t len = sizeof(error);
+        if (poll(&pfd, 1, timeout_ms) == 1) {
+            getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &len);
+        }
+        up = error == 0;
+        // for the log of failed()
+        errno = error;
+    }
+    close(fd);
+    return up;
+}
+
+void* upstream_group::checker(void* arg) {
+    upstream_group* group = (upstream_group*)arg;
+    struct pollfd pfd;
+    pfd.fd = group->m_wakefd;
+    pfd.events = POLLIN;
+    for (;;) {
+        int ret = poll(&pfd, 1, group->m_interval);
+        if (ret > 0 || (ret < 0 && errno != EINTR)) {
+            break;
+        }
+        for (upstream* server : group->m_servers) {
+            bool up = probe(server, group->m_interval);
+            if (up && !server->healthy.exchange(true)) {
+                LOG_INFO("upstream %s is up again", server->name.c_str());
+            } else if (!up) {
+                failed(server);
+            }
+        }
+    }
+    return NULL;
+}
+
+upstream_conn::upstream_conn(reactor* r, upstream* s, int sockfd) :
+owner(r), server(s), fd(sockfd), pipe_failed(false), piped(0), state(IDLE), reused(false), client(-1), slot(-1),
+deadline() {
+    pipe[0] = pipe[1] = -1;
+    deadline.sockfd = sockfd;
+    deadline.conn = this;
+    reset();
+}
+
+upstream_conn::~upstream_conn() {
+    if (fd != -1) {
+        close(fd);
+    }
+    if (pipe[0] != -1) {
+        close(pipe[0]);
+        close(pipe[1]);
+    }
+}
+
+void upstream_conn::reset() {
+    client = -1;
+    sent = 0;
+    in.clear();
+    out.clear();
+    out_sent = 0;
+    status = 0;
+    framing = NO_BODY;
+    remaining = 0;
+    dechunk = false;
+    eof = false;
+    responded = false;
+    keep_client = false;
+    keep_server = false;
+}
+
+// payload the length of which is known, or anything until the server closes
+bool upstream_conn::spliceable() {
+    if (state != BODY || done() || (framing == CHUNKED && decoder.data_left() == 0)) {
+        return false;
+    }
+    if (pipe[0] == -1 && !pipe_failed) {
+        if (pipe2(pipe, O_NONBLOCK | O_CLOEXEC) == -1) {
+            pipe_failed = true;
+            return false;
+        }
+        fcntl(pipe[1], F_SETPIPE_SZ, PIPE_SIZE);
+    }
+    return !pipe_failed;
+}
+
+bool upstream_conn::done() const {
+    switch (framing) {
+    case LENGTH:
+        return remaining == 0;
+    case CHUNKED:
+        return decoder.state() == chunked_decoder::DONE;
+    case UNTIL_CLOSE:
+        return eof;
+    default:
+        return true;
+    }
+}
+
+// "HTTP/1.1 200 OK" and the header lines; hop-by-hop headers stay behind and the
+// client gets a Connection header of its own
+bool upstream_conn::parse_head(const proxy_job& job, size_t head_len) {
+    std::string_view head(in.data(), head_len - 2);
+    size_t eol = head.find('\n');
+    std::string_view line = head.substr(0, eol);
+    if (!line.empty() && line.back() == '\r') {
+        line.remove_suffix(1);
+    }
+    if (line.size() < 12 || line.compare(0, 7, "HTTP/1.") != 0 || line[8] != ' ' || (line.size() > 12 && line[12] != ' ')) {
+        return false;
+    }
+    auto res = std::from_chars(line.data() + 9, line.data() + 12, status);
+    if (res.ec != std::errc() || res.ptr != line.data() + 12 || status < 100 || status > 599) {
+        return false;
+    }
+    if (status < 200) {
+        // 101 would switch protocols and we never ask for it, the others come before the response
+        if (status == 101) {
+            return false;
+        }
+        in.erase(0, head_len);
+        return true;
+    }
+    keep_server = line[7] == '1';
+    framing = UNTIL_CLOSE;
+
+    out.assign("HTTP/1.1");
+    out.append(line.substr(8));
+    out.append(crlf);
+    bool chunked = false;
+    bool length = false;
+    std::string_view fields = eol == std::string_view::npos ? std::string_view() : head.substr(eol + 1);
+    while (!fields.empty()) {
+        eol = fields.find('\n');
+        line = fields.substr(0, eol);
+        fields.remove_prefix(eol == std::string_view::npos ? fields.size() : eol + 1);
+        if (!line.empty() && line.back() == '\r') {
+            line.remove_suffix(1);
+        }
+        if (line.empty()) {
+            continue;
+        }
+        size_t colon = line.find(':');
+        if (colon == std::string_view::npos || colon == 0 || is_space(line[colon - 1])) {
+            return false;
+        }
+        std::string_view name = line.substr(0, colon);
+        std::string_view value = trim(line.substr(colon + 1));
+        if (iequals(name, "connection")) {
+            std::string_view token;
+            while (next_element(value, token)) {
+                if (iequals(token, "close")) {
+                    keep_server = false;
+                } else if (iequals(token, "keep-alive")) {
+                    keep_server = true;
+                }
+            }
+        } else if (iequals(name, "transfer-encoding")) {
+            // the last coding has to be chunked for the length to be known
+            std::string_view coding;
+            chunked = false;
+            while (next_element(value, coding)) {
+                chunked = iequals(coding, "chunked");
+            }
+            if (!job.http11) {
+                // the coding is gone from the body the client gets
+                continue;
+            }
+            out.append(line).append(crlf);
+            continue;
+        } else if (iequals(name, "content-length")) {
+            uint64_t n;
+            res = std::from_chars(value.data(), value.data() + value.size(), n);
+            if (value.empty() || res.ec != std::errc() || res.ptr != value.data() + value.size()
+                    || (length && n != remaining)) {
+                return false;
+            }
+            length = true;
+            remaining = n;
+        }
+        if (!hop_by_hop_header(name)) {
+            out.append(line).append(crlf);
+        }
+    }
+
+    if (job.head || status == 204 || status == 304) {
+        framing = NO_BODY;
+    } else if (chunked) {
+        // a Content-Length next to it is ignored and the connection isn't trusted after
+        framing = CHUNKED;
+        keep_server = keep_server && !length;
+        decoder.reset(UINT64_MAX);
+        dechunk = !job.http11;
+    } else if (length) {
+        framing = LENGTH;
+    } else {
+        keep_server = false;
+    }
+    if (job.head && length) {
+        remaining = 0;
+    }
+    keep_client = job.keep_alive && framing != UNTIL_CLOSE && !dechunk;
+    out.append(keep_client ? connection_keep_alive : connection_close);
+    out.append(crlf);
+    in.erase(0, head_len);
+    return true;
+}
+
+// bytes behind the body would be the start of a response nobody asked for, they end
+// the connection's reuse
+bool upstream_conn::take(const char* data, size_t len) {
+    switch (framing) {
+    case LENGTH: {
+        size_t n = len < remaining ? len : remaining;
+        out.append(data, n);
+        remaining -= n;
+        keep_server = keep_server && n == len;
+        return true;
+    }
+    case CHUNKED: {
+        const char* p = data;
+        const char* end = data + len;
+        while (p < end && !decoder.finished()) {
+            std::string_view payload;
+            const char* next = decoder.decode(p, end, payload);
+            if (dechunk) {
+                out.append(payload);
+            } else {
+                out.append(p, next - p);
+            }
+            p = next;
+        }
+        if (decoder.state() != chunked_decoder::DONE && decoder.finished()) {
+            return false;
+        }
+        keep_server = keep_server && p == end;
+        return true;
+    }
+    case UNTIL_CLOSE:
+        out.append(data, len);
+        return true;
+    default:
+        keep_server = keep_server && len == 0;
+        return true;
+    }
+}
@@ -0,0 +1,143 @@
+#ifndef PROXY_H
+#define PROXY_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include <netinet/in.h>
+#include <atomic>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "lst_timer.h"
+#include "upload.h"
+
+class reactor;
+struct upstream_conn;
+
+// Connection, Keep-Alive, Transfer-Encoding and the rest that only concern one hop, any case
+bool hop_by_hop_header(std::string_view name);
+
+// one server of an upstream_group
+struct upstream {
+    sockaddr_in addr;
+    std::string name;               // "host:port" as configured, for the log
+    int index;                      // of the reactors' idle lists, unique over all groups
+    std::atomic<bool> healthy;      // the last connect to it worked, either a request's or a check's
+    std::atomic<int> active;        // requests in flight on it over all reactors
+};
+
+/*
+    The servers a proxied prefix is forwarded to. pick() skips servers that are down:
+    a failed connect marks one down at once, and a checker thread connects to every
+    server once per interval and brings them back up. Any reactor picks, the state is
+    a few atomics.
+*/
+class upstream_group {
+public:
+    enum BALANCE { ROUND_ROBIN = 0, LEAST_CONN };
+
+    explicit upstream_group(BALANCE balance);
+    ~upstream_group();  // stops the checker
+
+    // "host:port,host:port", a name is resolved once here. False if one of them isn't valid
+    bool add(std::string_view servers);
+
+    // the next healthy server, NULL if every one is down
+    upstream* pick();
+    // a request couldn't connect to server
+    static void failed(upstream* server);
+
+    bool start_checks(int interval_ms);
+    void stop_checks();
+
+private:
+    static void* checker(void* arg);
+    static bool probe(const upstream* server, int timeout_ms);
+
+    std::vector<upstream*> m_servers;
+    BALANCE m_balance;
+    std::atomic<unsigned> m_next;
+    static std::atomic<int> m_count;    // upstreams of every group
+    pthread_t m_thread;
+    bool m_started;
+    int m_wakefd;
+    int m_interval;
+};
+
+// what the reactor needs of a request it forwards, built by the worker that parsed it
+struct proxy_job {
+    upstream_group* group;
+    upstream_conn* conn;    // carrying it, NULL until the reactor starts it
+    std::string request;    // as it goes upstream: request line, end-to-end headers, X-Forwarded-For, body
+    bool head;              // the response has no body, whatever its headers say
+    bool http11;            // the client takes a chunked body as it is, an HTTP/1.0 one gets the payload only
+    bool keep_alive;        // the client wants to keep the connection
+    bool idempotent;        // may be sent again when a pooled connection turns out to be closed
+    int attempts;           // upstream connections tried for it
+};
+
+// the timer of an upstream connection, on the wheel of its reactor
+struct upstream_timer : client_data {
+    upstream_conn* conn;
+};
+
+/*
+    A connection to an upstream server, owned by one reactor and driven by its epoll
+    loop like a client connection. Between requests it waits on the reactor's idle
+    list (IDLE); a request takes it there or connects a new one (CONNECTING), writes
+    the request (SENDING), reads the response head (HEAD) and relays the body (BODY).
+    The head is rewritten into out; body bytes that have been read go the same way,
+    the rest moves socket -> pipe -> client socket with splice() and never reaches
+    user space. The pipe only takes bytes once out has been written and is empty
+    again before anything is read, so the client gets them in order.
+*/
+struct upstream_conn {
+    enum STATE { IDLE = 0, CONNECTING, SENDING, HEAD, BODY };
+    // how the end of the body is found
+    enum FRAMING { NO_BODY = 0, LENGTH, CHUNKED, UNTIL_CLOSE };
+
+    static const int MAX_HEAD = 16384;      // a longer response head is a bad response
+    static const int READ_SIZE = 4096;      // bytes read for the head and the chunk framing
+    static const int PIPE_SIZE = 1 << 20;   // asked for, the default 64KB is what we get otherwise
+
+    reactor* owner;
+    upstream* server;
+    int fd;                 // -1 once it is closed, the object goes at the end of the round of events
+    int pipe[2];            // -1 until the first body is spliced, or if that failed
+    bool pipe_failed;
+    size_t piped;           // bytes in the pipe
+    STATE state;
+    bool reused;            // from the idle list: it may have been closed by the server in the meantime
+    int client;             // the fd of the client it works for, -1 while idle
+    int slot;               // in reactor::m_upstreams
+    size_t sent;            // bytes of the request written
+    std::string in;         // the response head until it is complete
+    std::string out;        // bytes for the client before the pipe's
+    size_t out_sent;
+    int status;
+    FRAMING framing;
+    uint64_t remaining;     // LENGTH: body bytes to come
+    chunked_decoder decoder;
+    bool dechunk;           // HTTP/1.0 client: only the payload of a chunked body goes out
+    bool eof;               // UNTIL_CLOSE: the server closed, the body is complete
+    bool responded;         // bytes reached the client, it is too late for a 502
+    bool keep_client;       // the client connection stays open after the response
+    bool keep_server;       // the server keeps this connection open after the response
+    upstream_timer deadline;
+
+    upstream_conn(reactor* r, upstream* s, int sockfd);
+    ~upstream_conn();       // closes the pipe, and the socket unless the reactor did
+
+    void reset();           // forget the exchange, the connection is idle
+    bool spliceable();      // body bytes can go to the pipe now
+    bool done() const;      // the whole body has been read
+
+    // parse the complete head in in and build the client's head in out; false if
+    // the response is malformed. A 1xx head is dropped and in keeps the rest
+    bool parse_head(const proxy_job& job, size_t head_len);
+    // body bytes that have been read, the ones that belong to the response go to out;
+    // false if the body is malformed
+    bool take(const char* data, size_t len);
+};
+
+#endif
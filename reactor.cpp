@@ -0,0 +1,393 @@
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <assert.h>
+#include "reactor.h"
+
+extern void addfd(int epollfd, int fd, bool one_shot);
+extern void modfd(int epollfd, int fd, int ev);
+extern int setnonblocking(int fd);
+
+http_conn* reactor::m_users = NULL;
+listen_config reactor::m_listen = { SOMAXCONN, 0, false, std::vector<int>() };
+int reactor::m_shared_listenfd = -1;
+int reactor::m_max_fd = 65536;
+ring_conn* reactor::m_ring_conns = NULL;
+
+reactor::reactor(int port, http_conn* users, client_data* users_timer, conn_threadpool* pool,
+                 ring_conn* ring_conns) :
+m_port(port), m_listenfd(-1), m_epollfd(-1), m_wakefd(-1), m_timerfd(-1), m_reserve_fd(-1),
+m_started(false), m_stop(false), m_draining(false),
+m_users_timer(users_timer), m_pool(pool), m_events(NULL), m_ring(NULL), m_chunks(NULL), m_sleeping(false),
+m_wake_count(0), m_tick_count(0) {
+    m_users = users;
+    if (ring_conns) {
+        m_ring_conns = ring_conns;
+    }
+}
+
+reactor::~reactor() {
+    stop();
+    if (m_timerfd != -1) {
+        close(m_timerfd);
+    }
+    if (m_wakefd != -1) {
+        close(m_wakefd);
+    }
+    if (m_epollfd != -1) {
+        close(m_epollfd);
+    }
+    if (m_listenfd != -1) {
+        close(m_listenfd);
+    }
+    if (m_reserve_fd != -1) {
+        close(m_reserve_fd);
+    }
+    for (upstream_conn* up : m_upstreams) {
+        // the wheel unlinks what is still on it once it goes, after this
+        m_timer_wheel.del_timer(&up->deadline.timer);
+        delete up;
+    }
+    for (upstream_conn* up : m_closed) {
+        delete up;
+    }
+    delete[] m_events;
+    delete m_ring;
+    delete m_chunks;
+}
+
+// the listener is nonblocking so accept4() can drain it until EAGAIN
+bool reactor::open_listener() {
+    if (m_listen.exclusive && m_shared_listenfd != -1) {
+        // the same socket, a descriptor of our own so every reactor can close its copy
+        m_listenfd = fcntl(m_shared_listenfd, F_DUPFD_CLOEXEC, 0);
+        return m_listenfd != -1;
+    }
+    if (!m_listen.inherited.empty()) {
+        // bound and listening already, connections queued on it before the handover are
+        // ours. listen() again only takes our backlog
+        m_listenfd = m_listen.inherited.back();
+        m_listen.inherited.pop_back();
+        if (m_listen.exclusive) {
+            m_shared_listenfd = m_listenfd;
+        }
+        setsockopt(m_listenfd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &m_listen.defer_accept, sizeof(m_listen.defer_accept));
+        return listen(m_listenfd, m_listen.backlog) == 0;
+    }
+
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = INADDR_ANY;
+    address.sin_port = htons(m_port);
+
+    m_listenfd = socket(PF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (m_listenfd < 0) {
+        return false;
+    }
+
+    // 端口复用, unless the listener is shared every reactor binds its own to the same port
+    int reuse = 1;
+    setsockopt(m_listenfd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    if (!m_listen.exclusive) {
+        setsockopt(m_listenfd, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof(reuse));
+    }
+
+    if (bind(m_listenfd, (struct sockaddr *)&address, sizeof(address)) == -1) {
+        return false;
+    }
+    if (m_listen.defer_accept > 0) {
+        setsockopt(m_listenfd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &m_listen.defer_accept, sizeof(m_listen.defer_accept));
+    }
+    if (listen(m_listenfd, m_listen.backlog) == -1) {
+        return false;
+    }
+    if (m_listen.exclusive) {
+        m_shared_listenfd = m_listenfd;
+    }
+    return true;
+}
+
+bool reactor::start() {
+    if (!open_listener()) {
+        return false;
+    }
+    m_reserve_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+
+    if (m_ring_conns) {
+        if (start_ring()) {
+            if (pthread_create(&m_thread, NULL, worker, this) != 0) {
+                return false;
+            }
+            m_started = true;
+            return true;
+        }
+        LOG_WARN("io_uring is not available, errno is: %d, falling back to epoll", errno);
+    }
+
+    m_epollfd = epoll_create(5);
+    if (m_epollfd == -1) {
+        return false;
+    }
+    epoll_event event;
+    event.data.u64 = m_listenfd;
+    event.events = EPOLLIN | (m_listen.exclusive ? (uint32_t)EPOLLEXCLUSIVE : 0u);
+    if (epoll_ctl(m_epollfd, EPOLL_CTL_ADD, m_listenfd, &event) == -1) {
+        return false;
+    }
+
+    m_wakefd = eventfd(0, EFD_NONBLOCK);
+    if (m_wakefd == -1) {
+        return false;
+    }
+    addfd(m_epollfd, m_wakefd, false);
+
+    m_timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (m_timerfd == -1) {
+        return false;
+    }
+    if (!start_tick(m_timerfd)) {
+        return false;
+    }
+    addfd(m_epollfd, m_timerfd, false);
+
+    m_events = new epoll_event[MAX_EVENT_NUMBER];
+    if (pthread_create(&m_thread, NULL, worker, this) != 0) {
+        return false;
+    }
+    m_started = true;
+    return true;
+}
+
+// expire every TICK_MS
+bool reactor::start_tick(int timerfd) {
+    struct itimerspec its;
+    its.it_interval.tv_sec = TICK_MS / 1000;
+    its.it_interval.tv_nsec = (TICK_MS % 1000) * 1000000;
+    its.it_value = its.it_interval;
+    return timerfd_settime(timerfd, 0, &its, NULL) == 0;
+}
+
+void reactor::stop() {
+    if (!m_started) {
+        return;
+    }
+    m_stop = true;
+    uint64_t one = 1;
+    ::write(m_wakefd, &one, sizeof(one));
+    pthread_join(m_thread, NULL);
+    m_started = false;
+}
+
+void reactor::drain() {
+    if (!m_started) {
+        return;
+    }
+    m_draining = true;
+    uint64_t one = 1;
+    ::write(m_wakefd, &one, sizeof(one));
+}
+
+// epoll: events of this round may still name the listener, so it goes after them
+void reactor::stop_listening() {
+    epoll_ctl(m_epollfd, EPOLL_CTL_DEL, m_listenfd, NULL);
+    close(m_listenfd);
+    m_listenfd = -1;
+}
+
+void* reactor::worker(void* arg) {
+    reactor* r = (reactor*)arg;
+    if (r->m_ring) {
+        r->run_ring();
+    } else {
+        r->run();
+    }
+    return r;
+}
+
+// 定时器回调函数，它删除非活动连接socket上的注册事件，并关闭之。
+void reactor::cb_func(client_data* user_data) {
+    assert(user_data);
+    int sockfd = user_data->sockfd;
+    if (m_ring_conns && m_ring_conns[sockfd].owner) {
+        // the kernel may still own operations on it, the reactor closes it once they are done
+        m_ring_conns[sockfd].owner->ring_close(sockfd);
+        return;
+    }
+    m_users[sockfd].close_conn();
+}
+
+// drain the accept queue up to the budget; accept4() returns the socket nonblocking already
+void reactor::handle_accept() {
+    for (int i = 0; i < ACCEPT_BUDGET; ++i) {
+        struct sockaddr_in client_address;
+        socklen_t client_addrlength = sizeof(client_address);
+
+        int connfd = accept4(m_listenfd, (struct sockaddr *)&client_address, &client_addrlength,
+                             SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (connfd < 0) {
+            if (errno == EMFILE || errno == ENFILE) {
+                if (shed_connection()) {
+                    continue;
+                }
+            } else if (errno == ECONNABORTED || errno == EINTR) {
+                continue;
+            } else if (errno != EAGAIN) {
+                LOG_ERROR("accept errno is: %d", errno);
+            }
+            return;
+        }
+
+        if (connfd >= m_max_fd) {
+            close(connfd);
+            continue;
+        }
+        http_conn& conn = m_users[connfd];
+        conn.init(connfd, client_address, m_epollfd);
+        start_timer(connfd, client_address);
+
+        // the request usually came with the handshake (with TCP_DEFER_ACCEPT it always
+        // did), read it now rather than one epoll_wait later
+        if (!conn.read()) {
+            handle_close(connfd);
+        } else if (conn.has_input()) {
+            dispatch(connfd);
+        } else {
+            modfd(m_epollfd, connfd, EPOLLIN);
+        }
+    }
+}
+
+// out of fds: spend the reserved one to accept a connection and close it at once, the
+// client sees the connection fail instead of hanging in the queue and the loop doesn't
+// spin on a listener that stays readable
+bool reactor::shed_connection() {
+    if (m_reserve_fd == -1) {
+        return false;
+    }
+    close(m_reserve_fd);
+    int connfd = accept(m_listenfd, NULL, NULL);
+    if (connfd >= 0) {
+        close(connfd);
+    }
+    m_reserve_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    return connfd >= 0;
+}
+
+void reactor::start_timer(int connfd, const sockaddr_in& client_address) {
+    client_data *data = &m_users_timer[connfd];
+    data->address = client_address;
+    data->sockfd = connfd;
+
+    // 定时器嵌入在 client_data 中，设置其回调函数与超时时间后挂到时间轮上
+    data->timer.user_data = data;
+    data->timer.cb_func = cb_func;
+    m_timer_wheel.add_timer(&data->timer, CONN_TIMEOUT / TICK_MS);
+}
+
+void reactor::handle_close(int sockfd) {
+    proxy_job* job = m_users[sockfd].proxy();
+    if (job && job->conn) {
+        // a response cut short leaves the upstream connection in no state to be reused
+        upstream_done(job->conn, false);
+    }
+    m_users[sockfd].close_conn();
+    m_timer_wheel.del_timer(&m_users_timer[sockfd].timer);
+}
+
+// hand the connection to a worker. A full queue means the workers are far behind, the
+// connection is closed rather than kept waiting for a wakeup that nobody will send
+void reactor::dispatch(int sockfd) {
+    if (!m_pool->append(m_users + sockfd)) {
+        handle_close(sockfd);
+    }
+}
+
+void reactor::run() {
+    while (!m_stop) {
+        uint64_t ticks = 0;
+        int number = epoll_wait(m_epollfd, m_events, MAX_EVENT_NUMBER, -1);
+        if (number < 0 && errno != EINTR) {
+            LOG_ERROR("epoll failure");
+            break;
+        }
+
+        for (int i = 0; i < number; i++) {
+            uint64_t data = m_events[i].data.u64;
+            if (data & UPSTREAM_TAG) {
+                proxy_event((upstream_conn*)(uintptr_t)(data & ~UPSTREAM_TAG));
+                continue;
+            }
+            int socketfd = (int)data;
+            if (socketfd == m_listenfd) {
+                handle_accept();
+            } else if (socketfd == m_wakefd) {
+                uint64_t count;
+                ::read(m_wakefd, &count, sizeof(count));
+            } else if (socketfd == m_timerfd) {
+                // the timerfd counts every expiration since the last read, so
+                // a loop that was busy for a while catches up in one go
+                if (::read(m_timerfd, &ticks, sizeof(ticks)) != sizeof(ticks)) {
+                    ticks = 0;
+                }
+            } else if (m_events[i].events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+                handle_close(socketfd);
+            } else if (m_events[i].events & EPOLLIN) {
+                if (m_users[socketfd].read()) {
+                    // before dispatch(), which may close it
+                    m_timer_wheel.adjust_timer(&m_users_timer[socketfd].timer, CONN_TIMEOUT / TICK_MS);
+                    LOG_DEBUG("adjust timer once");
+                    if (m_users[socketfd].receiving()) {
+                        // read() stored what there was of an upload's body, the worker gets it once it is complete
+                        modfd(m_epollfd, socketfd, EPOLLIN);
+                    } else {
+                        dispatch(socketfd);
+                    }
+                } else {
+                    handle_close(socketfd);
+                }
+            } else if (m_events[i].events & EPOLLOUT) {
+                http_conn& conn = m_users[socketfd];
+                proxy_job* job = conn.proxy();
+                if (job && job->conn) {
+                    // the client takes more of a proxied response
+                    proxy_relay(job->conn);
+                } else if (conn.write()) {
+                    // a long download is activity too, keep it off the idle list
+                    m_timer_wheel.adjust_timer(&m_users_timer[socketfd].timer, CONN_TIMEOUT / TICK_MS);
+                    if (conn.proxy()) {
+                        // the responses gathered before a proxied request are out once nothing is left
+                        if (conn.sent_all()) {
+                            proxy_start(socketfd);
+                        }
+                    } else if (conn.pipelined()) {
+                        dispatch(socketfd);
+                    }
+                } else {
+                    handle_close(socketfd);
+                }
+            }
+        }
+        for (upstream_conn* up : m_closed) {
+            delete up;
+        }
+        m_closed.clear();
+        if (m_draining && m_listenfd != -1) {
+            stop_listening();
+        }
+
+        // 最后处理定时事件，因为I/O事件有更高的优先级。
+        if (ticks) {
+            m_timer_wheel.tick(ticks);
+            metrics::set(GAUGE_TIMERS, m_timer_wheel.size());
+        }
+    }
+}
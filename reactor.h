@@ -0,0 +1,198 @@
+#ifndef REACTOR_H
+#define REACTOR_H
+
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <vector>
+#include "http_conn.h"
+#include "lst_timer.h"
+#include "threadpool.h"
+#include "buffer_pool.h"
+#include "io_ring.h"
+#include "proxy.h"
+
+#define MAX_FD (1 << 22)       // upper bound of the fd-indexed tables, main() sizes them by RLIMIT_NOFILE
+#define MAX_EVENT_NUMBER 10000 // max num of listened events
+#define TICK_MS 100            // granularity of the timing wheel
+#define CONN_TIMEOUT 15000     // idle connection timeout in ms
+#define ACCEPT_BUDGET 64       // connections accepted per wakeup, the listener is level-triggered and reports the rest again
+
+#define UPSTREAM_TIMEOUT 10000  // a proxied exchange that makes no progress for this long is given up, 504 if nothing was relayed yet
+#define UPSTREAM_IDLE_TIMEOUT 4000  // a pooled upstream connection is closed before the server is likely to do it
+#define UPSTREAM_MAX_IDLE 32    // pooled connections per upstream server and reactor
+#define UPSTREAM_ATTEMPTS 3     // upstream connections tried for one request
+#define UPSTREAM_TAG (1ULL << 63)   // epoll data of an upstream connection is its address with this bit, a client's is its fd
+
+#define RING_ENTRIES 4096               // SQ entries of an io_uring reactor, the CQ has four times as many
+#define RING_BUFFERS 1024               // provided receive buffers per io_uring reactor
+#define RING_BUFFER_SIZE 4096
+#define RING_CHUNK_SIZE (128 * 1024)    // file bytes read and sent per step of a response
+#define RING_PARK_MAX 8                 // buffers held for a busy connection before its recv is paused
+
+// workers own lock-free rings and steal from each other, locked_queue<http_conn>
+// gives back the single list + mutex + semaphore queue. Measured end to end on one
+// core only: ahead up to 16 workers, behind at 64; many cores are not measured yet
+typedef threadpool<http_conn, stealing_queue<http_conn> > conn_threadpool;
+
+class reactor;
+
+// how the reactors listen, set before the first start()
+struct listen_config {
+    int backlog;
+    int defer_accept;   // seconds TCP_DEFER_ACCEPT holds a connection back until its request arrives, 0 is off
+    bool exclusive;     // one listener shared by every reactor and woken with EPOLLEXCLUSIVE instead of
+                        // one SO_REUSEPORT listener each: a busy loop doesn't get connections it can't serve
+    std::vector<int> inherited; // listeners handed over by the process we replace, taken before new ones are opened
+};
+
+/*
+    Per-fd state of a connection driven by io_uring, fd-indexed and shared by the
+    reactors like the users table. Only the owning reactor's thread touches it.
+    A connection is either waiting for input (RING_IDLE), with a worker (RING_BUSY)
+    or having its responses sent (RING_SENDING); the fd is only closed once the
+    kernel is done with every operation on it, so a late completion can never
+    reach the next connection that gets the same fd.
+*/
+enum RING_STATE { RING_IDLE = 0, RING_BUSY, RING_SENDING };
+
+struct ring_conn {
+    reactor* owner;         // NULL when the fd isn't an io_uring connection
+    RING_STATE state;
+    bool recv_armed;        // the multishot recv is running
+    bool closing;           // close as soon as no worker has it and nothing is in flight
+    bool failed;            // the send step in flight went wrong
+    int sending;            // operations of the send step in flight
+    int registered;         // the fd as the registered file table should see it
+    char* chunk;            // file bytes of the send step in flight
+    off_t chunk_len;
+    struct msghdr msg;      // iovecs of the send step in flight
+    // provided buffers received while the connection was busy, linked through
+    // reactor::m_parked. Completions already posted keep coming after the recv is
+    // paused, so there is no fixed bound here
+    int park_head;
+    int park_tail;
+    int park_count;
+};
+
+// a provided buffer waiting in a ring_conn's park list, indexed by buffer id
+struct parked_buffer {
+    uint16_t next;
+    uint16_t offset;        // bytes of it already fed to the connection
+    uint16_t len;
+};
+
+/*
+    One event loop of the server. Every reactor owns its own SO_REUSEPORT listener,
+    epoll instance and timing wheel, and runs on its own thread. The kernel spreads
+    new connections over the listeners, and a connection accepted by a reactor is
+    only ever touched by that reactor (and by the worker processing its request),
+    so reactors share nothing but the threadpool and the fd-indexed users table. The
+    reverse proxy keeps it that way: every reactor has its own pool of upstream
+    connections and relays the responses of its clients itself.
+*/
+class reactor {
+public:
+    // ring_conns selects the io_uring backend, start() falls back to epoll when the kernel can't do it
+    reactor(int port, http_conn* users, client_data* users_timer, conn_threadpool* pool,
+            ring_conn* ring_conns = NULL);
+    ~reactor();
+
+    bool start();   // open the listener and the epoll instance or io_uring, then spawn the loop thread
+    void stop();    // wake the loop up, ask it to exit and wait for it
+    // stop accepting: the loop closes its listener and goes on serving the connections it has. Any thread
+    void drain();
+    int listenfd() const { return m_listenfd; }
+    bool uring() const { return m_ring != NULL; }
+
+    // io_uring: a worker is done with conn, see http_conn::next_event(). Any thread
+    void resume(http_conn* conn);
+
+    static listen_config m_listen;
+    static int m_max_fd;            // size of the fd-indexed tables, larger fds are refused
+
+private:
+    static void* worker(void* arg);
+    bool open_listener();
+    void run();
+    void handle_accept();
+    bool shed_connection();
+    void start_timer(int connfd, const sockaddr_in& client_address);
+    static bool start_tick(int timerfd);
+    void stop_listening();
+    void handle_close(int sockfd);
+    void dispatch(int sockfd);
+    static void cb_func(client_data* user_data);
+
+    // reverse proxy, reactor_proxy.cpp
+    void proxy_start(int fd);
+    void proxy_connect(int fd);
+    void proxy_event(upstream_conn* up);
+    void proxy_relay(upstream_conn* up);
+    void proxy_finish(upstream_conn* up);
+    void proxy_retry(upstream_conn* up, int status);
+    void proxy_error(int fd, int status);
+    void proxy_timeout(upstream_conn* up);
+    void proxy_pipelined(int fd);
+    upstream_conn* upstream_open(upstream* server);
+    void upstream_arm(upstream_conn* up, int ev);
+    void upstream_done(upstream_conn* up, bool reuse);
+    void upstream_close(upstream_conn* up);
+    static void upstream_expired(client_data* data);
+
+    // io_uring backend, reactor_ring.cpp
+    bool start_ring();
+    void run_ring();
+    void ring_accept(int fd);
+    void ring_recv(int fd, int res, unsigned flags);
+    void ring_input(int fd);
+    void ring_resumed(http_conn* conn);
+    bool ring_dispatch(int fd);
+    void ring_send(int fd);
+    void ring_sent(int fd, int op, int res);
+    void ring_close(int fd);
+    void ring_finish(int fd);
+    void arm_accept();
+    void arm_recv(int fd);
+    void arm_read(int fd, void* buf, int op);
+    void cancel(int fd, uint64_t user_data, bool all);
+    void update_file(int fd, int value);
+    struct io_uring_sqe* sqe_for(int fd, int op);
+
+private:
+    int m_port;
+    int m_listenfd;
+    int m_epollfd;
+    int m_wakefd;                   // eventfd used by stop() to interrupt epoll_wait
+    int m_timerfd;                  // periodic timerfd that drives the timing wheel
+    int m_reserve_fd;               // given up to accept and reset a connection when out of fds
+    static int m_shared_listenfd;   // the listener of the first reactor with listen_config::exclusive
+    pthread_t m_thread;
+    bool m_started;
+    volatile bool m_stop;
+    volatile bool m_draining;       // the listener goes once the loop sees it
+
+    static http_conn* m_users;      // fd-indexed table shared by all reactors
+    client_data* m_users_timer;
+    conn_threadpool* m_pool;
+
+    time_wheel m_timer_wheel;       // timers of the connections owned by this reactor
+    epoll_event* m_events;
+
+    // reverse proxy
+    std::vector<std::vector<upstream_conn*> > m_idle;   // pooled upstream connections by upstream::index
+    std::vector<upstream_conn*> m_upstreams;            // every open upstream connection, by upstream_conn::slot
+    std::vector<upstream_conn*> m_closed;               // deleted once the events that may still name them are handled
+
+    // io_uring backend
+    static ring_conn* m_ring_conns; // fd-indexed, NULL with epoll
+    io_ring* m_ring;
+    buffer_pool* m_chunks;          // RING_CHUNK_SIZE blocks for file bodies
+    mpmc_ring<http_conn> m_resumed; // connections handed back by the workers
+    std::vector<int> m_starved;     // recv ran out of provided buffers, rearmed on the next tick
+    std::vector<parked_buffer> m_parked;
+    std::atomic<bool> m_sleeping;   // the loop waits in the kernel, resume() has to wake it
+    uint64_t m_wake_count;          // read targets of the eventfd and the timerfd
+    uint64_t m_tick_count;
+};
+
+#endif
@@ -0,0 +1,399 @@
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <algorithm>
+#include "reactor.h"
+
+/*
+    The reverse proxy side of the epoll reactor. A worker parses a request for a
+    proxied prefix, builds what goes upstream and hands the connection back for
+    EPOLLOUT like any other response; once the responses gathered before it are
+    out, the reactor takes over:
+        - a healthy server of the group is picked and a pooled connection to it
+          reused, or a new one connected without blocking;
+        - the request is written and the response head read into the upstream
+          connection, then rewritten for the client;
+        - the body is spliced from the upstream socket through a pipe into the
+          client socket, only the chunk framing and what came with the head are
+          read into user space. A client that doesn't keep up stops the reading:
+          the upstream is only armed again once the pipe is empty;
+        - the upstream connection goes back to the pool if both ends allow it,
+          and the client is read from or handed to a worker again.
+    Both sockets are in the reactor's epoll set, the upstream with its address as
+    the event data; a client that goes to a worker afterwards leaves it until it is
+    handed back. The exchange runs on a timer of its own on the reactor's wheel, the
+    client's timer starts again once the response is out.
+*/
+
+extern void modfd(int epollfd, int fd, int ev);
+
+// the responses gathered before the request are out, forward it
+void reactor::proxy_start(int fd) {
+    // the exchange has a timer of its own, the client's starts again once it is over
+    m_timer_wheel.del_timer(&m_users_timer[fd].timer);
+    // until the response arrives only a hangup of the client is of interest
+    modfd(m_epollfd, fd, 0);
+    proxy_connect(fd);
+}
+
+// a pooled connection to a healthy server of the group, or a new one
+void reactor::proxy_connect(int fd) {
+    proxy_job& job = *m_users[fd].proxy();
+    upstream_conn* up = NULL;
+    while (!up) {
+        upstream* server = job.group->pick();
+        if (!server) {
+            proxy_error(fd, 503);
+            return;
+        }
+        up = upstream_open(server);
+        if (!up && ++job.attempts >= UPSTREAM_ATTEMPTS) {
+            proxy_error(fd, 502);
+            return;
+        }
+    }
+    up->client = fd;
+    up->server->active++;
+    job.conn = up;
+    m_timer_wheel.add_timer(&up->deadline.timer, UPSTREAM_TIMEOUT / TICK_MS);
+    if (up->state == upstream_conn::CONNECTING) {
+        upstream_arm(up, EPOLLOUT);
+    } else {
+        proxy_relay(up);
+    }
+}
+
+upstream_conn* reactor::upstream_open(upstream* server) {
+    if ((size_t)server->index < m_idle.size() && !m_idle[server->index].empty()) {
+        upstream_conn* up = m_idle[server->index].back();
+        m_idle[server->index].pop_back();
+        up->state = upstream_conn::SENDING;
+        up->reused = true;
+        metrics::add(UPSTREAM_REUSES);
+        return up;
+    }
+    int sockfd = socket(PF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (sockfd == -1) {
+        LOG_WARN("can't open an upstream socket, errno is: %d", errno);
+        return NULL;
+    }
+    int one = 1;
+    setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    int ret = connect(sockfd, (const struct sockaddr*)&server->addr, sizeof(server->addr));
+    if (ret == -1 && errno != EINPROGRESS) {
+        upstream_group::failed(server);
+        metrics::add(UPSTREAM_FAILURES);
+        close(sockfd);
+        return NULL;
+    }
+    upstream_conn* up = new upstream_conn(this, server, sockfd);
+    up->state = ret == 0 ? upstream_conn::SENDING : upstream_conn::CONNECTING;
+    up->slot = m_upstreams.size();
+    m_upstreams.push_back(up);
+    up->deadline.timer.user_data = &up->deadline;
+    up->deadline.timer.cb_func = upstream_expired;
+
+    // registered disarmed, like a client
+    epoll_event event;
+    event.data.u64 = (uint64_t)(uintptr_t)up | UPSTREAM_TAG;
+    event.events = EPOLLONESHOT;
+    epoll_ctl(m_epollfd, EPOLL_CTL_ADD, sockfd, &event);
+    metrics::add(UPSTREAM_CONNECTS);
+    return up;
+}
+
+void reactor::upstream_arm(upstream_conn* up, int ev) {
+    epoll_event event;
+    event.data.u64 = (uint64_t)(uintptr_t)up | UPSTREAM_TAG;
+    event.events = ev | EPOLLONESHOT | EPOLLRDHUP;
+    epoll_ctl(m_epollfd, EPOLL_CTL_MOD, up->fd, &event);
+}
+
+void reactor::proxy_event(upstream_conn* up) {
+    if (up->fd == -1) {
+        // closed by an event before this one
+        return;
+    }
+    if (up->state == upstream_conn::IDLE) {
+        // nobody asked a pooled connection for anything, the server is closing it
+        upstream_close(up);
+        return;
+    }
+    if (up->state == upstream_conn::CONNECTING) {
+        int error = 0;
+        socklen_t len = sizeof(error);
+        if (getsockopt(up->fd, SOL_SOCKET, SO_ERROR, &error, &len) == -1 || error != 0) {
+            errno = error;
+            proxy_retry(up, 502);
+            return;
+        }
+        up->state = upstream_conn::SENDING;
+    }
+    proxy_relay(up);
+}
+
+// move the exchange on as far as both sockets let it. Everything for the client is
+// written before anything more is read from the server
+void reactor::proxy_relay(upstream_conn* up) {
+    int fd = up->client;
+    const proxy_job& job = *m_users[fd].proxy();
+    // one of the sockets is ready, that is progress
+    m_timer_wheel.adjust_timer(&up->deadline.timer, UPSTREAM_TIMEOUT / TICK_MS);
+    if (up->state == upstream_conn::SENDING) {
+        while (up->sent < job.request.size()) {
+            ssize_t n = send(up->fd, job.request.data() + up->sent, job.request.size() - up->sent, 0);
+            if (n < 0 && errno == EAGAIN) {
+                upstream_arm(up, EPOLLOUT);
+                return;
+            }
+            if (n < 0) {
+                proxy_retry(up, 502);
+                return;
+            }
+            up->sent += n;
+        }
+        up->state = upstream_conn::HEAD;
+    }
+
+    off_t budget = http_conn::MAX_SEND_PER_CALL;
+    while (true) {
+        if (up->out_sent < up->out.size() || up->piped > 0) {
+            if (budget <= 0) {
+                // give the other connections of the reactor a turn
+                modfd(m_epollfd, fd, EPOLLOUT);
+                return;
+            }
+            ssize_t n;
+            if (up->out_sent < up->out.size()) {
+                n = send(fd, up->out.data() + up->out_sent, up->out.size() - up->out_sent, 0);
+            } else {
+                n = splice(up->pipe[0], NULL, fd, NULL, up->piped, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            }
+            if (n < 0 && errno == EAGAIN) {
+                modfd(m_epollfd, fd, EPOLLOUT);
+                return;
+            }
+            if (n <= 0) {
+                // the client is gone
+                handle_close(fd);
+                return;
+            }
+            if (up->out_sent < up->out.size()) {
+                up->out_sent += n;
+            } else {
+                up->piped -= n;
+            }
+            up->responded = true;
+            budget -= n;
+            metrics::add(BYTES_SENT, n);
+            continue;
+        }
+        up->out.clear();
+        up->out_sent = 0;
+        if (up->state == upstream_conn::BODY && up->done()) {
+            proxy_finish(up);
+            return;
+        }
+
+        ssize_t n;
+        bool bad = false;
+        if (up->spliceable()) {
+            uint64_t want = upstream_conn::PIPE_SIZE;
+            if (up->framing == upstream_conn::LENGTH && up->remaining < want) {
+                want = up->remaining;
+            } else if (up->framing == upstream_conn::CHUNKED && up->decoder.data_left() < want) {
+                want = up->decoder.data_left();
+            }
+            n = splice(up->fd, NULL, up->pipe[1], NULL, want, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (n > 0) {
+                up->piped = n;
+                if (up->framing == upstream_conn::LENGTH) {
+                    up->remaining -= n;
+                } else if (up->framing == upstream_conn::CHUNKED) {
+                    up->decoder.skip(n);
+                }
+            }
+        } else if (up->state == upstream_conn::HEAD) {
+            size_t old = up->in.size();
+            up->in.resize(old + upstream_conn::READ_SIZE);
+            n = recv(up->fd, &up->in[old], upstream_conn::READ_SIZE, 0);
+            up->in.resize(old + (n > 0 ? n : 0));
+            // a 1xx head is dropped and the real one may be right behind it
+            size_t end;
+            while (n > 0 && up->state == upstream_conn::HEAD && (end = up->in.find("\r\n\r\n")) != std::string::npos) {
+                if (!up->parse_head(job, end + 4)) {
+                    bad = true;
+                } else if (up->status >= 200) {
+                    up->state = upstream_conn::BODY;
+                    bad = !up->take(up->in.data(), up->in.size());
+                    up->in.clear();
+                }
+                if (bad) {
+                    break;
+                }
+            }
+            if (up->state == upstream_conn::HEAD && up->in.size() > upstream_conn::MAX_HEAD) {
+                bad = true;
+            }
+        } else {
+            char buf[upstream_conn::READ_SIZE];
+            n = recv(up->fd, buf, sizeof(buf), 0);
+            bad = n > 0 && !up->take(buf, n);
+        }
+
+        if (n == 0 && up->state == upstream_conn::BODY && up->framing == upstream_conn::UNTIL_CLOSE) {
+            up->eof = true;
+            up->keep_server = false;
+            continue;
+        }
+        if (n < 0 && errno == EAGAIN) {
+            upstream_arm(up, EPOLLIN);
+            return;
+        }
+        if (n <= 0 || bad) {
+            // closed or broken before the response was complete
+            if (bad) {
+                LOG_WARN("bad response from upstream %s", up->server->name.c_str());
+            }
+            proxy_retry(up, 502);
+            return;
+        }
+    }
+}
+
+// the response is out, the client goes on like after any other
+void reactor::proxy_finish(upstream_conn* up) {
+    int fd = up->client;
+    int status = up->status;
+    bool keep_alive = up->keep_client;
+    upstream_done(up, true);
+    http_conn& conn = m_users[fd];
+    if (!conn.end_proxy(status, keep_alive)) {
+        handle_close(fd);
+        return;
+    }
+    m_timer_wheel.add_timer(&m_users_timer[fd].timer, CONN_TIMEOUT / TICK_MS);
+    if (conn.pipelined()) {
+        proxy_pipelined(fd);
+    } else {
+        modfd(m_epollfd, fd, EPOLLIN);
+    }
+}
+
+// requests the client sent behind the proxied one go to a worker. proxy_start() left
+// the client armed for a hangup; it leaves the epoll set until the worker hands it back,
+// or the hangup would close it under the worker
+void reactor::proxy_pipelined(int fd) {
+    epoll_ctl(m_epollfd, EPOLL_CTL_DEL, fd, NULL);
+    dispatch(fd);
+}
+
+// the upstream connection failed. Before anything reached the client a refused connect
+// is tried on another server, and an idempotent request on a fresh connection when a
+// pooled one turns out to be closed; otherwise the client gets status, or is closed
+// in the middle of the response
+void reactor::proxy_retry(upstream_conn* up, int status) {
+    int fd = up->client;
+    proxy_job& job = *m_users[fd].proxy();
+    metrics::add(UPSTREAM_FAILURES);
+    if (up->responded) {
+        handle_close(fd);
+        return;
+    }
+    bool again = up->state == upstream_conn::CONNECTING
+            || (up->reused && job.idempotent && up->state <= upstream_conn::HEAD && up->in.empty());
+    if (up->state == upstream_conn::CONNECTING) {
+        upstream_group::failed(up->server);
+    } else if (!again) {
+        LOG_WARN("upstream %s failed, errno is: %d", up->server->name.c_str(), errno);
+    }
+    upstream_done(up, false);
+    if (again && ++job.attempts < UPSTREAM_ATTEMPTS) {
+        proxy_connect(fd);
+        return;
+    }
+    proxy_error(fd, status);
+}
+
+// no response from upstream: the client gets an error page the usual way
+void reactor::proxy_error(int fd, int status) {
+    http_conn& conn = m_users[fd];
+    m_timer_wheel.add_timer(&m_users_timer[fd].timer, CONN_TIMEOUT / TICK_MS);
+    if (!conn.proxy_error(status) || !conn.write()) {
+        handle_close(fd);
+        return;
+    }
+    if (conn.pipelined()) {
+        proxy_pipelined(fd);
+    }
+}
+
+void reactor::upstream_expired(client_data* data) {
+    upstream_conn* up = static_cast<upstream_timer*>(data)->conn;
+    up->owner->proxy_timeout(up);
+}
+
+void reactor::proxy_timeout(upstream_conn* up) {
+    if (up->state == upstream_conn::IDLE) {
+        upstream_close(up);
+        return;
+    }
+    int fd = up->client;
+    LOG_WARN("upstream %s timed out", up->server->name.c_str());
+    metrics::add(UPSTREAM_FAILURES);
+    if (up->responded) {
+        handle_close(fd);
+        return;
+    }
+    if (up->state == upstream_conn::CONNECTING) {
+        upstream_group::failed(up->server);
+    }
+    upstream_done(up, false);
+    proxy_error(fd, 504);
+}
+
+// the exchange is over, the connection is pooled if both sides keep it open
+void reactor::upstream_done(upstream_conn* up, bool reuse) {
+    up->server->active--;
+    proxy_job* job = m_users[up->client].proxy();
+    if (job) {
+        job->conn = NULL;
+    }
+    if (!reuse || !up->keep_server || up->piped > 0) {
+        upstream_close(up);
+        return;
+    }
+    if ((size_t)up->server->index >= m_idle.size()) {
+        m_idle.resize(up->server->index + 1);
+    }
+    std::vector<upstream_conn*>& idle = m_idle[up->server->index];
+    if (idle.size() >= UPSTREAM_MAX_IDLE) {
+        upstream_close(up);
+        return;
+    }
+    up->reset();
+    up->state = upstream_conn::IDLE;
+    idle.push_back(up);
+    // any event of an idle connection means the server closes it
+    upstream_arm(up, EPOLLIN);
+    m_timer_wheel.add_timer(&up->deadline.timer, UPSTREAM_IDLE_TIMEOUT / TICK_MS);
+}
+
+void reactor::upstream_close(upstream_conn* up) {
+    m_timer_wheel.del_timer(&up->deadline.timer);
+    if (up->state == upstream_conn::IDLE) {
+        std::vector<upstream_conn*>& idle = m_idle[up->server->index];
+        idle.erase(std::find(idle.begin(), idle.end(), up));
+    }
+    epoll_ctl(m_epollfd, EPOLL_CTL_DEL, up->fd, NULL);
+    close(up->fd);
+    up->fd = -1;
+    m_upstreams[up->slot] = m_upstreams.back();
+    m_upstreams[up->slot]->slot = up->slot;
+    m_upstreams.pop_back();
+    m_closed.push_back(up);
+}
@@ -0,0 +1,563 @@
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <sched.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include "reactor.h"
+
+/*
+    The io_uring backend of the reactor. Instead of waiting for readiness and then
+    making the syscall, every operation is queued on the ring and the loop only
+    sees its completion:
+        - one multishot accept on the listener;
+        - one multishot recv per connection, the kernel picks a provided buffer
+          for each read and the bytes are copied into the connection's read buffer,
+          or those of an upload's body written to its file from the buffer;
+        - a send step per response run: a sendmsg of the gathered iovecs linked to
+          a read of the next file chunk into a pooled block and a send of it;
+        - reads of the eventfd and the timerfd for wake-ups and ticks.
+    Sockets live in the registered file table at their own fd, so no operation
+    looks the fd up. Everything queued in a loop iteration goes to the kernel in
+    the same io_uring_enter() that waits for the next completions, which is the
+    only syscall left in the steady state; a worker handing a connection back
+    costs an eventfd write only when the loop is asleep.
+*/
+
+// user_data of an operation: the fd above, what it is below
+enum RING_OP { OP_ACCEPT = 1, OP_WAKE, OP_TICK, OP_RECV, OP_SEND, OP_READ, OP_SEND_CHUNK, OP_CANCEL, OP_UPDATE };
+
+static inline uint64_t ring_data(int fd, int op) {
+    return (uint64_t)fd << 8 | op;
+}
+
+bool reactor::start_ring() {
+    io_ring* ring = new io_ring;
+    if (!ring->init(RING_ENTRIES, RING_BUFFERS, RING_BUFFER_SIZE, m_max_fd)) {
+        delete ring;
+        return false;
+    }
+    // blocking: the ring waits on them, a read of a nonblocking fd would just fail
+    m_wakefd = eventfd(0, EFD_CLOEXEC);
+    m_timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+    if (m_wakefd == -1 || m_timerfd == -1 || !start_tick(m_timerfd)) {
+        // start() makes its own for epoll
+        if (m_wakefd != -1) {
+            close(m_wakefd);
+            m_wakefd = -1;
+        }
+        if (m_timerfd != -1) {
+            close(m_timerfd);
+            m_timerfd = -1;
+        }
+        delete ring;
+        return false;
+    }
+    m_resumed.init(m_pool->capacity());
+    m_parked.resize(ring->buffer_count());
+    m_chunks = new buffer_pool(RING_CHUNK_SIZE, 64);
+    m_ring = ring;
+    return true;
+}
+
+// get an SQE for an operation on a connection, through the registered file table if there is one
+struct io_uring_sqe* reactor::sqe_for(int fd, int op) {
+    struct io_uring_sqe* sqe = m_ring->get_sqe();
+    if (!sqe) {
+        LOG_ERROR("io_uring submission queue is stuck");
+        return NULL;
+    }
+    sqe->fd = fd;
+    if (m_ring->fixed_files() && (op == OP_RECV || op == OP_SEND || op == OP_SEND_CHUNK)) {
+        sqe->flags = IOSQE_FIXED_FILE;
+    }
+    sqe->user_data = ring_data(fd, op);
+    return sqe;
+}
+
+// sockets come back blocking, the ring never waits on them
+void reactor::arm_accept() {
+    struct io_uring_sqe* sqe = sqe_for(m_listenfd, OP_ACCEPT);
+    if (sqe) {
+        sqe->opcode = IORING_OP_ACCEPT;
+        sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+        sqe->accept_flags = SOCK_CLOEXEC;
+    }
+}
+
+void reactor::arm_read(int fd, void* buf, int op) {
+    struct io_uring_sqe* sqe = sqe_for(fd, op);
+    if (sqe) {
+        sqe->opcode = IORING_OP_READ;
+        sqe->addr = (uint64_t)(uintptr_t)buf;
+        sqe->len = sizeof(uint64_t);
+    }
+}
+
+void reactor::arm_recv(int fd) {
+    struct io_uring_sqe* sqe = sqe_for(fd, OP_RECV);
+    if (!sqe) {
+        return;
+    }
+    sqe->opcode = IORING_OP_RECV;
+    sqe->flags |= IOSQE_BUFFER_SELECT;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->buf_group = io_ring::BUFFER_GROUP;
+    m_ring_conns[fd].recv_armed = true;
+}
+
+// cancel the operation with user_data, or every operation on fd
+void reactor::cancel(int fd, uint64_t user_data, bool all) {
+    struct io_uring_sqe* sqe = sqe_for(fd, OP_CANCEL);
+    if (!sqe) {
+        return;
+    }
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    if (all) {
+        sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL
+            | (m_ring->fixed_files() ? IORING_ASYNC_CANCEL_FD_FIXED : 0);
+    } else {
+        sqe->fd = -1;
+        sqe->addr = user_data;
+    }
+}
+
+// slot fd of the registered file table gets value, -1 empties it. The kernel reads
+// the value when the SQE is submitted, so it is kept in ring_conn until then
+void reactor::update_file(int fd, int value) {
+    m_ring_conns[fd].registered = value;
+    struct io_uring_sqe* sqe = sqe_for(-1, OP_UPDATE);
+    if (!sqe) {
+        return;
+    }
+    sqe->opcode = IORING_OP_FILES_UPDATE;
+    sqe->addr = (uint64_t)(uintptr_t)&m_ring_conns[fd].registered;
+    sqe->len = 1;
+    sqe->off = fd;
+}
+
+void reactor::resume(http_conn* conn) {
+    // sized like the threadpool, so it is only full when the loop is far behind; it
+    // drains the ring without waiting for anybody
+    while (!m_resumed.push(conn)) {
+        uint64_t one = 1;
+        ::write(m_wakefd, &one, sizeof(one));
+        sched_yield();
+    }
+    // pairs with the store in run_ring(): either the loop sees conn or we see it asleep
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (m_sleeping.load(std::memory_order_relaxed) && m_sleeping.exchange(false)) {
+        uint64_t one = 1;
+        ::write(m_wakefd, &one, sizeof(one));
+    }
+}
+
+void reactor::run_ring() {
+    if (!m_ring->enable()) {
+        LOG_WARN("can't enable io_uring, errno is: %d", errno);
+        return;
+    }
+    arm_accept();
+    arm_read(m_wakefd, &m_wake_count, OP_WAKE);
+    arm_read(m_timerfd, &m_tick_count, OP_TICK);
+
+    while (!m_stop) {
+        http_conn* conn;
+        while (m_resumed.pop(conn)) {
+            ring_resumed(conn);
+        }
+        // say we are going to sleep and look once more, a resume() in between wakes us
+        m_sleeping.store(true, std::memory_order_seq_cst);
+        if (!m_resumed.empty()) {
+            m_sleeping.store(false, std::memory_order_relaxed);
+            continue;
+        }
+        int ret = m_ring->submit(1);
+        m_sleeping.store(false, std::memory_order_relaxed);
+        if (ret < 0 && ret != -EINTR && ret != -EBUSY) {
+            LOG_ERROR("io_uring failure, errno is: %d", -ret);
+            break;
+        }
+
+        uint64_t ticks = 0;
+        struct io_uring_cqe* cqe;
+        while ((cqe = m_ring->peek_cqe()) != NULL) {
+            int fd = (int)(cqe->user_data >> 8);
+            int op = (int)(cqe->user_data & 0xff);
+            int res = cqe->res;
+            unsigned flags = cqe->flags;
+            m_ring->seen();
+
+            switch (op) {
+            case OP_ACCEPT:
+                if (res >= 0) {
+                    ring_accept(res);
+                } else if (res == -EMFILE || res == -ENFILE) {
+                    // the multishot accept ends here, without shedding it would fail again at once
+                    shed_connection();
+                } else if (res != -ECANCELED) {
+                    LOG_ERROR("accept errno is: %d", -res);
+                }
+                if (!(flags & IORING_CQE_F_MORE)) {
+                    if (m_draining) {
+                        // the kernel let go of it, nothing more is accepted here
+                        close(m_listenfd);
+                        m_listenfd = -1;
+                    } else if (!m_stop) {
+                        arm_accept();
+                    }
+                }
+                break;
+            case OP_WAKE:
+                arm_read(m_wakefd, &m_wake_count, OP_WAKE);
+                if (m_draining && m_listenfd != -1) {
+                    // the multishot accept ends with -ECANCELED, or took its last connection already
+                    cancel(m_listenfd, ring_data(m_listenfd, OP_ACCEPT), false);
+                }
+                break;
+            case OP_TICK:
+                // the timerfd counts every expiration since the last read
+                if (res == sizeof(m_tick_count)) {
+                    ticks += m_tick_count;
+                }
+                arm_read(m_timerfd, &m_tick_count, OP_TICK);
+                break;
+            case OP_RECV:
+                ring_recv(fd, res, flags);
+                break;
+            case OP_SEND:
+            case OP_READ:
+            case OP_SEND_CHUNK:
+                ring_sent(fd, op, res);
+                break;
+            default:
+                // cancellations and file table updates need no follow-up
+                break;
+            }
+        }
+
+        // 最后处理定时事件，因为I/O事件有更高的优先级。
+        if (ticks) {
+            m_timer_wheel.tick(ticks);
+            metrics::set(GAUGE_TIMERS, m_timer_wheel.size());
+            for (int fd : m_starved) {
+                ring_conn& rc = m_ring_conns[fd];
+                if (rc.owner == this && !rc.closing && !rc.recv_armed && rc.state == RING_IDLE && rc.park_count == 0) {
+                    arm_recv(fd);
+                }
+            }
+            m_starved.clear();
+        }
+    }
+}
+
+void reactor::ring_accept(int connfd) {
+    if (connfd >= m_max_fd) {
+        close(connfd);
+        return;
+    }
+    // multishot accept has nowhere to put the address
+    struct sockaddr_in client_address;
+    socklen_t client_addrlength = sizeof(client_address);
+    memset(&client_address, 0, sizeof(client_address));
+    getpeername(connfd, (struct sockaddr*)&client_address, &client_addrlength);
+
+    ring_conn& rc = m_ring_conns[connfd];
+    rc.owner = this;
+    rc.state = RING_IDLE;
+    rc.recv_armed = false;
+    rc.closing = false;
+    rc.failed = false;
+    rc.sending = 0;
+    rc.chunk = NULL;
+    rc.chunk_len = 0;
+    rc.park_head = -1;
+    rc.park_tail = -1;
+    rc.park_count = 0;
+    m_users[connfd].init(connfd, client_address, -1, this);
+    if (m_ring->fixed_files()) {
+        update_file(connfd, connfd);
+    }
+    start_timer(connfd, client_address);
+    arm_recv(connfd);
+}
+
+void reactor::ring_recv(int fd, int res, unsigned flags) {
+    ring_conn& rc = m_ring_conns[fd];
+    if (!(flags & IORING_CQE_F_MORE)) {
+        rc.recv_armed = false;
+    }
+    if (res > 0) {
+        uint16_t bid = flags >> IORING_CQE_BUFFER_SHIFT;
+        if (rc.closing) {
+            m_ring->recycle(bid);
+        } else {
+            parked_buffer& p = m_parked[bid];
+            p.offset = 0;
+            p.len = res;
+            if (rc.park_count++ == 0) {
+                rc.park_head = bid;
+            } else {
+                m_parked[rc.park_tail].next = bid;
+            }
+            rc.park_tail = bid;
+            if (rc.state == RING_IDLE) {
+                ring_input(fd);
+            } else if (rc.park_count >= RING_PARK_MAX && rc.recv_armed) {
+                // a busy connection holds enough buffers, leave the rest in the socket
+                cancel(fd, ring_data(fd, OP_RECV), false);
+            }
+        }
+    } else if (res != -ENOBUFS && res != -ECANCELED) {
+        // 0 is the client closing the connection, anything else an error
+        ring_close(fd);
+        return;
+    }
+    if (rc.closing) {
+        ring_finish(fd);
+    } else if (res == -ENOBUFS && !rc.recv_armed) {
+        // every buffer is held by someone, retrying now would only spin
+        m_starved.push_back(fd);
+    } else if (!rc.recv_armed && rc.state == RING_IDLE && rc.park_count == 0) {
+        // paused, read again
+        arm_recv(fd);
+    }
+}
+
+// the connection waits for input: hand it what was received meanwhile
+void reactor::ring_input(int fd) {
+    ring_conn& rc = m_ring_conns[fd];
+    http_conn& conn = m_users[fd];
+    bool received = rc.park_count > 0;
+    if (conn.receiving()) {
+        // an upload: its body goes from the provided buffers straight into the file, a
+        // worker only gets the connection again once the body is complete
+        while (rc.park_count > 0 && conn.receiving()) {
+            int bid = rc.park_head;
+            parked_buffer& p = m_parked[bid];
+            p.offset += conn.feed_body(m_ring->buffer(bid) + p.offset, p.len - p.offset);
+            if (p.offset < p.len) {
+                // the rest of it is the next request
+                break;
+            }
+            rc.park_head = p.next;
+            --rc.park_count;
+            m_ring->recycle(bid);
+        }
+        if (received) {
+            m_timer_wheel.adjust_timer(&m_users_timer[fd].timer, CONN_TIMEOUT / TICK_MS);
+        }
+        if (!conn.receiving() && !ring_dispatch(fd)) {
+            return;
+        }
+        if (!rc.recv_armed && rc.park_count == 0) {
+            arm_recv(fd);
+        }
+        return;
+    }
+    while (rc.park_count > 0) {
+        int bid = rc.park_head;
+        parked_buffer& p = m_parked[bid];
+        p.offset += conn.feed(m_ring->buffer(bid) + p.offset, p.len - p.offset);
+        if (p.offset < p.len) {
+            // the read buffer is full, process() answers the request it holds
+            break;
+        }
+        rc.park_head = p.next;
+        --rc.park_count;
+        m_ring->recycle(bid);
+    }
+    if (received) {
+        m_timer_wheel.adjust_timer(&m_users_timer[fd].timer, CONN_TIMEOUT / TICK_MS);
+        if (!ring_dispatch(fd)) {
+            return;
+        }
+    }
+    if (!rc.recv_armed && rc.park_count == 0) {
+        arm_recv(fd);
+    }
+}
+
+// a worker handed the connection back
+void reactor::ring_resumed(http_conn* conn) {
+    int fd = conn - m_users;
+    ring_conn& rc = m_ring_conns[fd];
+    rc.state = RING_IDLE;
+    int ev = conn->next_event();
+    if (rc.closing || ev == 0) {
+        ring_close(fd);
+    } else if (ev == EPOLLOUT) {
+        rc.state = RING_SENDING;
+        ring_send(fd);
+    } else {
+        ring_input(fd);
+    }
+}
+
+// queue the next step of the gathered responses: the iovecs up to the next file
+// range, then one chunk of that range read into a pooled block and sent, linked so
+// they reach the socket in order
+void reactor::ring_send(int fd) {
+    ring_conn& rc = m_ring_conns[fd];
+    http_conn& conn = m_users[fd];
+    struct io_uring_sqe* last = NULL;
+    bool more;
+    if (conn.iov_run(rc.msg, more)) {
+        last = sqe_for(fd, OP_SEND);
+        if (!last) {
+            ring_close(fd);
+            return;
+        }
+        last->opcode = IORING_OP_SENDMSG;
+        last->addr = (uint64_t)(uintptr_t)&rc.msg;
+        last->msg_flags = MSG_WAITALL | (more ? MSG_MORE : 0);
+        ++rc.sending;
+    }
+
+    off_t offset, count;
+    if (!conn.file_range(offset, count)) {
+        // the last run, nothing follows
+    } else if (count == 0) {
+        if (!last) {
+            conn.sent_file(0);
+        }
+    } else {
+        off_t len = count < RING_CHUNK_SIZE ? count : RING_CHUNK_SIZE;
+        rc.chunk = m_chunks->take();
+        struct io_uring_sqe* read = rc.chunk ? sqe_for(conn.file_fd(), OP_READ) : NULL;
+        if (!read) {
+            rc.failed = true;
+        } else {
+            if (last) {
+                last->flags |= IOSQE_IO_LINK;
+            }
+            // sqe_for() filed it under the file's fd, completions must find the connection
+            read->user_data = ring_data(fd, OP_READ);
+            read->opcode = IORING_OP_READ;
+            read->addr = (uint64_t)(uintptr_t)rc.chunk;
+            read->len = len;
+            read->off = offset;
+            read->flags |= IOSQE_IO_LINK;
+            struct io_uring_sqe* send = sqe_for(fd, OP_SEND_CHUNK);
+            if (!send) {
+                read->flags &= ~IOSQE_IO_LINK;
+                rc.failed = true;
+            } else {
+                send->opcode = IORING_OP_SEND;
+                send->addr = (uint64_t)(uintptr_t)rc.chunk;
+                send->len = len;
+                send->msg_flags = MSG_WAITALL | (count > len ? MSG_MORE : 0);
+                ++rc.sending;
+            }
+            rc.chunk_len = len;
+            ++rc.sending;
+        }
+    }
+
+    if (rc.sending == 0) {
+        // nothing could be queued, either everything is out or it went wrong
+        ring_sent(fd, 0, 0);
+    }
+}
+
+// one operation of a send step completed, once they all have, move on
+void reactor::ring_sent(int fd, int op, int res) {
+    ring_conn& rc = m_ring_conns[fd];
+    http_conn& conn = m_users[fd];
+    if (op != 0) {
+        --rc.sending;
+        // -ECANCELED: an earlier link of the step came up short, the next step retries
+        if (res < 0 && res != -ECANCELED) {
+            rc.failed = true;
+        } else if (op == OP_SEND && res > 0) {
+            conn.sent_iov(res);
+        } else if (op == OP_READ && res >= 0 && res != rc.chunk_len) {
+            // the file was truncated while we were sending it
+            rc.failed = true;
+        } else if (op == OP_SEND_CHUNK && res > 0) {
+            conn.sent_file(res);
+        }
+        if (rc.sending > 0) {
+            return;
+        }
+    }
+
+    if (rc.chunk) {
+        m_chunks->give(rc.chunk);
+        rc.chunk = NULL;
+    }
+    if (rc.failed || rc.closing) {
+        ring_close(fd);
+        return;
+    }
+    // a long download is activity too, keep it off the idle list
+    m_timer_wheel.adjust_timer(&m_users_timer[fd].timer, CONN_TIMEOUT / TICK_MS);
+    if (!conn.sent_all()) {
+        ring_send(fd);
+        return;
+    }
+    rc.state = RING_IDLE;
+    if (!conn.end_response()) {
+        ring_close(fd);
+        return;
+    }
+    if (conn.pipelined()) {
+        ring_dispatch(fd);
+        return;
+    }
+    ring_input(fd);
+}
+
+// hand the connection to a worker. With the queue full it is closed: nothing would
+// resume it, and ring_finish() never reclaims a connection in RING_BUSY
+bool reactor::ring_dispatch(int fd) {
+    ring_conn& rc = m_ring_conns[fd];
+    rc.state = RING_BUSY;
+    if (m_pool->append(&m_users[fd])) {
+        return true;
+    }
+    rc.state = RING_IDLE;
+    ring_close(fd);
+    return false;
+}
+
+// stop everything on fd, it is closed once the kernel and the workers are done with it
+void reactor::ring_close(int fd) {
+    ring_conn& rc = m_ring_conns[fd];
+    if (!rc.owner) {
+        return;
+    }
+    if (!rc.closing) {
+        rc.closing = true;
+        if (rc.recv_armed || rc.sending > 0) {
+            cancel(fd, 0, true);
+        }
+    }
+    ring_finish(fd);
+}
+
+void reactor::ring_finish(int fd) {
+    ring_conn& rc = m_ring_conns[fd];
+    if (!rc.owner || !rc.closing || rc.state == RING_BUSY || rc.recv_armed || rc.sending > 0) {
+        return;
+    }
+    while (rc.park_count > 0) {
+        int bid = rc.park_head;
+        rc.park_head = m_parked[bid].next;
+        --rc.park_count;
+        m_ring->recycle(bid);
+    }
+    if (rc.chunk) {
+        m_chunks->give(rc.chunk);
+        rc.chunk = NULL;
+    }
+    if (m_ring->fixed_files()) {
+        update_file(fd, -1);
+    }
+    rc.owner = NULL;
+    m_users[fd].close_conn();
+    m_timer_wheel.del_timer(&m_users_timer[fd].timer);
+}
@@ -0,0 +1,67 @@
+#include <string.h>
+#include <unistd.h>
+#include "response_stream.h"
+#include "file_cache.h"
+
+void stream_chunk::append(const void* data, size_t len) {
+    if (len == 0) {
+        return;
+    }
+    struct iovec iv;
+    iv.iov_base = (void*)data;
+    iv.iov_len = len;
+    m_fragments.push_back(iv);
+    m_size += len;
+}
+
+void stream_chunk::clear() {
+    m_fragments.clear();
+    m_size = 0;
+}
+
+gzip_stream::gzip_stream(std::shared_ptr<const file_entry> file) : m_file(file), m_offset(0) {
+    memset(&m_zs, 0, sizeof(m_zs));
+    // windowBits 15 + 16 asks zlib for a gzip wrapper. Every response compresses the
+    // whole file again, so this is the default level rather than the best one
+    m_ready = deflateInit2(&m_zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) == Z_OK;
+}
+
+gzip_stream::~gzip_stream() {
+    if (m_ready) {
+        deflateEnd(&m_zs);
+    }
+}
+
+// deflate until want bytes of output are ready or the file is done; the output of
+// the call before has been sent, so its buffer is reused
+response_stream::STATUS gzip_stream::produce(stream_chunk& out, size_t want) {
+    if (!m_ready || m_file->fd == -1) {
+        return FAILED;
+    }
+    m_out.resize(want);
+    m_zs.next_out = (Bytef*)&m_out[0];
+    m_zs.avail_out = want;
+    int ret = Z_OK;
+    while (m_zs.avail_out > 0) {
+        if (m_zs.avail_in == 0 && m_offset < m_file->st.st_size) {
+            m_in.resize(READ_SIZE);
+            ssize_t n = pread(m_file->fd, &m_in[0], READ_SIZE, m_offset);
+            if (n <= 0) {
+                // the file was truncated while we were sending it
+                return FAILED;
+            }
+            m_offset += n;
+            m_zs.next_in = (Bytef*)&m_in[0];
+            m_zs.avail_in = n;
+        }
+        ret = deflate(&m_zs, m_offset >= m_file->st.st_size ? Z_FINISH : Z_NO_FLUSH);
+        if (ret == Z_STREAM_END) {
+            break;
+        }
+        if (ret != Z_OK && ret != Z_BUF_ERROR) {
+            return FAILED;
+        }
+    }
+    out.append(m_out.data(), want - m_zs.avail_out);
+    return ret == Z_STREAM_END ? DONE : MORE;
+}
@@ -0,0 +1,65 @@
+#ifndef RESPONSE_STREAM_H
+#define RESPONSE_STREAM_H
+
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <zlib.h>
+#include <memory>
+#include <string>
+#include <vector>
+
+struct file_entry;
+
+// the fragments one produce() call hands to the connection, sent as they are without a copy
+class stream_chunk {
+public:
+    void append(const void* data, size_t len);
+    void clear();
+    size_t size() const { return m_size; }
+    const std::vector<struct iovec>& fragments() const { return m_fragments; }
+
+private:
+    std::vector<struct iovec> m_fragments;
+    size_t m_size = 0;
+};
+
+/*
+    A response body that is produced while it is being sent, so its length is not
+    known when the headers go out: HTTP/1.1 clients get it with Transfer-Encoding:
+    chunked, one chunk per produce(), HTTP/1.0 clients until the connection closes.
+    produce() runs on a worker and is only called again once everything it gave
+    before has been written to the socket, so a slow client holds the producer
+    back instead of piling its output up in memory, and the fragments it appends
+    only have to stay valid until the next call.
+*/
+class response_stream {
+public:
+    enum STATUS { MORE = 0, DONE, FAILED };
+
+    virtual ~response_stream() {}
+
+    // append about want bytes of the body to out. DONE when out holds the last of it,
+    // FAILED ends the response early and the connection with it
+    virtual STATUS produce(stream_chunk& out, size_t want) = 0;
+};
+
+// a file gzipped as it is sent, for text too large to compress in memory
+class gzip_stream : public response_stream {
+public:
+    static const int READ_SIZE = 64 << 10;  // file bytes read per step
+
+    explicit gzip_stream(std::shared_ptr<const file_entry> file);
+    ~gzip_stream();
+
+    STATUS produce(stream_chunk& out, size_t want);
+
+private:
+    std::shared_ptr<const file_entry> m_file;   // keeps the fd open
+    z_stream m_zs;
+    bool m_ready;           // deflateInit2() succeeded
+    off_t m_offset;         // of the next file read
+    std::string m_in;
+    std::string m_out;
+};
+
+#endif
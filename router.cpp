@@ -0,0 +1,179 @@
+#include "router.h"
+#include "http_conn.h"
+
+std::string_view handler_request::param(std::string_view name) const {
+    for (int i = 0; i < param_count; ++i) {
+        if (params[i].name == name) {
+            return params[i].value;
+        }
+    }
+    return std::string_view();
+}
+
+std::string_view handler_request::header(HEADER id) const {
+    return conn->header(id);
+}
+
+std::string_view handler_request::header(std::string_view name) const {
+    return conn->header(name);
+}
+
+void handler_reply::reset() {
+    status = 200;
+    content_type = "text/plain; charset=utf-8";
+    headers.clear();
+    body.clear();
+    stream = NULL;
+    upstream = NULL;
+}
+
+router::router() : m_root(new node), m_routes(0) {
+}
+
+router::~router() {
+    destroy(m_root);
+}
+
+void router::destroy(node* n) {
+    for (node* c : n->children) {
+        destroy(c);
+    }
+    if (n->param) {
+        destroy(n->param);
+    }
+    delete n;
+}
+
+bool router::add(std::string_view pattern, route_handler handler, void* arg) {
+    if (pattern.empty() || pattern[0] != '/' || !handler) {
+        return false;
+    }
+    for (size_t i = 0; i < pattern.size(); ++i) {
+        // "*" only at the end, ":" only at the start of a segment and followed by a name
+        if (pattern[i] == '*' && i + 1 != pattern.size()) {
+            return false;
+        }
+        if (pattern[i] == ':' && (pattern[i - 1] != '/' || i + 1 == pattern.size() || pattern[i + 1] == '/')) {
+            return false;
+        }
+    }
+    route r = { handler, arg };
+    if (!insert(m_root, pattern, r)) {
+        return false;
+    }
+    ++m_routes;
+    return true;
+}
+
+// the part of n's label behind at moves into a new child that takes over everything n had
+void router::split(node* n, size_t at) {
+    node* tail = new node;
+    tail->label = n->label.substr(at);
+    tail->children.swap(n->children);
+    tail->param = n->param;
+    tail->param_name.swap(n->param_name);
+    tail->exact = n->exact;
+    tail->prefix = n->prefix;
+    n->label.resize(at);
+    n->children.push_back(tail);
+    n->param = NULL;
+    n->exact = route{ NULL, NULL };
+    n->prefix = route{ NULL, NULL };
+}
+
+// n's label has been matched, rest is the pattern behind it
+bool router::insert(node* n, std::string_view rest, const route& r) {
+    if (rest.empty() || rest == "*") {
+        route& slot = rest.empty() ? n->exact : n->prefix;
+        if (slot.handler) {
+            return false;
+        }
+        slot = r;
+        return true;
+    }
+    if (rest[0] == ':') {
+        size_t end = rest.find('/');
+        std::string_view name = rest.substr(1, end == std::string_view::npos ? std::string_view::npos : end - 1);
+        if (name.find_first_of(":*") != std::string_view::npos) {
+            return false;
+        }
+        if (!n->param) {
+            n->param = new node;
+            n->param_name = name;
+        } else if (n->param_name != name) {
+            // one position, one name: "/users/:id" and "/users/:name/posts" can't both be
+            return false;
+        }
+        return insert(n->param, rest.substr(name.size() + 1), r);
+    }
+
+    size_t len = rest.find_first_of(":*");
+    std::string_view text = rest.substr(0, len);
+    for (node* c : n->children) {
+        if (c->label[0] != text[0]) {
+            continue;
+        }
+        size_t common = 1;
+        while (common < c->label.size() && common < text.size() && c->label[common] == text[common]) {
+            ++common;
+        }
+        if (common < c->label.size()) {
+            split(c, common);
+        }
+        return insert(c, rest.substr(common), r);
+    }
+    node* c = new node;
+    c->label = text;
+    n->children.push_back(c);
+    return insert(c, rest.substr(text.size()), r);
+}
+
+route_handler router::match(std::string_view path, handler_request& req) const {
+    req.param_count = 0;
+    const route* r = find(m_root, path, req);
+    if (!r) {
+        return NULL;
+    }
+    req.arg = r->arg;
+    return r->handler;
+}
+
+// n's label has been matched, rest is the path behind it. A branch that fails takes
+// back the parameters it captured
+const router::route* router::find(const node* n, std::string_view rest, handler_request& req) const {
+    if (rest.empty() && n->exact.handler) {
+        return &n->exact;
+    }
+    if (!rest.empty()) {
+        for (const node* c : n->children) {
+            if (c->label[0] != rest[0]) {
+                continue;
+            }
+            if (rest.compare(0, c->label.size(), c->label) == 0) {
+                const route* r = find(c, rest.substr(c->label.size()), req);
+                if (r) {
+                    return r;
+                }
+            }
+            break;
+        }
+        size_t end = rest.find('/');
+        if (n->param && end != 0 && req.param_count < handler_request::MAX_PARAMS) {
+            std::string_view segment = rest.substr(0, end);
+            int count = req.param_count;
+            req.params[req.param_count++] = route_param{ n->param_name, segment };
+            const route* r = find(n->param, rest.substr(segment.size()), req);
+            if (r) {
+                return r;
+            }
+            req.param_count = count;
+        }
+    }
+    if (n->prefix.handler) {
+        if (req.param_count < handler_request::MAX_PARAMS) {
+            req.params[req.param_count++] = route_param{ "*", rest };
+        }
+        return &n->prefix;
+    }
+    return NULL;
+}
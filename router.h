@@ -0,0 +1,100 @@
+#ifndef ROUTER_H
+#define ROUTER_H
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include "http_header.h"
+
+class http_conn;
+class response_stream;
+class upstream_group;
+
+// a ":name" segment of the pattern and what it matched, "*" for the rest behind a prefix
+struct route_param {
+    std::string_view name;
+    std::string_view value;
+};
+
+/*
+    What a handler gets of the request. Every view points into the connection's read
+    buffer, nothing is copied, and stays valid until the handler returns.
+*/
+struct handler_request {
+    static const int MAX_PARAMS = 8;
+
+    const http_conn* conn;
+    int method;                 // http_conn::METHOD
+    std::string_view path;      // the URL up to '?'
+    std::string_view query;     // behind '?', empty without one
+    std::string_view body;      // of a PUT/POST, it had to fit into the read buffer
+    void* arg;                  // what the route was added with
+    int param_count;
+    route_param params[MAX_PARAMS];
+
+    std::string_view param(std::string_view name) const;   // empty if the route has no such parameter
+    std::string_view header(HEADER id) const;
+    std::string_view header(std::string_view name) const;
+};
+
+// the response a handler fills in, the connection adds Content-Length, Date and Connection
+struct handler_reply {
+    int status;
+    std::string_view content_type;  // has to outlive the response, normally a literal
+    std::string headers;            // more header lines, each ending with "\r\n"
+    std::string body;
+    response_stream* stream;        // instead of body: produced while it is sent, the connection deletes it
+    upstream_group* upstream;       // instead of answering: the request goes to a server of the group as it is
+
+    void reset();
+};
+
+// runs on a threadpool worker; false answers 500
+typedef bool (*route_handler)(const handler_request& req, handler_reply& reply);
+
+/*
+    Radix trie of the routes, built at startup and only read afterwards, so workers
+    match without a lock. A pattern is an exact path ("/api/status"), ends with "*"
+    to take every path that starts with the rest of it ("/img*", the part matched by
+    the star is the parameter "*"), and may have ":name" segments that match one
+    segment each ("/users/:id/posts"). The static part of an edge
+    wins over a parameter and both over a prefix route, the longest prefix first. A
+    lookup walks the path once, whatever the number of routes.
+*/
+class router {
+public:
+    router();
+    ~router();
+
+    // false if the pattern is malformed or another route has it already
+    bool add(std::string_view pattern, route_handler handler, void* arg = NULL);
+
+    // the handler for path and its parameters in req, NULL if no route matches
+    route_handler match(std::string_view path, handler_request& req) const;
+
+    bool empty() const { return m_routes == 0; }
+
+private:
+    struct route {
+        route_handler handler;
+        void* arg;
+    };
+    struct node {
+        std::string label;              // static bytes on the edge into the node
+        std::vector<node*> children;    // static children, their labels start with different bytes
+        node* param = NULL;             // the ":name" child, it matches up to the next '/'
+        std::string param_name;
+        route exact = { NULL, NULL };   // the path ends here
+        route prefix = { NULL, NULL };  // the pattern ends with "*" here
+    };
+
+    bool insert(node* n, std::string_view rest, const route& r);
+    static void split(node* n, size_t at);
+    const route* find(const node* n, std::string_view rest, handler_request& req) const;
+    static void destroy(node* n);
+
+    node* m_root;
+    int m_routes;
+};
+
+#endif
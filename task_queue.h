@@ -0,0 +1,312 @@
+#ifndef TASK_QUEUE_H
+#define TASK_QUEUE_H
+
+#include <list>
+#include <atomic>
+#include <sched.h>
+#include <stddef.h>
+#include "locker.h"
+
+/*
+    Queue policies for threadpool<T, Queue>. A policy provides
+        Queue(int workers, int max_request_num)
+        bool push(T* request)                     // called by any producer thread
+        int pop(int worker, T** out, int max)     // blocks, returns 0 only after stop()
+        void stop()                               // wakes every worker blocked in pop()
+        size_t capacity() const                   // requests it holds at most
+*/
+
+static inline void cpu_relax() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#endif
+}
+
+// the original queue: one list, one mutex and one semaphore shared by everybody
+template<typename T>
+class locked_queue {
+public:
+    locked_queue(int workers, int max_request_num) :
+    m_workers(workers), max_request_num(max_request_num), m_stop(false) {}
+
+    bool push(T* request) {
+        requests_locker.lock();
+        if((int)requests.size() > max_request_num) {
+            requests_locker.unlock();
+            return false;
+        }
+        requests.push_back(request);
+        requests_locker.unlock();
+        requests_sem.post();
+        return true;
+    }
+
+    // one request at a time from the shared list, whoever the worker is
+    int pop(int /* worker */, T** out, int /* max */) {
+        while(!m_stop) {
+            requests_sem.wait();
+            if(m_stop) {
+                break;
+            }
+            requests_locker.lock();
+            if(requests.empty()) {
+                requests_locker.unlock();
+                continue;
+            }
+            out[0] = requests.front();
+            requests.pop_front();
+            requests_locker.unlock();
+            return 1;
+        }
+        return 0;
+    }
+
+    void stop() {
+        m_stop = true;
+        for(int i = 0; i < m_workers; ++i) {
+            requests_sem.post();
+        }
+    }
+
+    size_t capacity() const { return max_request_num + 1; }
+
+private:
+    int m_workers;
+    int max_request_num;
+    std::list<T*> requests;
+    locker requests_locker;
+    sem requests_sem;
+    volatile bool m_stop;
+};
+
+// bounded lock-free MPMC ring (Vyukov): one CAS per push/pop, no allocation
+template<typename T>
+class mpmc_ring {
+public:
+    mpmc_ring() : m_cells(NULL), m_mask(0), m_enqueue(0), m_dequeue(0) {}
+    ~mpmc_ring() { delete[] m_cells; }
+
+    // capacity is rounded up to a power of two
+    void init(size_t capacity) {
+        size_t size = 2;
+        while(size < capacity) {
+            size <<= 1;
+        }
+        m_cells = new cell[size];
+        m_mask = size - 1;
+        for(size_t i = 0; i < size; ++i) {
+            m_cells[i].seq.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    bool push(T* data) {
+        size_t pos = m_enqueue.load(std::memory_order_relaxed);
+        for(;;) {
+            cell* c = &m_cells[pos & m_mask];
+            size_t seq = c->seq.load(std::memory_order_acquire);
+            intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+            if(diff == 0) {
+                if(m_enqueue.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    c->data = data;
+                    c->seq.store(pos + 1, std::memory_order_release);
+                    return true;
+                }
+            } else if(diff < 0) {
+                return false;   // full
+            } else {
+                pos = m_enqueue.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    bool pop(T*& data) {
+        size_t pos = m_dequeue.load(std::memory_order_relaxed);
+        for(;;) {
+            cell* c = &m_cells[pos & m_mask];
+            size_t seq = c->seq.load(std::memory_order_acquire);
+            intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+            if(diff == 0) {
+                if(m_dequeue.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    data = c->data;
+                    c->seq.store(pos + m_mask + 1, std::memory_order_release);
+                    return true;
+                }
+            } else if(diff < 0) {
+                return false;   // empty
+            } else {
+                pos = m_dequeue.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    bool empty() const {
+        return m_dequeue.load(std::memory_order_seq_cst) >= m_enqueue.load(std::memory_order_seq_cst);
+    }
+
+    size_t capacity() const { return m_mask + 1; }
+
+private:
+    struct cell {
+        std::atomic<size_t> seq;
+        T* data;
+    };
+    cell* m_cells;
+    size_t m_mask;
+    alignas(64) std::atomic<size_t> m_enqueue;
+    alignas(64) std::atomic<size_t> m_dequeue;
+};
+
+/*
+    Every worker owns a bounded lock-free ring. Producers spread requests over the
+    rings round-robin, a worker drains its own ring in batches and steals from the
+    others when it runs dry. An idle worker spins for a while before it parks on its
+    own semaphore, and producers only touch a semaphore when somebody is parked.
+*/
+template<typename T>
+class stealing_queue {
+public:
+    static const int SPIN_LIMIT = 128;     // empty polls before a worker parks
+
+    stealing_queue(int workers, int max_request_num) :
+    m_workers(workers), m_slots(new slot[workers]), m_sleepers(0), m_stop(false) {
+        size_t capacity = max_request_num / workers;
+        if(capacity < 64) {
+            capacity = 64;
+        }
+        for(int i = 0; i < workers; ++i) {
+            m_slots[i].ring.init(capacity);
+            m_slots[i].parked.store(false, std::memory_order_relaxed);
+        }
+    }
+
+    ~stealing_queue() {
+        delete[] m_slots;
+    }
+
+    bool push(T* request) {
+        static thread_local unsigned int next = 0;
+        int start = next++ % m_workers;
+        for(int i = 0; i < m_workers; ++i) {
+            int target = (start + i) % m_workers;
+            if(m_slots[target].ring.push(request)) {
+                wake(target);
+                return true;
+            }
+        }
+        return false;
+    }
+
+    int pop(int worker, T** out, int max) {
+        int spin = 0;
+        while(!m_stop.load(std::memory_order_relaxed)) {
+            int n = take(worker, out, max);
+            if(n > 0) {
+                return n;
+            }
+            if(++spin < SPIN_LIMIT) {
+                cpu_relax();
+            } else if(spin < SPIN_LIMIT + 4) {
+                sched_yield();
+            } else {
+                park(worker);
+                spin = 0;
+            }
+        }
+        return 0;
+    }
+
+    void stop() {
+        m_stop.store(true, std::memory_order_seq_cst);
+        for(int i = 0; i < m_workers; ++i) {
+            unpark(i);
+        }
+    }
+
+    size_t capacity() const {
+        size_t n = 0;
+        for(int i = 0; i < m_workers; ++i) {
+            n += m_slots[i].ring.capacity();
+        }
+        return n;
+    }
+
+private:
+    // batch from our own ring first, then steal from the others
+    int take(int worker, T** out, int max) {
+        int n = 0;
+        while(n < max && m_slots[worker].ring.pop(out[n])) {
+            ++n;
+        }
+        for(int i = 1; n == 0 && i < m_workers; ++i) {
+            mpmc_ring<T>& victim = m_slots[(worker + i) % m_workers].ring;
+            while(n < max / 2 + 1 && victim.pop(out[n])) {
+                ++n;
+            }
+        }
+        return n;
+    }
+
+    bool all_empty() const {
+        for(int i = 0; i < m_workers; ++i) {
+            if(!m_slots[i].ring.empty()) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    void park(int worker) {
+        slot& s = m_slots[worker];
+        s.parked.store(true, std::memory_order_seq_cst);
+        m_sleepers.fetch_add(1, std::memory_order_seq_cst);
+        // re-check after announcing ourselves, a push may have raced with us
+        if(!all_empty() || m_stop.load(std::memory_order_seq_cst)) {
+            if(s.parked.exchange(false, std::memory_order_seq_cst)) {
+                m_sleepers.fetch_sub(1, std::memory_order_seq_cst);
+                return;
+            }
+            // a producer already claimed us and is about to post
+        }
+        s.wakeup.wait();
+    }
+
+    bool unpark(int worker) {
+        slot& s = m_slots[worker];
+        if(s.parked.load(std::memory_order_seq_cst) && s.parked.exchange(false, std::memory_order_seq_cst)) {
+            m_sleepers.fetch_sub(1, std::memory_order_seq_cst);
+            s.wakeup.post();
+            return true;
+        }
+        return false;
+    }
+
+    // wake the owner of the ring if it is parked, otherwise any parked worker to steal
+    void wake(int target) {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if(m_sleepers.load(std::memory_order_seq_cst) == 0) {
+            return;
+        }
+        if(unpark(target)) {
+            return;
+        }
+        for(int i = 1; i < m_workers; ++i) {
+            if(unpark((target + i) % m_workers)) {
+                return;
+            }
+        }
+    }
+
+private:
+    struct alignas(64) slot {
+        mpmc_ring<T> ring;
+        std::atomic<bool> parked;
+        sem wakeup;
+    };
+
+    int m_workers;
+    slot* m_slots;
+    alignas(64) std::atomic<int> m_sleepers;
+    std::atomic<bool> m_stop;
+};
+
+#endif
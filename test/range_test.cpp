@@ -0,0 +1,171 @@
+/*
+    Range requests against a file larger than SMALL_FILE_SIZE, through a socketpair:
+    the body of every response is compared byte for byte with what it has to be, part
+    headers, file data and the closing boundary of multipart/byteranges included.
+    Prints the failing case and exits with 1.
+
+    g++ -std=c++17 -O2 -I. -o range_test test/range_test.cpp http_conn.cpp http_response.cpp \
+        http_scan.cpp file_cache.cpp reactor.cpp reactor_ring.cpp io_ring.cpp metrics.cpp logger.cpp \
+        upload.cpp response_stream.cpp router.cpp proxy.cpp reactor_proxy.cpp -lpthread -lz
+    ./range_test
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <string>
+#include <vector>
+#include "http_conn.h"
+#include "logger.h"
+
+extern const char* doc_root;
+
+static const off_t FILE_SIZE = 200000;
+
+struct range {
+    off_t first, last;
+};
+
+static std::string content;     // what the file holds
+
+static void fail(const char* name, const char* what) {
+    fprintf(stderr, "%s: %s\n", name, what);
+    exit(1);
+}
+
+// one request on a fresh connection, returns the whole response once Content-Length bytes of body are in
+static std::string exchange(const char* name, const std::string& request) {
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == -1) {
+        fail(name, strerror(errno));
+    }
+    fcntl(fds[0], F_SETFL, fcntl(fds[0], F_GETFL) | O_NONBLOCK);
+    int epollfd = epoll_create1(0);
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+
+    http_conn* conn = new http_conn;
+    conn->init(fds[0], addr, epollfd);
+    if (write(fds[1], request.data(), request.size()) != (ssize_t)request.size()) {
+        fail(name, "request not written");
+    }
+    if (!conn->read()) {
+        fail(name, "request not read");
+    }
+    conn->process();
+
+    std::string response;
+    size_t expected = std::string::npos;
+    char buf[65536];
+    while (response.size() != expected) {
+        if (!conn->sent_all() && !conn->write()) {
+            fail(name, "write failed");
+        }
+        ssize_t n = recv(fds[1], buf, sizeof(buf), conn->sent_all() ? 0 : MSG_DONTWAIT);
+        if (n == 0) {
+            break;
+        }
+        if (n > 0) {
+            response.append(buf, n);
+        }
+        size_t end = response.find("\r\n\r\n");
+        if (expected == std::string::npos && end != std::string::npos) {
+            size_t at = response.find("Content-Length: ");
+            if (at == std::string::npos || at > end) {
+                fail(name, "no Content-Length");
+            }
+            expected = end + 4 + strtoul(response.c_str() + at + 16, NULL, 10);
+        }
+    }
+    conn->close_conn();
+    delete conn;
+    close(fds[1]);
+    close(epollfd);
+    return response;
+}
+
+static std::string header(const std::string& response, const char* field) {
+    std::string key = std::string("\r\n") + field + ": ";
+    size_t at = response.find(key);
+    if (at == std::string::npos) {
+        return std::string();
+    }
+    at += key.size();
+    return response.substr(at, response.find("\r\n", at) - at);
+}
+
+static std::string content_range(const range& r) {
+    return "bytes " + std::to_string(r.first) + "-" + std::to_string(r.last) + "/" + std::to_string(FILE_SIZE);
+}
+
+static void check(const char* name, const std::vector<range>& ranges) {
+    std::string request = "GET /file.bin HTTP/1.1\r\nHost: localhost\r\nRange: bytes=";
+    for (size_t i = 0; i < ranges.size(); ++i) {
+        request += (i ? "," : "") + std::to_string(ranges[i].first) + "-" + std::to_string(ranges[i].last);
+    }
+    request += "\r\n\r\n";
+
+    std::string response = exchange(name, request);
+    if (response.compare(0, 25, "HTTP/1.1 206 Partial Cont") != 0) {
+        fail(name, "not 206");
+    }
+    std::string body = response.substr(response.find("\r\n\r\n") + 4);
+
+    std::string expected;
+    if (ranges.size() == 1) {
+        if (header(response, "Content-Range") != content_range(ranges[0])) {
+            fail(name, "wrong Content-Range");
+        }
+        expected = content.substr(ranges[0].first, ranges[0].last - ranges[0].first + 1);
+    } else {
+        std::string type = header(response, "Content-Type");
+        const char* prefix = "multipart/byteranges; boundary=";
+        if (type.compare(0, strlen(prefix), prefix) != 0) {
+            fail(name, "not multipart/byteranges");
+        }
+        std::string boundary = type.substr(strlen(prefix));
+        for (const range& r : ranges) {
+            expected += "\r\n--" + boundary + "\r\n";
+            expected += "Content-Type: application/octet-stream\r\n";
+            expected += "Content-Range: " + content_range(r) + "\r\n\r\n";
+            expected += content.substr(r.first, r.last - r.first + 1);
+        }
+        expected += "\r\n--" + boundary + "--\r\n";
+    }
+    if (body != expected) {
+        fail(name, "body differs");
+    }
+    printf("%s ok\n", name);
+}
+
+int main() {
+    logger::m_level = LEVEL_WARN;
+
+    char dir[] = "/tmp/range_test.XXXXXX";
+    if (!mkdtemp(dir)) {
+        perror("mkdtemp");
+        return 1;
+    }
+    // no two neighbouring ranges look alike, a part in the wrong place shows
+    for (off_t i = 0; i < FILE_SIZE; ++i) {
+        content += (char)('a' + (i * 7 + i / 26) % 26);
+    }
+    std::string path = std::string(dir) + "/file.bin";
+    FILE* fp = fopen(path.c_str(), "w");
+    fwrite(content.data(), 1, content.size(), fp);
+    fclose(fp);
+    doc_root = dir;
+
+    check("single", { { 100, 109 } });
+    check("two parts", { { 0, 9 }, { 100, 109 } });
+    check("three parts", { { 0, 9 }, { 100, 109 }, { 150000, 150099 } });
+    check("large parts", { { 0, 65535 }, { 70000, 139999 }, { 199990, 199999 } });
+
+    unlink(path.c_str());
+    rmdir(dir);
+    return 0;
+}
@@ -1,24 +1,35 @@
 #ifndef THREADPOOL_H
 #define THREADPOOL_H
 
-#include<list>
 #include<pthread.h>
 #include <cstdio>
 #include <exception>
 #include "locker.h"
-
-template<typename T>
+#include "task_queue.h"
+#include "metrics.h"
+#include "logger.h"
+
+// Queue is the request queue policy, see task_queue.h. T provides process(), queued(),
+// which is called right before the request is queued, and rejected(), called when the
+// queue was full: the request is the caller's again and append() returns false
+template<typename T, typename Queue = locked_queue<T> >
 class threadpool {
 public:
     threadpool(int threadpool_size = 8, int max_request_num = 10000);
     ~threadpool();
     bool append(T* request);
+    // requests queued or taken by the workers at most, at any one time
+    size_t capacity() const { return requests.capacity() + (size_t)threadpool_size * BATCH_SIZE; }
 
 private:
     static void* worker(void* arg);
-    void run();
+    void run(int id);
+    void shutdown(int started);
 
 private:
+    // max num of requests taken from the queue at once
+    static const int BATCH_SIZE = 16;
+
     // number of threads
     int threadpool_size;
 
@@ -28,93 +39,88 @@ private:
     // number of max request
     int max_request_num;
 
-    //list of request
-    std::list<T*> requests;
-
-    // locker of pool
-    locker requests_locker;
+    // queue of request
+    Queue requests;
 
-    // semaphore of pool
-    sem requests_sem;
+    // ids handed out to the workers
+    std::atomic<int> m_next_id;
 
     // flag of the state of the threadpool(run & stop)
-    bool m_stop;
+    volatile bool m_stop;
 };
 
-template<typename T>
-threadpool<T>::threadpool(int threadpool_size, int max_request_num) :
-threadpool_size(threadpool_size), max_request_num(max_request_num),
-m_stop(false), m_threads(NULL) {
+template<typename T, typename Queue>
+threadpool<T, Queue>::threadpool(int threadpool_size, int max_request_num) :
+threadpool_size(threadpool_size), m_threads(NULL), max_request_num(max_request_num),
+requests(threadpool_size > 0 ? threadpool_size : 1, max_request_num), m_next_id(0),
+m_stop(false) {
 
     if(threadpool_size <= 0 || max_request_num <= 0) {
-        printf("illegal threadpool\n");
+        LOG_ERROR("illegal threadpool");
         throw std::exception();
     }
 
     m_threads = new pthread_t[threadpool_size];
     if(!m_threads) {
-        printf("can't create threadpool\n");
+        LOG_ERROR("can't create threadpool");
         throw std::exception();
     }
 
-    //create threads and set them detached
+    //create threads, they are joined in the destructor once the queue is stopped
     for(int i = 0; i < threadpool_size; i ++ ) {
-        printf("create %d thread\n", i);
+        LOG_INFO("create %d thread", i);
         if(pthread_create(m_threads + i, NULL, worker, this ) != 0) {
-            delete []m_threads;
-            throw std::exception();
-        }
-
-        if(pthread_detach(m_threads[i])) {
-            delete []m_threads;
+            shutdown(i);
             throw std::exception();
         }
     }
 }
 
-template<typename T>
-threadpool<T>::~threadpool() {
-    delete []m_threads;
+template<typename T, typename Queue>
+threadpool<T, Queue>::~threadpool() {
+    shutdown(threadpool_size);
+}
+
+template<typename T, typename Queue>
+void threadpool<T, Queue>::shutdown(int started) {
     m_stop = true;
+    requests.stop();
+    for(int i = 0; i < started; i ++ ) {
+        pthread_join(m_threads[i], NULL);
+    }
+    delete []m_threads;
 }
 
-template<typename T>
-bool threadpool<T>::append(T* request) {
-    requests_locker.lock();
-    if(requests.size() > max_request_num) {
-        requests_locker.unlock();
+// counted before the push, a worker may pop it before push() returns
+template<typename T, typename Queue>
+bool threadpool<T, Queue>::append(T* request) {
+    request->queued();
+    metrics::add(REQUESTS_QUEUED);
+    if(!requests.push(request)) {
+        metrics::add(REQUESTS_DEQUEUED);
+        request->rejected();
         return false;
     }
-    requests.push_back(request);
-    requests_locker.unlock();
-    requests_sem.post();
     return true;
 }
 
-template<typename T>
-void* threadpool<T>::worker(void* arg) {
+template<typename T, typename Queue>
+void* threadpool<T, Queue>::worker(void* arg) {
     threadpool* pool = (threadpool*)arg;
-    pool->run();
-    return pool; 
+    pool->run(pool->m_next_id++);
+    return pool;
 }
 
-template<typename T>
-void threadpool<T>::run() {
+template<typename T, typename Queue>
+void threadpool<T, Queue>::run(int id) {
+    T* batch[BATCH_SIZE];
     while(!m_stop) {
-        requests_sem.wait();
-        requests_locker.lock();
-        if(requests.empty()) {
-            requests_locker.unlock();
-            continue;
-        }
-        T* request = requests.front();
-        requests.pop_front();
-        requests_locker.unlock();
-        if (request == NULL) {
-            continue;
+        int n = requests.pop(id, batch, BATCH_SIZE);
+        metrics::add(REQUESTS_DEQUEUED, n);
+        for(int i = 0; i < n; ++i) {
+            batch[i]->process();
         }
-        request->process();
     }
 }
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,289 @@
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <errno.h>
+#include <unistd.h>
+#include "upload.h"
+
+void chunked_decoder::reset(uint64_t limit) {
+    m_state = SIZE;
+    m_size = 0;
+    m_total = 0;
+    m_limit = limit;
+    m_digits = 0;
+    m_trailer = 0;
+}
+
+static int hex_value(char c) {
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    }
+    if (c >= 'A' && c <= 'F') {
+        return c - 'A' + 10;
+    }
+    return -1;
+}
+
+// chunk = size [ ; extensions ] CRLF data CRLF, the last chunk has size 0 and is
+// followed by trailer fields and a blank line
+const char* chunked_decoder::decode(const char* p, const char* end, std::string_view& payload) {
+    payload = std::string_view();
+    while (p < end && !finished()) {
+        if (m_state == DATA) {
+            uint64_t n = (uint64_t)(end - p) < m_size ? (uint64_t)(end - p) : m_size;
+            payload = std::string_view(p, n);
+            skip(n);
+            return p + n;
+        }
+        char c = *p++;
+        switch (m_state) {
+        case SIZE: {
+            int digit = hex_value(c);
+            if (digit >= 0) {
+                if (m_size >> 60) {
+                    m_state = BAD;
+                } else {
+                    m_size = m_size << 4 | digit;
+                    ++m_digits;
+                }
+            } else if (m_digits == 0) {
+                m_state = BAD;
+            } else if (c == '\r') {
+                m_state = SIZE_LF;
+            } else if (c == ';' || c == ' ' || c == '\t') {
+                m_state = EXTENSION;
+            } else {
+                m_state = BAD;
+            }
+            break;
+        }
+        case EXTENSION:
+            // chunk extensions are ignored, they only have to stay on their line
+            if (c == '\r') {
+                m_state = SIZE_LF;
+            } else if (c == '\n') {
+                m_state = BAD;
+            }
+            break;
+        case SIZE_LF:
+            if (c != '\n') {
+                m_state = BAD;
+            } else if (m_size > m_limit - m_total) {
+                // m_total never exceeds m_limit, the sum could wrap around
+                m_state = TOO_LARGE;
+            } else {
+                m_total += m_size;
+                m_state = m_size ? DATA : TRAILER;
+            }
+            break;
+        case DATA_CR:
+            m_state = c == '\r' ? DATA_LF : BAD;
+            break;
+        case DATA_LF:
+            if (c == '\n') {
+                m_state = SIZE;
+                m_size = 0;
+                m_digits = 0;
+            } else {
+                m_state = BAD;
+            }
+            break;
+        case TRAILER:
+            m_state = c == '\r' ? END_LF : TRAILER_LINE;
+            break;
+        case TRAILER_LINE:
+            if (++m_trailer > MAX_TRAILER) {
+                m_state = BAD;
+            } else if (c == '\r') {
+                m_state = TRAILER_LF;
+            }
+            break;
+        case TRAILER_LF:
+            m_state = c == '\n' ? TRAILER : BAD;
+            break;
+        case END_LF:
+            m_state = c == '\n' ? DONE : BAD;
+            break;
+        default:
+            break;
+        }
+    }
+    return p;
+}
+
+void chunked_decoder::skip(uint64_t n) {
+    m_size -= n;
+    if (m_size == 0) {
+        m_state = DATA_CR;
+    }
+}
+
+upload::upload() :
+m_status(FAILED), m_fd(-1), m_pipe_failed(false), m_chunked(false), m_created(false), m_left(0), m_received(0) {
+    m_pipe[0] = m_pipe[1] = -1;
+}
+
+upload::~upload() {
+    if (m_fd != -1) {
+        close(m_fd);
+    }
+    if (!m_temp.empty()) {
+        unlink(m_temp.c_str());
+    }
+    if (m_pipe[0] != -1) {
+        close(m_pipe[0]);
+        close(m_pipe[1]);
+    }
+}
+
+bool upload::open(const std::string& path, int64_t length, int64_t limit) {
+    struct stat st;
+    if (stat(path.c_str(), &st) == 0) {
+        if (!S_ISREG(st.st_mode)) {
+            errno = EISDIR;
+            return false;
+        }
+        m_created = false;
+    } else if (errno == ENOENT) {
+        m_created = true;
+    } else {
+        return false;
+    }
+
+    // in the same directory, so the rename is atomic
+    m_temp = path + ".upload.XXXXXX";
+    m_fd = mkostemp(&m_temp[0], O_CLOEXEC);
+    if (m_fd == -1) {
+        m_temp.clear();
+        return false;
+    }
+    // served like any other file once it is in place
+    fchmod(m_fd, 0644);
+    if (length > 0 && fallocate(m_fd, FALLOC_FL_KEEP_SIZE, 0, length) == -1 && errno == ENOSPC) {
+        return false;
+    }
+    m_path = path;
+    m_chunked = length < 0;
+    m_left = m_chunked ? 0 : length;
+    m_decoder.reset(limit);
+    m_status = (length == 0) ? RECEIVED : RECEIVING;
+    return true;
+}
+
+void upload::store(const char* data, size_t len) {
+    while (len > 0 && m_status != FAILED) {
+        ssize_t n = ::write(m_fd, data, len);
+        if (n < 0) {
+            if (errno != EINTR) {
+                m_status = FAILED;
+            }
+            continue;
+        }
+        data += n;
+        len -= n;
+    }
+}
+
+// payload bytes went into the file
+void upload::advance(uint64_t payload) {
+    m_received += payload;
+    if (m_chunked) {
+        m_decoder.skip(payload);
+    } else {
+        m_left -= payload;
+        if (m_left == 0 && m_status == RECEIVING) {
+            m_status = RECEIVED;
+        }
+    }
+}
+
+size_t upload::take(const char* data, size_t len) {
+    if (m_status != RECEIVING) {
+        return 0;
+    }
+    if (!m_chunked) {
+        size_t n = (uint64_t)len < (uint64_t)m_left ? len : (size_t)m_left;
+        store(data, n);
+        advance(n);
+        return n;
+    }
+    const char* p = data;
+    const char* end = data + len;
+    while (p < end && m_status == RECEIVING) {
+        std::string_view payload;
+        p = m_decoder.decode(p, end, payload);
+        store(payload.data(), payload.size());
+        m_received += payload.size();
+        switch (m_decoder.state()) {
+        case chunked_decoder::DONE:
+            m_status = m_status == FAILED ? FAILED : RECEIVED;
+            break;
+        case chunked_decoder::BAD:
+            m_status = BAD_BODY;
+            break;
+        case chunked_decoder::TOO_LARGE:
+            m_status = TOO_LARGE;
+            break;
+        default:
+            break;
+        }
+    }
+    return p - data;
+}
+
+bool upload::spliceable() {
+    if (m_status != RECEIVING || (m_chunked ? m_decoder.data_left() : (uint64_t)m_left) == 0) {
+        return false;
+    }
+    if (m_pipe[0] == -1 && !m_pipe_failed) {
+        if (pipe2(m_pipe, O_NONBLOCK | O_CLOEXEC) == -1) {
+            m_pipe_failed = true;
+            return false;
+        }
+        fcntl(m_pipe[1], F_SETPIPE_SZ, PIPE_SIZE);
+    }
+    return !m_pipe_failed;
+}
+
+// the pipe is empty before and after, everything spliced into it goes on to the file
+ssize_t upload::splice_from(int sockfd, off_t max) {
+    uint64_t want = m_chunked ? m_decoder.data_left() : (uint64_t)m_left;
+    if (want > (uint64_t)max) {
+        want = max;
+    }
+    ssize_t n = splice(sockfd, NULL, m_pipe[1], NULL, want, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if (n <= 0) {
+        return n;
+    }
+    ssize_t left = n;
+    while (left > 0) {
+        ssize_t written = splice(m_pipe[0], NULL, m_fd, NULL, left, SPLICE_F_MOVE);
+        if (written <= 0) {
+            if (written < 0 && errno == EINTR) {
+                continue;
+            }
+            m_status = FAILED;
+            return n;
+        }
+        left -= written;
+    }
+    advance(n);
+    return n;
+}
+
+bool upload::commit() {
+    if (m_status != RECEIVED) {
+        return false;
+    }
+    int ret = close(m_fd);
+    m_fd = -1;
+    if (ret == -1 || rename(m_temp.c_str(), m_path.c_str()) == -1) {
+        m_status = FAILED;
+        return false;
+    }
+    m_temp.clear();
+    return true;
+}
@@ -0,0 +1,100 @@
+#ifndef UPLOAD_H
+#define UPLOAD_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <string>
+#include <string_view>
+
+/*
+    Incremental decoder of a chunked request body. It is fed whatever has arrived,
+    any split of the input works, and keeps no more than a few integers between
+    calls: chunk sizes, extensions and trailers are parsed a byte at a time and
+    skipped, the payload is handed back as runs of the input itself.
+*/
+class chunked_decoder {
+public:
+    enum STATE { SIZE = 0, EXTENSION, SIZE_LF, DATA, DATA_CR, DATA_LF, TRAILER, TRAILER_LINE, TRAILER_LF, END_LF,
+                 DONE, BAD, TOO_LARGE };
+
+    static const int MAX_TRAILER = 8192;    // bytes of trailer fields, they are read and dropped
+
+    void reset(uint64_t limit);
+
+    // decode from p up to end, at most until the end of the next run of payload, which is
+    // returned in payload (empty if there was none). Returns where decoding stopped, at
+    // the end of the body when it is DONE, the bytes behind it belong to the next request
+    const char* decode(const char* p, const char* end, std::string_view& payload);
+
+    STATE state() const { return m_state; }
+    bool finished() const { return m_state >= DONE; }
+
+    // payload bytes of the current chunk still to come, they may bypass decode()
+    uint64_t data_left() const { return m_state == DATA ? m_size : 0; }
+    void skip(uint64_t n);
+
+private:
+    STATE m_state;
+    uint64_t m_size;        // of the chunk being read, what is left of it in DATA
+    uint64_t m_total;       // payload announced so far
+    uint64_t m_limit;
+    int m_digits;
+    int m_trailer;
+};
+
+/*
+    The body of a PUT or POST being stored. It is written to a temporary file next
+    to the target and renamed over it once it is complete, so a reader never sees a
+    partial upload and a failed one leaves nothing behind. Payload the connection
+    knows the length of is moved socket -> pipe -> file with splice() and never
+    copied to user space; bytes that have been read already, and all the framing of
+    a chunked body, go through take(). Whatever the size of the body, an upload
+    holds a pipe, a file and this object.
+*/
+class upload {
+public:
+    enum STATUS { RECEIVING = 0, RECEIVED, TOO_LARGE, BAD_BODY, FAILED };
+
+    static const int PIPE_SIZE = 1 << 20;   // asked for, the default 64KB is what we get otherwise
+
+    upload();
+    ~upload();  // an upload that wasn't committed is removed
+
+    // length is the Content-Length, -1 for a chunked body; limit is the most the
+    // body may be. False with errno set if the file can't be created
+    bool open(const std::string& path, int64_t length, int64_t limit);
+
+    // the bytes of data that belong to the body are written, returns how many
+    size_t take(const char* data, size_t len);
+
+    // payload that can go straight from the socket to the file
+    bool spliceable();
+    // splice up to max bytes of it from sockfd: the count, 0 at the end of the stream,
+    // -1 with errno set by the socket. Trouble with the file ends the upload as FAILED
+    ssize_t splice_from(int sockfd, off_t max);
+
+    bool commit();  // move the complete body into place
+
+    STATUS status() const { return m_status; }
+    bool receiving() const { return m_status == RECEIVING; }
+    bool created() const { return m_created; }  // the target didn't exist before
+    int64_t received() const { return m_received; }
+
+private:
+    void store(const char* data, size_t len);
+    void advance(uint64_t payload);
+
+    STATUS m_status;
+    int m_fd;
+    int m_pipe[2];
+    bool m_pipe_failed;     // no pipe to be had, everything goes through take()
+    bool m_chunked;
+    bool m_created;
+    int64_t m_left;         // of an identity body
+    int64_t m_received;     // payload bytes
+    chunked_decoder m_decoder;
+    std::string m_path;
+    std::string m_temp;     // empty once it is renamed or removed
+};
+
+#endif